@@ -0,0 +1,23 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdio.h>
+#include <time.h>
+#include "types.h"
+
+// shared by all benchmark and stress test executables
+
+static inline f64 now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+// one line per result: benchmark, threads, value, unit (tab separated)
+static inline void report(const char *name, unsigned int threads, f64 value, const char *unit)
+{
+	printf("%s\t%u\t%.2f\t%s\n", name, threads, value, unit);
+}
+
+#endif // _BENCH_H_
@@ -0,0 +1,98 @@
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "bench/bench.h"
+#include "server/voxel_depth_search.h"
+
+// shape of a big oak tree: a thick trunk, a few branches and a large crown of leaves
+#define TRUNK_HEIGHT 32
+#define TRUNK_RADIUS 1
+#define BRANCH_LENGTH 10
+#define CROWN_RADIUS 12
+
+typedef struct {
+	s32 trunk_start; // lowest node of the trunk, the tree floats if this is above the ground
+	size_t visited;
+} TreeShape;
+
+static f64 duration = 0.5;
+
+static bool is_tree(TreeShape *shape, v3s32 pos)
+{
+	// trunk
+	if (abs(pos.x) <= TRUNK_RADIUS && abs(pos.z) <= TRUNK_RADIUS && pos.y >= shape->trunk_start && pos.y < TRUNK_HEIGHT)
+		return true;
+
+	// branches, along the diagonals at a third and two thirds of the trunk
+	if ((pos.y == TRUNK_HEIGHT / 3 || pos.y == TRUNK_HEIGHT * 2 / 3) && abs(pos.x) == abs(pos.z) && abs(pos.x) <= BRANCH_LENGTH)
+		return true;
+
+	// crown
+	v3s32 center = {0, TRUNK_HEIGHT, 0};
+	s32 dx = pos.x - center.x, dy = pos.y - center.y, dz = pos.z - center.z;
+	return dx * dx + dy * dy + dz * dz <= CROWN_RADIUS * CROWN_RADIUS;
+}
+
+static void search_callback(DepthSearchNode *node, TreeShape *shape)
+{
+	shape->visited++;
+
+	if (node->pos.y < 0)
+		node->type = DEPTH_SEARCH_TARGET;
+	else if (is_tree(shape, node->pos))
+		node->type = DEPTH_SEARCH_PATH;
+	else
+		node->type = DEPTH_SEARCH_BLOCK;
+}
+
+// search from the top of the crown, and from starts around it like tree_physics_check does after removing a node
+static void bench_search(const char *name, s32 trunk_start, size_t budget, int starts)
+{
+	TreeShape shape = {trunk_start, 0};
+	unsigned long count = 0;
+	bool success[starts];
+
+	f64 start = now();
+	while (now() - start < duration) {
+		DepthSearch search;
+		voxel_depth_search_ini(&search, budget);
+
+		for (int i = 0; i < starts; i++)
+			voxel_depth_search(&search, (v3s32) {i % 3 - 1, TRUNK_HEIGHT + CROWN_RADIUS - 1 - i / 3, 0},
+				(void *) &search_callback, &shape, &success[i]);
+
+		voxel_depth_search_dst(&search);
+		count++;
+	}
+	f64 elapsed = now() - start;
+
+	report(name, 1, count / elapsed, "searches/s");
+	report(name, 1, shape.visited / elapsed / 1.0e6, "Mnodes/s");
+}
+
+int main(int argc, char **argv)
+{
+	struct option long_options[] = {
+		{"duration", required_argument, 0, 'd' },
+		{}
+	};
+
+	int option;
+	while ((option = getopt_long(argc, argv, "d:", long_options, NULL)) != -1) {
+		switch (option) {
+			case 'd': duration = atof(optarg); break;
+		}
+	}
+
+	// ground is found quickly, downwards first
+	bench_search("depth_search_grounded", 0, 0, 1);
+	// the whole tree has to be visited
+	bench_search("depth_search_floating", 1, 0, 1);
+	// later searches reuse the nodes of the first one
+	bench_search("depth_search_floating_multi", 1, 0, 6);
+	// the search gives up early
+	bench_search("depth_search_floating_budget", 1, 1024, 1);
+
+	return EXIT_SUCCESS;
+}
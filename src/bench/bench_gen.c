@@ -0,0 +1,232 @@
+#include <assert.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bench/bench.h"
+#include "common/perlin.h"
+#include "common/terrain.h"
+#include "server/database.h"
+#include "server/server_config.h"
+#include "server/server_player.h"
+#include "server/server_terrain.h"
+#include "server/terrain_gen.h"
+
+static const char *biome_names[COUNT_BIOME] = {
+	"mountain",
+	"ocean",
+	"hills",
+};
+
+// same order as tree_def
+static const char *tree_names[NUM_TREES] = {
+	"oak",
+	"pine",
+	"palm",
+};
+
+static const char *world_files[] = {
+	"terrain.sqlite",
+	"meta.sqlite",
+	"players.sqlite",
+};
+
+// FNV-1a
+static void hash_bytes(u64 *hash, const void *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++) {
+		*hash ^= ((const u8 *) data)[i];
+		*hash *= 0x100000001B3;
+	}
+}
+
+// hash of the types and data of all nodes in the region, chunk by chunk in a fixed order
+static u64 hash_region(v3s32 min, v3s32 max)
+{
+	u64 hash = 0xCBF29CE484222325;
+
+	for (s32 x = min.x; x <= max.x; x++)
+	for (s32 y = min.y; y <= max.y; y++)
+	for (s32 z = min.z; z <= max.z; z++) {
+		TerrainChunk *chunk = terrain_get_chunk(server_terrain, (v3s32) {x, y, z}, CHUNK_MODE_PASSIVE);
+
+		if (!chunk) {
+			fprintf(stderr, "[warning] chunk at (%d, %d, %d) was not generated\n", x, y, z);
+			continue;
+		}
+
+		assert(pthread_rwlock_rdlock(&chunk->lock) == 0);
+
+		CHUNK_ITERATE {
+			TerrainNode node = terrain_chunk_get_node(chunk, (v3s32) {x, y, z});
+			u32 type = node.type;
+
+			hash_bytes(&hash, &type, sizeof type);
+			if (node_def[node.type].has_data)
+				hash_bytes(&hash, node.data, sizeof node.data);
+		}
+
+		pthread_rwlock_unlock(&chunk->lock);
+	}
+
+	return hash;
+}
+
+// compare the tile noise functions with the single sample functions they replace, bit by bit
+static bool check_noise()
+{
+	unsigned int rand_seed = 1;
+	size_t mismatches = 0;
+
+	for (int i = 0; i < 256; i++) {
+		v2s32 pos = {rand_r(&rand_seed) % 200000 - 100000, rand_r(&rand_seed) % 200000 - 100000};
+		// odd sizes as well, so the parts of rows that don't fill a whole vector are covered
+		v2s32 size = {1 + rand_r(&rand_seed) % CHUNK_SIZE, 1 + rand_r(&rand_seed) % CHUNK_SIZE};
+		f64 scale = (f64[]) {32.0, 128.0, 256.0, 500.0}[i % 4];
+		int noise_seed = seed + rand_r(&rand_seed) % COUNT_BIOME;
+
+		f64 tile[size.x * size.y];
+
+		smooth2d_tile(tile, pos, size, scale, 0, noise_seed);
+		for (s32 x = 0; x < size.x; x++)
+		for (s32 z = 0; z < size.y; z++) {
+			f64 expected = smooth2d(U32(pos.x + x) / scale, U32(pos.y + z) / scale, 0, noise_seed);
+			mismatches += memcmp(&tile[x * size.y + z], &expected, sizeof expected) != 0;
+		}
+
+		pnoise2d_tile(tile, pos, size, scale, 0.45, 5, noise_seed);
+		for (s32 x = 0; x < size.x; x++)
+		for (s32 z = 0; z < size.y; z++) {
+			f64 expected = pnoise2d(U32(pos.x + x) / scale, U32(pos.y + z) / scale, 0.45, 5, noise_seed);
+			mismatches += memcmp(&tile[x * size.y + z], &expected, sizeof expected) != 0;
+		}
+	}
+
+	printf("noise_kernel\t1\t%s\tkernel\n", perlin_tile_kernel());
+
+	if (mismatches > 0)
+		fprintf(stderr, "[error] %zu samples of the %s noise kernel differ from the perlin library\n", mismatches, perlin_tile_kernel());
+
+	return mismatches == 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int threads = server_config.terrain_gen_threads;
+	v3s32 size = {12, 8, 12};
+	s32 bottom = -3;
+	char *world_path = NULL;
+
+	struct option long_options[] = {
+		{"threads", required_argument, 0, 't' },
+		{"region",  required_argument, 0, 'r' },
+		{"bottom",  required_argument, 0, 'b' },
+		{"seed",    required_argument, 0, 's' },
+		{"world",   required_argument, 0, 'w' },
+		{}
+	};
+
+	int option;
+	while ((option = getopt_long(argc, argv, "t:r:b:s:w:", long_options, NULL)) != -1) {
+		switch (option) {
+			case 't': threads = atoi(optarg); break;
+			case 'b': bottom = atoi(optarg); break;
+			case 's': seed = atoi(optarg); break;
+			case 'w': world_path = optarg; break;
+
+			case 'r':
+				if (sscanf(optarg, "%dx%dx%d", &size.x, &size.y, &size.z) != 3) {
+					fprintf(stderr, "[error] invalid region %s, expected NxMxK\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+		}
+	}
+
+	if (threads < 1)
+		threads = 1;
+
+	// generated terrain has to be the same no matter which noise kernel is used
+	if (!check_noise())
+		return EXIT_FAILURE;
+
+	// region is centered around the spawn, it starts at bottom (in chunks)
+	v3s32 min = {-size.x / 2, bottom, -size.z / 2};
+	v3s32 max = {min.x + size.x - 1, min.y + size.y - 1, min.z + size.z - 1};
+
+	// use a fresh temporary world unless one is given, so nothing is loaded instead of generated
+	char temp_path[] = "/tmp/dragonblocks-genbench-XXXXXX";
+	bool temp_world = !world_path;
+
+	if (temp_world && !(world_path = mkdtemp(temp_path))) {
+		perror("[error] failed to create temporary world");
+		return EXIT_FAILURE;
+	}
+
+	server_config.terrain_gen_threads = threads;
+	// there are no players, keep all chunks in memory
+	server_config.max_loaded_chunks = UINT_MAX;
+
+	s32 fixed_seed = seed;
+	database_init(world_path);
+	seed = fixed_seed;
+	database_save_meta("seed", seed);
+
+	server_player_init();
+	server_terrain_init();
+	terrain_gen_profile_enable(true);
+
+	f64 start = now();
+
+	for (s32 x = min.x; x <= max.x; x++)
+	for (s32 y = min.y; y <= max.y; y++)
+	for (s32 z = min.z; z <= max.z; z++)
+		server_terrain_generate_chunk((v3s32) {x, y, z});
+
+	while (server_terrain_num_gen_chunks() > 0)
+		usleep(1000);
+
+	f64 elapsed = now() - start;
+	TerrainGenProfile profile = terrain_gen_profile();
+
+	report("generate", threads, profile.chunks / elapsed, "chunks/s");
+	report("generate_uniform", threads, 100.0 * profile.uniform_chunks / profile.chunks, "%");
+
+	// thread time, summed over all generation threads
+	for (Biome i = 0; i < COUNT_BIOME; i++) {
+		char name[64];
+		snprintf(name, sizeof name, "biome_%s", biome_names[i]);
+		report(name, threads, profile.biome_ns[i] / 1.0e6, "ms");
+	}
+
+	for (int i = 0; i < NUM_TREES; i++) {
+		char name[64];
+		snprintf(name, sizeof name, "tree_%s", tree_names[i]);
+		report(name, threads, profile.tree_ns[i] / 1.0e6, "ms");
+		report(name, threads, profile.trees[i], "trees");
+	}
+
+	// generation does not depend on thread timing, runs with different numbers of threads have the same hash
+	printf("content_hash\t%u\t%016" PRIx64 "\tfnv1a\n", threads, hash_region(min, max));
+
+	server_player_deinit();
+	server_terrain_deinit();
+	database_deinit();
+
+	if (temp_world) {
+		for (size_t i = 0; i < sizeof world_files / sizeof *world_files; i++) {
+			char path[strlen(world_path) + 1 + strlen(world_files[i]) + 1];
+			sprintf(path, "%s/%s", world_path, world_files[i]);
+			unlink(path);
+		}
+
+		rmdir(world_path);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,329 @@
+#include <assert.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bench/bench.h"
+#include "common/terrain.h"
+
+// size of the populated area, in chunks
+#define AREA_X 16
+#define AREA_Y 8
+#define AREA_Z 16
+
+typedef enum {
+	MIX_AIR,     // empty chunk above ground
+	MIX_STONE,   // uniform chunk below ground
+	MIX_SURFACE, // layered terrain with a surface
+	MIX_FOREST,  // surface with trees, leaves carry data
+	MIX_NOISE,   // random nodes, worst case for compression
+	COUNT_MIX,
+} ChunkMix;
+
+static const char *mix_names[COUNT_MIX] = {
+	"air",
+	"stone",
+	"surface",
+	"forest",
+	"noise",
+};
+
+typedef struct {
+	unsigned int id;
+	unsigned int seed;
+	unsigned long ops;
+	pthread_t thread;
+} Worker;
+
+static Terrain *terrain;
+static f64 duration = 0.5;
+static atomic_bool stop;
+
+static v3s32 random_chunkp(unsigned int *seed)
+{
+	return (v3s32) {rand_r(seed) % AREA_X, rand_r(seed) % AREA_Y, rand_r(seed) % AREA_Z};
+}
+
+static v3s32 random_nodep(unsigned int *seed)
+{
+	return (v3s32) {
+		rand_r(seed) % (AREA_X * CHUNK_SIZE),
+		rand_r(seed) % (AREA_Y * CHUNK_SIZE),
+		rand_r(seed) % (AREA_Z * CHUNK_SIZE),
+	};
+}
+
+static void fill_chunk(TerrainChunk *chunk, ChunkMix mix, unsigned int seed)
+{
+	switch (mix) {
+		case MIX_AIR:
+			terrain_chunk_fill(chunk, NODE_AIR);
+			return;
+
+		case MIX_STONE:
+			terrain_chunk_fill(chunk, NODE_STONE);
+			return;
+
+		default:
+			break;
+	}
+
+	CHUNK_ITERATE {
+		TerrainNode node = {.type = NODE_AIR};
+		s32 height = 8 + (x + z) % 3;
+
+		if (mix == MIX_NOISE)
+			node.type = NODE_GRASS + rand_r(&seed) % (COUNT_NODE - NODE_GRASS);
+		else if (y < height - 3)
+			node.type = NODE_STONE;
+		else if (y < height - 1)
+			node.type = NODE_DIRT;
+		else if (y < height)
+			node.type = NODE_GRASS;
+		else if (mix == MIX_FOREST && y > height + 3 && rand_r(&seed) % 3 == 0)
+			node.type = NODE_OAK_LEAVES;
+
+		if (node_def[node.type].has_data)
+			memset(node.data, rand_r(&seed) & 0xFF, sizeof node.data);
+
+		terrain_chunk_set_node(chunk, (v3s32) {x, y, z}, node);
+	}
+}
+
+static void populate()
+{
+	unsigned int seed = 1;
+
+	for (s32 x = 0; x < AREA_X; x++)
+	for (s32 y = 0; y < AREA_Y; y++)
+	for (s32 z = 0; z < AREA_Z; z++) {
+		TerrainChunk *chunk = terrain_get_chunk(terrain, (v3s32) {x, y, z}, CHUNK_MODE_CREATE);
+		ChunkMix mix = y < AREA_Y / 2 - 1 ? MIX_STONE : y == AREA_Y / 2 - 1 ? MIX_SURFACE + rand_r(&seed) % 2 : MIX_AIR;
+
+		// sprinkle in some worst case chunks
+		if (rand_r(&seed) % 16 == 0)
+			mix = MIX_NOISE;
+
+		assert(pthread_rwlock_wrlock(&chunk->lock) == 0);
+		fill_chunk(chunk, mix, rand_r(&seed));
+		pthread_rwlock_unlock(&chunk->lock);
+	}
+}
+
+// run func on threads workers until duration has passed, returns total operations per second
+static f64 run_threads(unsigned int threads, void *(*func)(Worker *))
+{
+	Worker workers[threads];
+	atomic_store(&stop, false);
+
+	f64 start = now();
+
+	for (unsigned int i = 0; i < threads; i++) {
+		workers[i].id = i;
+		workers[i].seed = i + 1;
+		workers[i].ops = 0;
+		pthread_create(&workers[i].thread, NULL, (void *) func, &workers[i]);
+	}
+
+	usleep(duration * 1.0e6);
+	atomic_store(&stop, true);
+
+	unsigned long ops = 0;
+	for (unsigned int i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ops += workers[i].ops;
+	}
+
+	return ops / (now() - start);
+}
+
+// workers check the stop flag every this many operations
+#define BATCH 1024
+
+static void *bench_chunkp(Worker *worker)
+{
+	s32 sum = 0;
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		for (int i = 0; i < BATCH; i++) {
+			v3s32 pos = {rand_r(&worker->seed) - RAND_MAX / 2, i, -i};
+			v3s32 chunkp = terrain_chunkp(pos);
+			v3s32 offset = terrain_offset(pos);
+			sum += chunkp.x + offset.x;
+		}
+
+		worker->ops += BATCH;
+	}
+
+	// keep the compiler from optimizing the loop away
+	return (void *) (size_t) sum;
+}
+
+static void *bench_get_chunk(Worker *worker)
+{
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		for (int i = 0; i < BATCH; i++)
+			terrain_get_chunk(terrain, random_chunkp(&worker->seed), CHUNK_MODE_PASSIVE);
+
+		worker->ops += BATCH;
+	}
+
+	return NULL;
+}
+
+// lookups walk along a line of nodes, like most code that reads terrain does
+static void *bench_get_node(Worker *worker)
+{
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		v3s32 pos = random_nodep(&worker->seed);
+
+		for (int i = 0; i < BATCH; i++)
+			terrain_get_node(terrain, (v3s32) {pos.x, pos.y, (pos.z + i) % (AREA_Z * CHUNK_SIZE)});
+
+		worker->ops += BATCH;
+	}
+
+	return NULL;
+}
+
+// all workers modify nodes in the same few chunks
+static void *bench_contention(Worker *worker)
+{
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		for (int i = 0; i < BATCH; i++) {
+			v3s32 offset;
+			TerrainChunk *chunk = terrain_get_chunk_nodep(terrain,
+				(v3s32) {rand_r(&worker->seed) % (2 * CHUNK_SIZE), AREA_Y / 2 * CHUNK_SIZE, rand_r(&worker->seed) % CHUNK_SIZE},
+				&offset, CHUNK_MODE_PASSIVE);
+
+			assert(pthread_rwlock_wrlock(&chunk->lock) == 0);
+			NodeType type = terrain_chunk_get_type(chunk, offset);
+			terrain_chunk_set_node(chunk, offset, (TerrainNode) {.type = type == NODE_AIR ? NODE_STONE : NODE_AIR});
+			pthread_rwlock_unlock(&chunk->lock);
+		}
+
+		worker->ops += BATCH;
+	}
+
+	return NULL;
+}
+
+// the first worker modifies the chunks used by bench_contention, the others read them without locking
+static void *bench_contention_read(Worker *worker)
+{
+	if (worker->id == 0)
+		return bench_contention(worker);
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		for (int i = 0; i < BATCH; i++)
+			terrain_get_node(terrain, (v3s32) {rand_r(&worker->seed) % (2 * CHUNK_SIZE), AREA_Y / 2 * CHUNK_SIZE, rand_r(&worker->seed) % CHUNK_SIZE});
+
+		worker->ops += BATCH;
+	}
+
+	return NULL;
+}
+
+static void bench_serialize()
+{
+	Terrain *scratch = terrain_create();
+	scratch->callbacks.create_chunk = NULL;
+	scratch->callbacks.delete_chunk = NULL;
+	scratch->callbacks.get_chunk = NULL;
+
+	for (ChunkMix mix = 0; mix < COUNT_MIX; mix++) {
+		TerrainChunk *chunk = terrain_get_chunk(scratch, (v3s32) {mix, 0, 0}, CHUNK_MODE_CREATE);
+		TerrainChunk *copy = terrain_get_chunk(scratch, (v3s32) {mix, 1, 0}, CHUNK_MODE_CREATE);
+		fill_chunk(chunk, mix, mix + 1);
+
+		char name[64];
+		size_t bytes = 0;
+		unsigned long count = 0;
+
+		f64 start = now();
+		while (now() - start < duration) {
+			Blob buffer = terrain_serialize_chunk(scratch, chunk, NULL);
+			bytes += buffer.siz;
+			count++;
+			Blob_free(&buffer);
+		}
+		f64 elapsed = now() - start;
+
+		Blob buffer = terrain_serialize_chunk(scratch, chunk, NULL);
+
+		snprintf(name, sizeof name, "serialize_%s", mix_names[mix]);
+		report(name, 1, count / elapsed, "chunks/s");
+		report(name, 1, bytes / elapsed / 1.0e6, "MB/s");
+
+		snprintf(name, sizeof name, "serialized_size_%s", mix_names[mix]);
+		report(name, 1, buffer.siz, "bytes");
+
+		bytes = 0;
+		count = 0;
+
+		start = now();
+		while (now() - start < duration) {
+			terrain_deserialize_chunk(scratch, copy, buffer, NULL);
+			bytes += buffer.siz;
+			count++;
+		}
+		elapsed = now() - start;
+
+		snprintf(name, sizeof name, "deserialize_%s", mix_names[mix]);
+		report(name, 1, count / elapsed, "chunks/s");
+		report(name, 1, bytes / elapsed / 1.0e6, "MB/s");
+
+		Blob_free(&buffer);
+	}
+
+	terrain_delete(scratch);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	struct option long_options[] = {
+		{"threads",  required_argument, 0, 't' },
+		{"duration", required_argument, 0, 'd' },
+		{}
+	};
+
+	int option;
+	while ((option = getopt_long(argc, argv, "t:d:", long_options, NULL)) != -1) {
+		switch (option) {
+			case 't': max_threads = atoi(optarg); break;
+			case 'd': duration = atof(optarg); break;
+		}
+	}
+
+	if (max_threads < 1)
+		max_threads = 1;
+
+	terrain = terrain_create();
+	terrain->callbacks.create_chunk = NULL;
+	terrain->callbacks.delete_chunk = NULL;
+	terrain->callbacks.get_chunk = NULL;
+
+	populate();
+
+	// thread counts double up to max_threads, which is always included
+	for (unsigned int threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+		report("chunkp_offset", threads, run_threads(threads, &bench_chunkp), "ops/s");
+		report("get_chunk", threads, run_threads(threads, &bench_get_chunk), "ops/s");
+		report("get_node", threads, run_threads(threads, &bench_get_node), "ops/s");
+		report("contention_write", threads, run_threads(threads, &bench_contention), "ops/s");
+		report("contention_read", threads, run_threads(threads, &bench_contention_read), "ops/s");
+
+		if (threads == max_threads)
+			break;
+	}
+
+	bench_serialize();
+
+	terrain_delete(terrain);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,364 @@
+#include <assert.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bench/bench.h"
+#include "common/terrain.h"
+
+// size of the area writers and readers work on, in chunks, small so they collide a lot
+#define AREA_X 2
+#define AREA_Y 1
+#define AREA_Z 2
+
+// nodes changed by a writer per locked round
+#define ROUND 64
+// at most this many mismatches are printed
+#define MAX_PRINTED 16
+// time between eviction passes in microseconds, the server and the client evict about once per second
+// readers don't register anywhere, the grace period of TERRAIN_EVICT_GRACE passes is what keeps them safe,
+// so passes must not be closer together than in production
+#define EVICT_INTERVAL 1000000
+// the evicter checks the stop flag this often while waiting, in microseconds
+#define STOP_INTERVAL 10000
+
+/*
+	Seqlock stress test:
+	- writers lock random chunks and change nodes, fill them or serialize them and compare the result
+	- readers use the optimistic accessors without locking and check every node they get
+	- the data of nodes that carry data encodes their position and type, so a reader that mixes up
+	  the type of one write with the data of another (or reads from a freed array) sees a mismatch
+	- another thread calls terrain_evict at the same rate as production, so arrays retired by writers are actually freed
+	- exits with failure if any mismatch was found
+*/
+
+typedef struct {
+	unsigned int id;
+	unsigned int seed;
+	unsigned long ops;
+	pthread_t thread;
+} Worker;
+
+static const NodeType types[] = {
+	NODE_AIR,
+	NODE_STONE,
+	NODE_DIRT,
+	NODE_OAK_LEAVES,
+	NODE_PINE_LEAVES,
+};
+
+#define NUM_TYPES (sizeof types / sizeof *types)
+
+static Terrain *terrain;
+static Terrain *scratch;
+static f64 duration = 10.0;
+static atomic_bool stop;
+static atomic_ulong mismatches;
+
+static void mismatch(const char *where, v3s32 pos, const char *what)
+{
+	if (atomic_fetch_add(&mismatches, 1) < MAX_PRINTED)
+		fprintf(stderr, "[error] %s: %s at (%d, %d, %d)\n", where, what, pos.x, pos.y, pos.z);
+}
+
+static bool valid_type(NodeType type)
+{
+	for (size_t i = 0; i < NUM_TYPES; i++)
+		if (types[i] == type)
+			return true;
+
+	return false;
+}
+
+static u32 pattern(v3s32 pos, NodeType type)
+{
+	return ((u32) pos.x * 73856093u) ^ ((u32) pos.y * 19349663u) ^ ((u32) pos.z * 83492791u) ^ (u32) type;
+}
+
+// node at pos (in nodes) with data that identifies it, version changes with every write
+static TerrainNode make_node(v3s32 pos, NodeType type, u32 version)
+{
+	TerrainNode node = {.type = type};
+
+	if (node_def[type].has_data) {
+		u32 check = pattern(pos, type);
+		memcpy(&node.data[0], &check, sizeof check);
+		memset(&node.data[sizeof check], version & 0xFF, sizeof node.data - sizeof check);
+	}
+
+	return node;
+}
+
+static void check_node(const char *where, v3s32 pos, TerrainNode node)
+{
+	if (!valid_type(node.type)) {
+		mismatch(where, pos, "invalid type");
+		return;
+	}
+
+	if (!node_def[node.type].has_data)
+		return;
+
+	u32 check;
+	memcpy(&check, &node.data[0], sizeof check);
+
+	if (check != pattern(pos, node.type)) {
+		mismatch(where, pos, "data does not match type and position");
+		return;
+	}
+
+	// the rest of the data is written at once, so it has to be the same byte everywhere
+	for (size_t i = sizeof check + 1; i < sizeof node.data; i++)
+		if (node.data[i] != node.data[sizeof check]) {
+			mismatch(where, pos, "torn data");
+			return;
+		}
+}
+
+static v3s32 random_offset(unsigned int *seed)
+{
+	return (v3s32) {rand_r(seed) % CHUNK_SIZE, rand_r(seed) % CHUNK_SIZE, rand_r(seed) % CHUNK_SIZE};
+}
+
+static v3s32 random_nodep(unsigned int *seed)
+{
+	return (v3s32) {
+		rand_r(seed) % (AREA_X * CHUNK_SIZE),
+		rand_r(seed) % (AREA_Y * CHUNK_SIZE),
+		rand_r(seed) % (AREA_Z * CHUNK_SIZE),
+	};
+}
+
+// node data is stored as it is, the server does the same with the actual data types
+static void serialize_data(TerrainNode *node, Blob *buffer)
+{
+	for (size_t i = 0; i < sizeof node->data; i++)
+		u8_write(buffer, &node->data[i]);
+}
+
+static void deserialize_data(TerrainNode *node, Blob buffer)
+{
+	for (size_t i = 0; i < sizeof node->data; i++)
+		if (!u8_read(&buffer, &node->data[i]))
+			return;
+}
+
+// serialize a chunk and check that it deserializes to the same nodes, chunk has to be locked
+static void check_serialize(TerrainChunk *chunk, TerrainChunk *copy)
+{
+	Blob buffer = terrain_serialize_chunk(terrain, chunk, &serialize_data);
+
+	if (!terrain_deserialize_chunk(scratch, copy, buffer, &deserialize_data)) {
+		mismatch("serialize", chunk->pos, "failed deserializing chunk");
+		Blob_free(&buffer);
+		return;
+	}
+
+	Blob_free(&buffer);
+
+	CHUNK_ITERATE {
+		v3s32 offset = {x, y, z};
+		TerrainNode expected = terrain_chunk_get_node(chunk, offset);
+		TerrainNode node = terrain_chunk_get_node(copy, offset);
+
+		if (node.type != expected.type || (node_def[node.type].has_data
+				&& memcmp(node.data, expected.data, sizeof node.data) != 0)) {
+			mismatch("serialize", v3s32_add(v3s32_scale(chunk->pos, CHUNK_SIZE), offset), "node changed by serialization");
+			return;
+		}
+	}
+}
+
+static void *writer(Worker *worker)
+{
+	TerrainChunk *copy = terrain_get_chunk(scratch, (v3s32) {worker->id, 0, 0}, CHUNK_MODE_CREATE);
+	u32 version = 0;
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		v3s32 chunkp = {rand_r(&worker->seed) % AREA_X, rand_r(&worker->seed) % AREA_Y, rand_r(&worker->seed) % AREA_Z};
+		TerrainChunk *chunk = terrain_get_chunk(terrain, chunkp, CHUNK_MODE_PASSIVE);
+		int op = rand_r(&worker->seed) % 100;
+
+		assert(pthread_rwlock_wrlock(&chunk->lock) == 0);
+
+		if (op < 2) {
+			terrain_chunk_fill(chunk, rand_r(&worker->seed) % 2 ? NODE_AIR : NODE_STONE);
+		} else if (op < 4) {
+			check_serialize(chunk, copy);
+		} else for (int i = 0; i < ROUND; i++) {
+			v3s32 offset = random_offset(&worker->seed);
+			v3s32 pos = v3s32_add(v3s32_scale(chunkp, CHUNK_SIZE), offset);
+			NodeType type = types[rand_r(&worker->seed) % NUM_TYPES];
+
+			terrain_chunk_set_node(chunk, offset, make_node(pos, type, version++));
+		}
+
+		pthread_rwlock_unlock(&chunk->lock);
+		worker->ops++;
+	}
+
+	return NULL;
+}
+
+static void *reader(Worker *worker)
+{
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		switch (rand_r(&worker->seed) % 3) {
+			case 0: {
+				v3s32 pos = random_nodep(&worker->seed);
+				check_node("terrain_get_node", pos, terrain_get_node(terrain, pos));
+				break;
+			}
+
+			case 1: {
+				v3s32 offset;
+				v3s32 pos = random_nodep(&worker->seed);
+				TerrainChunk *chunk = terrain_get_chunk_nodep(terrain, pos, &offset, CHUNK_MODE_PASSIVE);
+				check_node("terrain_chunk_read_node", pos, terrain_chunk_read_node(chunk, offset));
+				break;
+			}
+
+			case 2: {
+				// boxes span chunk borders most of the time
+				v3s32 min = random_nodep(&worker->seed);
+				aabb3s32 box = {min, {min.x + 7, min.y + 7, min.z + 7}};
+				box.max = v3s32_clamp(box.max, min, (v3s32) {AREA_X * CHUNK_SIZE - 1, AREA_Y * CHUNK_SIZE - 1, AREA_Z * CHUNK_SIZE - 1});
+
+				NodeType buffer[8 * 8 * 8];
+				terrain_read_box(terrain, box, buffer);
+
+				for (size_t i = 0; i < terrain_box_volume(box); i++)
+					if (!valid_type(buffer[i])) {
+						mismatch("terrain_read_box", box.min, "invalid type in box");
+						break;
+					}
+
+				break;
+			}
+		}
+
+		worker->ops++;
+	}
+
+	return NULL;
+}
+
+// frees arrays retired by writers, no chunks are evicted
+static void *evicter(__attribute__((unused)) void *arg)
+{
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		for (int i = 0; i < EVICT_INTERVAL / STOP_INTERVAL && !atomic_load_explicit(&stop, memory_order_relaxed); i++)
+			usleep(STOP_INTERVAL);
+
+		terrain_evict(terrain, 0, NULL, NULL);
+	}
+
+	return NULL;
+}
+
+static void populate()
+{
+	unsigned int seed = 1;
+
+	for (s32 cx = 0; cx < AREA_X; cx++)
+	for (s32 cy = 0; cy < AREA_Y; cy++)
+	for (s32 cz = 0; cz < AREA_Z; cz++) {
+		v3s32 chunkp = {cx, cy, cz};
+		TerrainChunk *chunk = terrain_get_chunk(terrain, chunkp, CHUNK_MODE_CREATE);
+
+		assert(pthread_rwlock_wrlock(&chunk->lock) == 0);
+
+		CHUNK_ITERATE {
+			v3s32 offset = {x, y, z};
+			v3s32 pos = v3s32_add(v3s32_scale(chunkp, CHUNK_SIZE), offset);
+			terrain_chunk_set_node(chunk, offset, make_node(pos, types[rand_r(&seed) % NUM_TYPES], 0));
+		}
+
+		pthread_rwlock_unlock(&chunk->lock);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	struct option long_options[] = {
+		{"threads",  required_argument, 0, 't' },
+		{"duration", required_argument, 0, 'd' },
+		{}
+	};
+
+	int option;
+	while ((option = getopt_long(argc, argv, "t:d:", long_options, NULL)) != -1) {
+		switch (option) {
+			case 't': threads = atoi(optarg); break;
+			case 'd': duration = atof(optarg); break;
+		}
+	}
+
+	// at least one writer and one reader
+	if (threads < 2)
+		threads = 2;
+
+	terrain = terrain_create();
+	terrain->callbacks.create_chunk = NULL;
+	terrain->callbacks.delete_chunk = NULL;
+	terrain->callbacks.get_chunk = NULL;
+
+	scratch = terrain_create();
+	scratch->callbacks.create_chunk = NULL;
+	scratch->callbacks.delete_chunk = NULL;
+	scratch->callbacks.get_chunk = NULL;
+
+	populate();
+
+	// a quarter of the threads write, the rest read
+	unsigned int writers = threads / 4 > 0 ? threads / 4 : 1;
+	Worker workers[threads];
+	pthread_t evict_thread;
+
+	atomic_store(&stop, false);
+	atomic_store(&mismatches, 0);
+
+	f64 start = now();
+
+	for (unsigned int i = 0; i < threads; i++) {
+		workers[i].id = i;
+		workers[i].seed = i + 1;
+		workers[i].ops = 0;
+		pthread_create(&workers[i].thread, NULL, (void *) (i < writers ? &writer : &reader), &workers[i]);
+	}
+
+	pthread_create(&evict_thread, NULL, &evicter, NULL);
+
+	usleep(duration * 1.0e6);
+	atomic_store(&stop, true);
+
+	unsigned long write_ops = 0, read_ops = 0;
+	for (unsigned int i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		*(i < writers ? &write_ops : &read_ops) += workers[i].ops;
+	}
+
+	pthread_join(evict_thread, NULL);
+
+	f64 elapsed = now() - start;
+	unsigned long failed = atomic_load(&mismatches);
+
+	report("seqlock_write", writers, write_ops / elapsed, "rounds/s");
+	report("seqlock_read", threads - writers, read_ops / elapsed, "ops/s");
+	report("seqlock_mismatches", threads, failed, "mismatches");
+
+	terrain_delete(scratch);
+	terrain_delete(terrain);
+
+	if (failed > 0) {
+		fprintf(stderr, "[error] seqlock stress test found %lu mismatches\n", failed);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
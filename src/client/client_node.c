@@ -8,6 +8,8 @@
 #include "common/node.h"
 #include "common/perlin.h"
 
+_Static_assert(sizeof(ColorData) <= TERRAIN_NODE_DATA_SIZE, "ColorData does not fit into TerrainNode");
+
 #define TILES_SIMPLE(path) {.paths = {path, NULL, NULL, NULL, NULL, NULL}, .indices = {0, 0, 0, 0, 0, 0}, .textures = {}, .x4 = {}}
 #define TILES_NONE {.paths = {NULL}, .indices = {0}, .textures = {}, .x4 = {}}
 
@@ -243,23 +245,11 @@ void client_node_deinit()
 	texture_destroy(&client_node_atlas);
 }
 
-void client_node_delete(TerrainNode *node)
-{
-	switch (node->type) {
-		NODES_TREE
-			free(node->data);
-			break;
-
-		default:
-			break;
-	}
-}
-
 void client_node_deserialize(TerrainNode *node, Blob buffer)
 {
 	switch (node->type) {
 		NODES_TREE
-			ColorData_read(&buffer, node->data = malloc(sizeof(ColorData)));
+			ColorData_read(&buffer, (ColorData *) node->data);
 			break;
 
 		default:
@@ -39,7 +39,6 @@ extern Texture client_node_atlas;
 void client_node_init();
 void client_node_deinit();
 
-void client_node_delete(TerrainNode *node);
 void client_node_deserialize(TerrainNode *node, Blob buffer);
 
 #endif // _CLIENT_NODE_H_
@@ -3,9 +3,11 @@
 #include <dragonstd/queue.h>
 #include <sched.h>
 #include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <time.h>
 #include "client/client.h"
 #include "client/facecache.h"
 #include "client/client_config.h"
@@ -15,8 +17,10 @@
 #include "client/debug_menu.h"
 #include "client/terrain_gfx.h"
 #include "common/facedir.h"
+#include "common/slab.h"
 
 #define MAX_REQUESTS 4
+#define UNLOAD_HYSTERESIS 2 // chunks are unloaded once they are this far outside of load distance
 
 Terrain *client_terrain;
 
@@ -26,6 +30,8 @@ static pthread_t *meshgen_threads; // consumer threads for meshgen queue
 static pthread_t sync_thread;      // this thread requests new / changed chunks from server
 static u32 load_distance;          // load distance sent by server
 static size_t load_chunks;         // cached number of facecache positions to process every sync step (matches load distance)
+static pthread_mutex_t mtx_wiring; // serializes receiving chunks and unloading them, protects neighbor references
+static Slab *meta_slab;            // chunk metadata is allocated from here
 
 // meshgen functions
 
@@ -45,13 +51,99 @@ static TerrainChunk *set_dequeued(TerrainChunk *chunk)
 	return chunk;
 }
 
+// dequeue callback for meshgen queue, drops the pin taken on enqueue if the chunk is skipped
+static TerrainChunk *dequeue_task(TerrainChunk *chunk)
+{
+	TerrainChunk *ret = set_dequeued(chunk);
+
+	if (!ret)
+		terrain_unpin_chunk(chunk);
+
+	return ret;
+}
+
 // mesh generator step
 static void meshgen_step()
 {
-	TerrainChunk *chunk = queue_deq(&meshgen_tasks, &set_dequeued);
+	TerrainChunk *chunk = queue_deq(&meshgen_tasks, &dequeue_task);
 
-	if (chunk)
+	if (chunk) {
 		terrain_gfx_make_chunk_model(chunk);
+		terrain_unpin_chunk(chunk);
+	}
+}
+
+// unload functions
+
+// flag model for deletion and remove references from and to neighbors
+// wiring mutex has to be locked
+static void unload_chunk(TerrainChunk *chunk)
+{
+	TerrainChunkMeta *meta = chunk->extra;
+
+	pthread_mutex_lock(&meta->mtx_model);
+
+	assert(pthread_rwlock_wrlock(&meta->lock_state) == 0);
+	meta->state = CHUNK_STATE_UNLOADED;
+	pthread_rwlock_unlock(&meta->lock_state);
+
+	if (meta->model) {
+		// don't let the animation callback schedule a remake
+		meta->model->extra = NULL;
+		meta->model->flags.delete = 1;
+		meta->model = NULL;
+	}
+
+	pthread_mutex_unlock(&meta->mtx_model);
+
+	for (int i = 0; i < 6; i++) {
+		TerrainChunk *neighbor = meta->neighbors[i];
+		if (!neighbor)
+			continue;
+		TerrainChunkMeta *neighbor_meta = neighbor->extra;
+
+		// this is the reverse face index
+		int j = i % 2 ? i - 1 : i + 1;
+
+		// wait for meshgen of neighbor to finish, it might be using us
+		pthread_mutex_lock(&neighbor_meta->mtx_model);
+
+		neighbor_meta->neighbors[j] = NULL;
+		neighbor_meta->num_neighbors--;
+
+		// make sure neighbor remeshes once we are received again
+		neighbor_meta->depends[j] = true;
+
+		assert(pthread_rwlock_wrlock(&neighbor_meta->lock_state) == 0);
+		if (neighbor_meta->state > CHUNK_STATE_DEPS)
+			neighbor_meta->state = CHUNK_STATE_DEPS;
+		pthread_rwlock_unlock(&neighbor_meta->lock_state);
+
+		pthread_mutex_unlock(&neighbor_meta->mtx_model);
+
+		meta->neighbors[i] = NULL;
+	}
+
+	meta->num_neighbors = 0;
+
+	// on_get_chunk rejects neighbors that went back to DEPS now, don't let cached lookups return them
+	terrain_invalidate_cache(client_terrain);
+}
+
+// eviction callback, unload chunks that are far enough outside of load distance
+// if the chunk gets pinned meanwhile, terrain_evict keeps it in the terrain as UNLOADED,
+// the sync step requests it again once it is back in range and it is wired up again when received
+static bool on_evict_chunk(TerrainChunk *chunk, v3s32 *center)
+{
+	s32 dist = load_distance + UNLOAD_HYSTERESIS;
+
+	if (abs(chunk->pos.x - center->x) <= dist
+			&& abs(chunk->pos.y - center->y) <= dist
+			&& abs(chunk->pos.z - center->z) <= dist)
+		return false;
+
+	unload_chunk(chunk);
+	return true;
 }
 
 // sync functions
@@ -85,6 +177,19 @@ static void sync_step()
 
 	u64 last_tick = tick++;
 
+	// run an unloading pass about once per second
+	static time_t last_unload = 0;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (now.tv_sec != last_unload) {
+		last_unload = now.tv_sec;
+
+		pthread_mutex_lock(&mtx_wiring);
+		terrain_evict(client_terrain, SIZE_MAX, (void *) &on_evict_chunk, &center);
+		pthread_mutex_unlock(&mtx_wiring);
+	}
+
 	v3s32 *requests = malloc(MAX_REQUESTS * sizeof *requests);
 	size_t num_requests = 0;
 
@@ -155,7 +260,7 @@ static void *loop_routine(struct LoopThread *thread)
 // allocate and initialize meta data
 static void on_create_chunk(TerrainChunk *chunk)
 {
-	TerrainChunkMeta *meta = chunk->extra = malloc(sizeof *meta);
+	TerrainChunkMeta *meta = chunk->extra = slab_alloc(meta_slab);
 
 	meta->queue = false;
 	meta->state = CHUNK_STATE_INIT;
@@ -181,7 +286,7 @@ static void on_create_chunk(TerrainChunk *chunk)
 // free meta data
 static void on_delete_chunk(TerrainChunk *chunk)
 {
-	free(chunk->extra);
+	slab_free(meta_slab, chunk->extra);
 }
 
 // callback for determining whether a chunk should be returned by terrain_get_chunk
@@ -204,14 +309,15 @@ static bool on_get_chunk(TerrainChunk *chunk, int mode)
 // called on startup
 void client_terrain_init()
 {
+	meta_slab = slab_create(sizeof(TerrainChunkMeta));
 	client_terrain = terrain_create();
 	client_terrain->callbacks.create_chunk = &on_create_chunk;
 	client_terrain->callbacks.delete_chunk = &on_delete_chunk;
 	client_terrain->callbacks.get_chunk    = &on_get_chunk;
-	client_terrain->callbacks.delete_node  = &client_node_delete;
 
 	cancel = false;
 	queue_ini(&meshgen_tasks);
+	pthread_mutex_init(&mtx_wiring, NULL);
 
 	client_terrain_set_load_distance(10); // some initial fuck idk just in case server is stupid
 
@@ -226,6 +332,8 @@ void client_terrain_deinit()
 {
 	queue_clr(&meshgen_tasks, NULL, NULL, NULL);
 	terrain_delete(client_terrain);
+	slab_delete(meta_slab);
+	pthread_mutex_destroy(&mtx_wiring);
 }
 
 // start meshgen and sync threads
@@ -272,7 +380,8 @@ void client_terrain_meshgen_task(TerrainChunk *chunk, bool changed)
 	TerrainChunkMeta *meta = chunk->extra;
 
 	assert(pthread_rwlock_wrlock(&meta->lock_state) == 0);
-	bool queue = meta->queue;
+	// unloaded chunks may still be referenced by models that are about to be deleted
+	bool queue = meta->queue || meta->state == CHUNK_STATE_UNLOADED;
 	pthread_rwlock_unlock(&meta->lock_state);
 
 	if (queue)
@@ -295,6 +404,7 @@ void client_terrain_meshgen_task(TerrainChunk *chunk, bool changed)
 		}
 	} else {
 		meta->queue = true;
+		terrain_pin_chunk(chunk);
 		if (meta->has_model && changed)
 			queue_ppd(&meshgen_tasks, chunk);
 		else
@@ -310,13 +420,16 @@ static void iterator_meshgen_task(TerrainChunk *chunk)
 
 void client_terrain_receive_chunk(__attribute__((unused)) void *peer, ToClientChunk *pkt)
 {
+	pthread_mutex_lock(&mtx_wiring);
+
 	// get/create chunk
 	TerrainChunk *chunk = terrain_get_chunk(client_terrain, pkt->pos, CHUNK_MODE_CREATE);
 	TerrainChunkMeta *meta = chunk->extra;
 
 	assert(pthread_rwlock_wrlock(&meta->lock_state) == 0);
 	// remember whether this is the first time we're receiving the chunk
-	bool init = meta->state == CHUNK_STATE_INIT;
+	// a chunk that was unloaded but stayed in the terrain because it got pinned has no neighbors either
+	bool init = meta->state <= CHUNK_STATE_INIT;
 	// change state to receiving
 	meta->state = CHUNK_STATE_RECV;
 	pthread_rwlock_unlock(&meta->lock_state);
@@ -336,6 +449,14 @@ void client_terrain_receive_chunk(__attribute__((unused)) void *peer, ToClientCh
 				continue;
 			TerrainChunkMeta *neighbor_meta = neighbor->extra;
 
+			// unloaded chunks stay unwired until they are received again themselves
+			assert(pthread_rwlock_rdlock(&neighbor_meta->lock_state) == 0);
+			bool unloaded = neighbor_meta->state == CHUNK_STATE_UNLOADED;
+			pthread_rwlock_unlock(&neighbor_meta->lock_state);
+
+			if (unloaded)
+				continue;
+
 			// initialize reference from us to neighbor
 			meta->neighbors[i] = neighbor;
 			meta->num_neighbors++;
@@ -362,6 +483,9 @@ void client_terrain_receive_chunk(__attribute__((unused)) void *peer, ToClientCh
 		}
 	}
 
+	// on_get_chunk rejects us and the neighbors that depend on us until they are dirty again
+	terrain_invalidate_cache(client_terrain);
+
 	// deserialize data
 	assert(pthread_rwlock_wrlock(&chunk->lock) == 0);
 	meta->empty = (pkt->data.siz == 0);
@@ -406,6 +530,8 @@ void client_terrain_receive_chunk(__attribute__((unused)) void *peer, ToClientCh
 		list_apd(&meshgen_tasks, neighbor);
 	}
 
+	pthread_mutex_unlock(&mtx_wiring);
+
 	// schedule meshgen tasks
 	list_clr(&meshgen_tasks, (void *) &iterator_meshgen_task, NULL, NULL);
 }
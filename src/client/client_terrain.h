@@ -10,6 +10,7 @@
 #define CHUNK_MODE_NOCREATE 2
 
 typedef enum {
+	CHUNK_STATE_UNLOADED, // unwired and waiting to be freed, or put back by a failed removal, received like a new chunk
 	CHUNK_STATE_INIT,
 	CHUNK_STATE_RECV,
 	CHUNK_STATE_DEPS,
@@ -22,7 +23,8 @@ typedef struct {
 	TerrainChunkState state;
 	pthread_rwlock_t lock_state;
 
-	// accessed only by recv thread
+	// accessed by recv thread and unloading in sync thread, protected by wiring mutex
+	// unloading also clears them with mtx_model locked since meshgen threads read them
 	TerrainChunk *neighbors[6];
 	unsigned int num_neighbors;
 
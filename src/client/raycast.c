@@ -1,21 +1,56 @@
 #include <math.h>
+#include <stdlib.h>
 #include "client/client_node.h"
 #include "client/client_terrain.h"
 #include "client/raycast.h"
 
+// boxes of up to this many nodes are read into a buffer on the stack, enough for the usual pointing range
+#define STACK_NODES 512
+
+static inline v3s32 node_at(v3f64 pos)
+{
+	return (v3s32) {floor(pos.x + 0.5), floor(pos.y + 0.5), floor(pos.z + 0.5)};
+}
+
+static inline bool inside(aabb3s32 box, v3s32 pos)
+{
+	return pos.x >= box.min.x && pos.x <= box.max.x
+		&& pos.y >= box.min.y && pos.y <= box.max.y
+		&& pos.z >= box.min.z && pos.z <= box.max.z;
+}
+
 bool raycast(v3f64 pos, v3f64 dir, f64 len, v3s32 *node_pos, NodeType *node)
 {
 	f64 dir_len = sqrt(dir.x * dir.x + dir.y * dir.y + dir.z * dir.z);
 
+	// read all nodes the ray can pass through at once
+	v3s32 start = node_at(pos);
+	v3s32 end = node_at(v3f64_add(pos, v3f64_scale(dir, len / dir_len)));
+	aabb3s32 box = {
+		{s32_min(start.x, end.x), s32_min(start.y, end.y), s32_min(start.z, end.z)},
+		{s32_max(start.x, end.x), s32_max(start.y, end.y), s32_max(start.z, end.z)},
+	};
+
+	NodeType stack_nodes[STACK_NODES];
+	size_t volume = terrain_box_volume(box);
+	NodeType *nodes = volume <= STACK_NODES ? stack_nodes : malloc(sizeof *nodes * volume);
+	terrain_read_box(client_terrain, box, nodes);
+
+	bool found = false;
+
 	while (len > 0) {
-		*node = terrain_get_node(client_terrain,
-			*node_pos = (v3s32) {floor(pos.x + 0.5), floor(pos.y + 0.5), floor(pos.z + 0.5)}).type;
+		*node_pos = node_at(pos);
+		*node = inside(box, *node_pos)
+			? nodes[terrain_box_index(box, *node_pos)]
+			: terrain_get_node(client_terrain, *node_pos).type;
 
 		if (*node == COUNT_NODE)
-			return false;
+			break;
 
-		if (client_node_def[*node].pointable)
-			return true;
+		if (client_node_def[*node].pointable) {
+			found = true;
+			break;
+		}
 
 		f64 vpos[3] = {pos.x, pos.y, pos.z};
 		f64 vdir[3] = {dir.x, dir.y, dir.z};
@@ -42,5 +77,7 @@ bool raycast(v3f64 pos, v3f64 dir, f64 len, v3s32 *node_pos, NodeType *node)
 		len -= dir_len * min_mul;
 	}
 
-	return false;
+	if (nodes != stack_nodes)
+		free(nodes);
+	return found;
 }
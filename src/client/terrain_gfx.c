@@ -20,7 +20,6 @@ typedef struct {
 	bool animate;            // input: disable edge culling
 	Array vertices[2];       // main output: vertex data, 0=regular, 1=transparent textures
 	bool abort;              // output: state changes have occured that invalidate generated output
-	bool grabbed[6];         // output: neighbors that have been grabbed
 	bool visible;            // output: edge culled model would be visible
 	bool remake_needed;      // output: edge culled model would be different from non-culled
 } ChunkRenderData;
@@ -50,7 +49,7 @@ static ModelShader model_shader;
 
 static void grab_neighbor(ChunkRenderData *data, int i)
 {
-	// return if we've already subscribed/grabbed the lock
+	// return if we've already subscribed
 	if (data->meta->depends[i])
 		return;
 
@@ -62,11 +61,8 @@ static void grab_neighbor(ChunkRenderData *data, int i)
 
 	pthread_rwlock_rdlock(&neighbor_meta->lock_state);
 	// check neighbor in case it was already in a bad state before we subscribed
-	if ((data->grabbed[i] = neighbor_meta->state > CHUNK_STATE_RECV))
-		// if state is good, actually grab the data lock in read mode
-		assert(pthread_rwlock_rdlock(&neighbor->lock) == 0);
-	else
-		// if state is bad, set flag to abort
+	// its data is read optimistically, if it changes later we'll be remade anyway
+	if (neighbor_meta->state <= CHUNK_STATE_RECV)
 		data->abort = true;
 	pthread_rwlock_unlock(&neighbor_meta->lock_state);
 }
@@ -91,7 +87,7 @@ static inline bool show_face(ChunkRenderData *data, NodeArgsRender *args, v3s32
 	NodeType nbr_node = NODE_UNKNOWN;
 
 	if (nbr_chunk) {
-		// grab neighbor chunk data lock
+		// subscribe to neighbor
 		grab_neighbor(data, args->f);
 
 		// if grabbing failed, return true so caller immediately takes notice of abort
@@ -101,11 +97,10 @@ static inline bool show_face(ChunkRenderData *data, NodeArgsRender *args, v3s32
 		nbr_offset = terrain_offset(nbr_offset);
 
 		// select node from neighbor chunk
-		nbr_node = data->meta->neighbors[args->f]->data
-			[nbr_offset.x][nbr_offset.y][nbr_offset.z].type;
+		nbr_node = terrain_chunk_read_type(data->meta->neighbors[args->f], nbr_offset);
 	} else {
 		// select node from current chunk
-		nbr_node = data->chunk->data[nbr_offset.x][nbr_offset.y][nbr_offset.z].type;
+		nbr_node = terrain_chunk_read_type(data->chunk, nbr_offset);
 	}
 
 	if (visibility == VISIBILITY_BLEND) {
@@ -130,7 +125,8 @@ static inline void render_node(ChunkRenderData *data, v3s32 offset)
 {
 	NodeArgsRender args;
 
-	args.node = &data->chunk->data[offset.x][offset.y][offset.z];
+	TerrainNode node = terrain_chunk_read_node(data->chunk, offset);
+	args.node = &node;
 
 	ClientNodeDef *def = &client_node_def[args.node->type];
 
@@ -181,8 +177,19 @@ static void animate_chunk_model(Model *model, f64 dtime)
 	if (finished) {
 		model->callbacks.step = NULL;
 
-		if (model->extra)
-			client_terrain_meshgen_task(model->extra, false);
+		// unloading clears model->extra with mtx_model locked, the chunk itself stays valid for a grace period
+		TerrainChunk *chunk = model->extra;
+
+		if (chunk) {
+			TerrainChunkMeta *meta = chunk->extra;
+
+			pthread_mutex_lock(&meta->mtx_model);
+			bool loaded = model->extra != NULL;
+			pthread_mutex_unlock(&meta->mtx_model);
+
+			if (loaded)
+				client_terrain_meshgen_task(chunk, false);
+		}
 	}
 }
 
@@ -275,7 +282,6 @@ void terrain_gfx_make_chunk_model(TerrainChunk *chunk)
 		.animate = false,
 		.vertices = {},
 		.abort = false,
-		.grabbed = {false},
 		.visible = false,
 		.remake_needed = false,
 	};
@@ -289,15 +295,29 @@ void terrain_gfx_make_chunk_model(TerrainChunk *chunk)
 	else
 		data.animate = !meta->has_model;
 
-	// obtain own data lock
-	assert(pthread_rwlock_rdlock(&chunk->lock) == 0);
-
 	// clear dependencies, they are repopulated by calls to grab_neighbor
 	for (int i = 0; i < 6; i++)
 		meta->depends[i] = false;
 
+	// faces between nodes of a uniform chunk are culled unless they are clip nodes
+	// so only the nodes on the surface of the chunk need to be looked at
+	assert(pthread_rwlock_rdlock(&chunk->lock) == 0);
+	NodeType uniform;
+	bool surface_only = terrain_chunk_uniform(chunk, &uniform)
+		&& client_node_def[uniform].visibility != VISIBILITY_CLIP;
+	pthread_rwlock_unlock(&chunk->lock);
+
+	// nodes are read optimistically without holding data locks
+	// writers don't have to wait for the mesher, a chunk that changes while it's being meshed is remade anyway
+
 	// render nodes
 	CHUNK_ITERATE {
+		if (surface_only
+				&& x > 0 && x < CHUNK_SIZE - 1
+				&& y > 0 && y < CHUNK_SIZE - 1
+				&& z > 0 && z < CHUNK_SIZE - 1)
+			continue;
+
 		// obtain changed state
 		pthread_rwlock_rdlock(&meta->lock_state);
 		data.abort = meta->state < CHUNK_STATE_CLEAN;
@@ -317,14 +337,6 @@ void terrain_gfx_make_chunk_model(TerrainChunk *chunk)
 	}
 	abort:
 
-	// release grabbed data locks
-	for (int i = 0; i < 6; i++)
-		if (data.grabbed[i])
-			pthread_rwlock_unlock(&meta->neighbors[i]->lock);
-
-	// release own data lock
-	pthread_rwlock_unlock(&chunk->lock);
-
 	// only create model if we didn't abort
 	Model *model = data.abort ? NULL : create_chunk_model(&data);
 
@@ -6,7 +6,33 @@ f64 get_humidity(v3s32 pos)
 	return smooth2d(U32(pos.x) / 128.0, U32(pos.z) / 128.0, 0, seed + OFFSET_WETNESS) * 0.5 + 0.5;
 }
 
+f64 get_column_temperature(v2s32 pos)
+{
+	return smooth2d(U32(pos.x) / 128.0, U32(pos.y) / 128.0, 0, seed + OFFSET_TEMPERATURE) * 0.5 + 0.5;
+}
+
+f64 get_temperature_at(f64 column_temperature, s32 y)
+{
+	return column_temperature - (y - 32.0) / 64.0;
+}
+
+void get_humidity_tile(f64 *out, v2s32 pos, v2s32 size)
+{
+	smooth2d_tile(out, pos, size, 128.0, 0, seed + OFFSET_WETNESS);
+
+	for (s32 i = 0; i < size.x * size.y; i++)
+		out[i] = out[i] * 0.5 + 0.5;
+}
+
+void get_column_temperature_tile(f64 *out, v2s32 pos, v2s32 size)
+{
+	smooth2d_tile(out, pos, size, 128.0, 0, seed + OFFSET_TEMPERATURE);
+
+	for (s32 i = 0; i < size.x * size.y; i++)
+		out[i] = out[i] * 0.5 + 0.5;
+}
+
 f64 get_temperature(v3s32 pos)
 {
-	return smooth2d(U32(pos.x) / 128.0, U32(pos.z) / 128.0, 0, seed + OFFSET_TEMPERATURE) * 0.5 + 0.5 - (pos.y - 32.0) / 64.0;
+	return get_temperature_at(get_column_temperature((v2s32) {pos.x, pos.z}), pos.y);
 }
@@ -5,5 +5,11 @@
 
 f64 get_humidity(v3s32 pos);
 f64 get_temperature(v3s32 pos);
+// temperature only depends on height within a column, so it can be split into a per column part and an offset
+f64 get_column_temperature(v2s32 pos); // pos is x and z
+f64 get_temperature_at(f64 column_temperature, s32 y);
+// batched variants, see smooth2d_tile for the layout of out
+void get_humidity_tile(f64 *out, v2s32 pos, v2s32 size);
+void get_column_temperature_tile(f64 *out, v2s32 pos, v2s32 size);
 
 #endif // _ENVIRONMENT_H_
@@ -8,80 +8,96 @@ NodeDef node_def[COUNT_NODE] = {
 	{
 		.solid = true,
 		.dig_class = DIG_NONE,
+		.has_data = false,
 	},
 	// air
 	{
 		.solid = false,
 		.dig_class = DIG_NONE,
+		.has_data = false,
 	},
 	// grass
 	{
 		.solid = true,
 		.dig_class = DIG_DIRT,
+		.has_data = false,
 	},
 	// dirt
 	{
 		.solid = true,
 		.dig_class = DIG_DIRT,
+		.has_data = false,
 	},
 	// stone
 	{
 		.solid = true,
 		.dig_class = DIG_STONE,
+		.has_data = false,
 	},
 	// snow
 	{
 		.solid = true,
 		.dig_class = DIG_DIRT,
+		.has_data = false,
 	},
 	// oak wood
 	{
 		.solid = true,
 		.dig_class = DIG_WOOD,
+		.has_data = true,
 	},
 	// oak leaves
 	{
 		.solid = true,
 		.dig_class = DIG_LEAVES,
+		.has_data = true,
 	},
 	// pine wood
 	{
 		.solid = true,
 		.dig_class = DIG_WOOD,
+		.has_data = true,
 	},
 	// pine leaves
 	{
 		.solid = true,
 		.dig_class = DIG_LEAVES,
+		.has_data = true,
 	},
 	// palm wood
 	{
 		.solid = true,
 		.dig_class = DIG_WOOD,
+		.has_data = true,
 	},
 	// palm leaves
 	{
 		.solid = true,
 		.dig_class = DIG_LEAVES,
+		.has_data = true,
 	},
 	// sand
 	{
 		.solid = true,
 		.dig_class = DIG_DIRT,
+		.has_data = false,
 	},
 	// water
 	{
 		.solid = false,
 		.dig_class = DIG_NONE,
+		.has_data = false,
 	},
 	// lava
 	{
 		.solid = false,
 		.dig_class = DIG_NONE,
+		.has_data = false,
 	},
 	// vulcanostone
 	{
 		.solid = true,
 		.dig_class = DIG_STONE,
+		.has_data = false,
 	},
 };
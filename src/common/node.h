@@ -32,6 +32,7 @@ struct TerrainNode;
 typedef struct {
 	bool solid;
 	unsigned long dig_class;
+	bool has_data; // nodes of this type carry data (stored in the chunk's side table)
 } NodeDef;
 
 extern NodeDef node_def[];
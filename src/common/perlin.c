@@ -1,3 +1,316 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NOISE_X86
+#endif
 #include "common/perlin.h"
 
 s32 seed = 0;
+
+// factors the perlin library multiplies lattice coordinates, octave and seed with before hashing them
+#define NOISE_X 1619
+#define NOISE_Y 31337
+#define NOISE_OCTAVE 3463
+#define NOISE_SEED 13397
+// the library's value of pi used for cosine interpolation
+#define NOISE_PI 3.141593
+
+/*
+	Noise kernels:
+	- the value noise of the perlin library is reimplemented here so that a tile row can be computed
+	  several samples at a time (SSE4.1: 2 samples, AVX2: 4 samples)
+	- lattice hashes and interpolation weights only depend on one coordinate, they are computed once
+	  per row and column of a tile instead of once per sample, so cos is only called O(size.x + size.y) times
+	- the kernel is chosen on first use, depending on what the CPU supports, and only if it is bit exact
+	  with the library on a set of probe tiles, otherwise the library is called for every sample
+	- kernels must not contract multiplications and additions into FMA instructions, or results would differ
+*/
+
+typedef void NoiseRow(f64 *out, const u32 *hy, const f64 *wy, s32 size, u32 hx, f64 wx, f64 amplitude, bool accumulate);
+
+static NoiseRow *noise_row = NULL;
+static const char *noise_kernel = "scalar";
+static pthread_once_t noise_once = PTHREAD_ONCE_INIT;
+
+// scaled coordinates are computed once per row and column of the tile instead of once per sample
+static void scale_coords(f64 *out, s32 start, s32 size, f64 scale)
+{
+	for (s32 i = 0; i < size; i++)
+		out[i] = U32(start + i) / scale;
+}
+
+// lattice hash and interpolation weight of each coordinate, at the frequency of an octave
+static void lattice_coords(u32 *hash, f64 *weight, const f64 *coords, s32 size, f64 frequency, u32 factor)
+{
+	for (s32 i = 0; i < size; i++) {
+		f64 x = coords[i] * frequency;
+		int lattice = (int) x;
+
+		hash[i] = (u32) lattice * factor;
+		weight[i] = (1.0 - cos((x - lattice) * NOISE_PI)) * 0.5;
+	}
+}
+
+static inline f64 lattice_value(u32 n)
+{
+	n = (n << 13) ^ n;
+	return 1.0 - (s32) ((n * (n * n * 15731 + 789221) + 1376312589) & 0x7fffffff) / 1073741824.0;
+}
+
+static inline f64 lerp(f64 a, f64 b, f64 f)
+{
+	return a * (1.0 - f) + b * f;
+}
+
+static inline f64 sample(u32 hx, f64 wx, u32 hy, f64 wy)
+{
+	u32 n = hx + hy;
+
+	f64 i1 = lerp(lattice_value(n),           lattice_value(n + NOISE_X),           wx);
+	f64 i2 = lerp(lattice_value(n + NOISE_Y), lattice_value(n + NOISE_X + NOISE_Y), wx);
+
+	return lerp(i1, i2, wy);
+}
+
+// remaining samples of a row that don't fill a whole vector
+static void row_tail(f64 *out, const u32 *hy, const f64 *wy, s32 start, s32 size, u32 hx, f64 wx, f64 amplitude, bool accumulate)
+{
+	for (s32 j = start; j < size; j++) {
+		f64 value = sample(hx, wx, hy[j], wy[j]);
+		out[j] = accumulate ? out[j] + value * amplitude : value;
+	}
+}
+
+#ifdef NOISE_X86
+
+__attribute__((target("sse4.1")))
+static inline __m128d lattice_value_sse41(__m128i n)
+{
+	n = _mm_xor_si128(_mm_slli_epi32(n, 13), n);
+
+	__m128i t = _mm_mullo_epi32(_mm_mullo_epi32(n, n), _mm_set1_epi32(15731));
+	t = _mm_add_epi32(t, _mm_set1_epi32(789221));
+	t = _mm_add_epi32(_mm_mullo_epi32(n, t), _mm_set1_epi32(1376312589));
+	t = _mm_and_si128(t, _mm_set1_epi32(0x7fffffff));
+
+	return _mm_sub_pd(_mm_set1_pd(1.0), _mm_div_pd(_mm_cvtepi32_pd(t), _mm_set1_pd(1073741824.0)));
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128d lerp_sse41(__m128d a, __m128d b, __m128d f)
+{
+	return _mm_add_pd(_mm_mul_pd(a, _mm_sub_pd(_mm_set1_pd(1.0), f)), _mm_mul_pd(b, f));
+}
+
+__attribute__((target("sse4.1")))
+static void row_sse41(f64 *out, const u32 *hy, const f64 *wy, s32 size, u32 hx, f64 wx, f64 amplitude, bool accumulate)
+{
+	__m128i vhx = _mm_set1_epi32(hx);
+	__m128d vwx = _mm_set1_pd(wx);
+	__m128d vamplitude = _mm_set1_pd(amplitude);
+
+	s32 j = 0;
+	for (; j + 2 <= size; j += 2) {
+		__m128i n = _mm_add_epi32(vhx, _mm_loadl_epi64((const __m128i *) &hy[j]));
+
+		__m128d i1 = lerp_sse41(lattice_value_sse41(n),
+			lattice_value_sse41(_mm_add_epi32(n, _mm_set1_epi32(NOISE_X))), vwx);
+		__m128d i2 = lerp_sse41(lattice_value_sse41(_mm_add_epi32(n, _mm_set1_epi32(NOISE_Y))),
+			lattice_value_sse41(_mm_add_epi32(n, _mm_set1_epi32(NOISE_X + NOISE_Y))), vwx);
+		__m128d value = lerp_sse41(i1, i2, _mm_loadu_pd(&wy[j]));
+
+		if (accumulate)
+			value = _mm_add_pd(_mm_loadu_pd(&out[j]), _mm_mul_pd(value, vamplitude));
+
+		_mm_storeu_pd(&out[j], value);
+	}
+
+	row_tail(out, hy, wy, j, size, hx, wx, amplitude, accumulate);
+}
+
+__attribute__((target("avx2")))
+static inline __m256d lattice_value_avx2(__m128i n)
+{
+	n = _mm_xor_si128(_mm_slli_epi32(n, 13), n);
+
+	__m128i t = _mm_mullo_epi32(_mm_mullo_epi32(n, n), _mm_set1_epi32(15731));
+	t = _mm_add_epi32(t, _mm_set1_epi32(789221));
+	t = _mm_add_epi32(_mm_mullo_epi32(n, t), _mm_set1_epi32(1376312589));
+	t = _mm_and_si128(t, _mm_set1_epi32(0x7fffffff));
+
+	return _mm256_sub_pd(_mm256_set1_pd(1.0), _mm256_div_pd(_mm256_cvtepi32_pd(t), _mm256_set1_pd(1073741824.0)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256d lerp_avx2(__m256d a, __m256d b, __m256d f)
+{
+	return _mm256_add_pd(_mm256_mul_pd(a, _mm256_sub_pd(_mm256_set1_pd(1.0), f)), _mm256_mul_pd(b, f));
+}
+
+__attribute__((target("avx2")))
+static void row_avx2(f64 *out, const u32 *hy, const f64 *wy, s32 size, u32 hx, f64 wx, f64 amplitude, bool accumulate)
+{
+	__m128i vhx = _mm_set1_epi32(hx);
+	__m256d vwx = _mm256_set1_pd(wx);
+	__m256d vamplitude = _mm256_set1_pd(amplitude);
+
+	s32 j = 0;
+	for (; j + 4 <= size; j += 4) {
+		__m128i n = _mm_add_epi32(vhx, _mm_loadu_si128((const __m128i *) &hy[j]));
+
+		__m256d i1 = lerp_avx2(lattice_value_avx2(n),
+			lattice_value_avx2(_mm_add_epi32(n, _mm_set1_epi32(NOISE_X))), vwx);
+		__m256d i2 = lerp_avx2(lattice_value_avx2(_mm_add_epi32(n, _mm_set1_epi32(NOISE_Y))),
+			lattice_value_avx2(_mm_add_epi32(n, _mm_set1_epi32(NOISE_X + NOISE_Y))), vwx);
+		__m256d value = lerp_avx2(i1, i2, _mm256_loadu_pd(&wy[j]));
+
+		if (accumulate)
+			value = _mm256_add_pd(_mm256_loadu_pd(&out[j]), _mm256_mul_pd(value, vamplitude));
+
+		_mm256_storeu_pd(&out[j], value);
+	}
+
+	row_tail(out, hy, wy, j, size, hx, wx, amplitude, accumulate);
+}
+
+#endif // NOISE_X86
+
+static void smooth2d_tile_kernel(NoiseRow *row, f64 *out, v2s32 pos, v2s32 size, f64 scale, int z, int seed)
+{
+	f64 xs[size.x], ys[size.y];
+	scale_coords(xs, pos.x, size.x, scale);
+	scale_coords(ys, pos.y, size.y, scale);
+
+	if (!row) {
+		for (s32 i = 0; i < size.x; i++)
+		for (s32 j = 0; j < size.y; j++)
+			*out++ = smooth2d(xs[i], ys[j], z, seed);
+		return;
+	}
+
+	u32 hx[size.x], hy[size.y];
+	f64 wx[size.x], wy[size.y];
+	lattice_coords(hx, wx, xs, size.x, 1.0, NOISE_X);
+	lattice_coords(hy, wy, ys, size.y, 1.0, NOISE_Y);
+
+	u32 base = (u32) z * NOISE_OCTAVE + (u32) seed * NOISE_SEED;
+
+	for (s32 i = 0; i < size.x; i++)
+		row(&out[i * size.y], hy, wy, size.y, hx[i] + base, wx[i], 1.0, false);
+}
+
+static void pnoise2d_tile_kernel(NoiseRow *row, f64 *out, v2s32 pos, v2s32 size, f64 scale, f64 persistence, int octaves, int seed)
+{
+	f64 xs[size.x], ys[size.y];
+	scale_coords(xs, pos.x, size.x, scale);
+	scale_coords(ys, pos.y, size.y, scale);
+
+	if (!row) {
+		for (s32 i = 0; i < size.x; i++)
+		for (s32 j = 0; j < size.y; j++)
+			*out++ = pnoise2d(xs[i], ys[j], persistence, octaves, seed);
+		return;
+	}
+
+	u32 hx[size.x], hy[size.y];
+	f64 wx[size.x], wy[size.y];
+
+	// octaves are summed up in the same order as the library does
+	for (s32 i = 0; i < size.x * size.y; i++)
+		out[i] = 0.0;
+
+	f64 frequency = 1.0;
+	f64 amplitude = 1.0;
+
+	for (int octave = 0; octave < octaves; octave++) {
+		lattice_coords(hx, wx, xs, size.x, frequency, NOISE_X);
+		lattice_coords(hy, wy, ys, size.y, frequency, NOISE_Y);
+
+		u32 base = (u32) octave * NOISE_OCTAVE + (u32) seed * NOISE_SEED;
+
+		for (s32 i = 0; i < size.x; i++)
+			row(&out[i * size.y], hy, wy, size.y, hx[i] + base, wx[i], amplitude, true);
+
+		frequency /= 2;
+		amplitude *= persistence;
+	}
+}
+
+// compare a kernel with the library on tiles like the ones used by generation, with odd sizes to cover row tails
+static bool verify_kernel(NoiseRow *row)
+{
+	v2s32 pos = {-1237, 2459};
+	v2s32 size = {7, 13};
+	f64 expected[size.x * size.y], got[size.x * size.y];
+
+	for (int probe = 0; probe < 4; probe++) {
+		f64 scale = probe % 2 ? 128.0 : 32.0;
+		int probe_seed = 0x5EED + probe * 7919;
+
+		smooth2d_tile_kernel(NULL, expected, pos, size, scale, probe, probe_seed);
+		smooth2d_tile_kernel(row, got, pos, size, scale, probe, probe_seed);
+
+		if (memcmp(expected, got, sizeof got) != 0)
+			return false;
+
+		pnoise2d_tile_kernel(NULL, expected, pos, size, scale, 0.45, 5, probe_seed);
+		pnoise2d_tile_kernel(row, got, pos, size, scale, 0.45, 5, probe_seed);
+
+		if (memcmp(expected, got, sizeof got) != 0)
+			return false;
+
+		pos.x += 10007 * (probe + 1);
+		pos.y -= 30011 * (probe + 1);
+	}
+
+	return true;
+}
+
+static bool try_kernel(NoiseRow *row, const char *name)
+{
+	if (!verify_kernel(row)) {
+		fprintf(stderr, "[warning] %s noise kernel is not bit exact with the perlin library\n", name);
+		return false;
+	}
+
+	noise_row = row;
+	noise_kernel = name;
+	return true;
+}
+
+static void select_kernel()
+{
+#ifdef NOISE_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2") && try_kernel(&row_avx2, "avx2"))
+		return;
+
+	if (__builtin_cpu_supports("sse4.1") && try_kernel(&row_sse41, "sse4.1"))
+		return;
+#endif // NOISE_X86
+}
+
+// public functions
+
+const char *perlin_tile_kernel()
+{
+	pthread_once(&noise_once, &select_kernel);
+	return noise_kernel;
+}
+
+void smooth2d_tile(f64 *out, v2s32 pos, v2s32 size, f64 scale, int z, int seed)
+{
+	pthread_once(&noise_once, &select_kernel);
+	smooth2d_tile_kernel(noise_row, out, pos, size, scale, z, seed);
+}
+
+void pnoise2d_tile(f64 *out, v2s32 pos, v2s32 size, f64 scale, f64 persistence, int octaves, int seed)
+{
+	pthread_once(&noise_once, &select_kernel);
+	pnoise2d_tile_kernel(noise_row, out, pos, size, scale, persistence, octaves, seed);
+}
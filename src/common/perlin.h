@@ -32,8 +32,24 @@ typedef enum {
 	OFFSET_PINETREE_BRANCH_DIR,
 	OFFSET_PALMTREE,
 	OFFSET_PALMTREE_AREA,
+	OFFSET_TREE_VARIANT,
 } SeedOffset;
 
 extern s32 seed;
 
+/*
+	Batched noise:
+	- evaluates a tile of size.x * size.y samples at once, the sample for pos + (i, j) goes to out[i * size.y + j]
+	- sample coordinates are scaled like U32(x) / scale, which is what all generation code uses
+	- results are bit exact with calling the single sample functions for each position
+	- tiles are computed by SSE4.1 or AVX2 kernels if the CPU supports them and they match the perlin library,
+	  otherwise by calling the library for every sample
+*/
+
+// name of the kernel used by the tile functions ("avx2", "sse4.1" or "scalar")
+const char *perlin_tile_kernel();
+
+void smooth2d_tile(f64 *out, v2s32 pos, v2s32 size, f64 scale, int z, int seed);
+void pnoise2d_tile(f64 *out, v2s32 pos, v2s32 size, f64 scale, f64 persistence, int octaves, int seed);
+
 #endif // _PERLIN_H_
@@ -1,6 +1,10 @@
 #include <math.h>
+#include <stdlib.h>
 #include "common/physics.h"
 
+// boxes of up to this many nodes are read into a buffer on the stack, bodies only ever need a few nodes per step
+#define STACK_NODES 512
+
 static aabb3f64 move_box(aabb3f32 box, v3f64 pos)
 {
 	return (aabb3f64) {
@@ -17,9 +21,8 @@ static aabb3s32 round_box(aabb3f64 box)
 	};
 }
 
-static bool is_solid(Terrain *terrain, s32 x, s32 y, s32 z)
+static bool is_solid(NodeType node)
 {
-	NodeType node = terrain_get_node(terrain, (v3s32) {x, y, z}).type;
 	return node == COUNT_NODE || node_def[node].solid;
 }
 
@@ -39,12 +42,24 @@ bool physics_ground(Terrain *terrain, bool collide, aabb3f32 box, v3f64 *pos, v3
 	if (mbox.min.y - (f64) rbox.min.y > 0.01)
 		return false;
 
-	for (s32 x = rbox.min.x; x <= rbox.max.x; x++)
-		for (s32 z = rbox.min.z; z <= rbox.max.z; z++)
-			if (is_solid(terrain, x, rbox.min.y, z))
-				return true;
+	rbox.max.y = rbox.min.y;
+
+	NodeType stack_nodes[STACK_NODES];
+	size_t volume = terrain_box_volume(rbox);
+	NodeType *nodes = volume <= STACK_NODES ? stack_nodes : malloc(sizeof *nodes * volume);
+	terrain_read_box(terrain, rbox, nodes);
+
+	bool ground = false;
+	for (size_t i = 0; i < volume; i++) {
+		if (is_solid(nodes[i])) {
+			ground = true;
+			break;
+		}
+	}
 
-	return false;
+	if (nodes != stack_nodes)
+		free(nodes);
+	return ground;
 }
 
 bool physics_step(Terrain *terrain, bool collide, aabb3f32 box, v3f64 *pos, v3f64 *vel, v3f64 *acc, f64 t)
@@ -97,6 +112,22 @@ bool physics_step(Terrain *terrain, bool collide, aabb3f32 box, v3f64 *pos, v3f6
 			max_rnd[i] =   ceil(x[i] + off - 0.5);
 		}
 
+		// nothing to check if we didn't cross into a new node
+		if ((max_rnd[i] - min_rnd[i]) * dir < 0)
+			continue;
+
+		// read all nodes that can be hit at once, in the order the axis is traversed
+		aabb3s32 read_box = box_rnd;
+		s32 *min_read = &read_box.min.x;
+		s32 *max_read = &read_box.max.x;
+		min_read[i] = dir > 0 ? min_rnd[i] : max_rnd[i];
+		max_read[i] = dir > 0 ? max_rnd[i] : min_rnd[i];
+
+		NodeType stack_nodes[STACK_NODES];
+		size_t volume = terrain_box_volume(read_box);
+		NodeType *nodes = volume <= STACK_NODES ? stack_nodes : malloc(sizeof *nodes * volume);
+		terrain_read_box(terrain, read_box, nodes);
+
 		max_rnd[i] += dir;
 
 		u8 i_a = idx[i][0]; // = i
@@ -111,14 +142,16 @@ bool physics_step(Terrain *terrain, bool collide, aabb3f32 box, v3f64 *pos, v3f6
 			p[i_b] = b;
 			p[i_c] = c;
 
-			if (is_solid(terrain, p[0], p[1], p[2])) {
+			if (is_solid(nodes[terrain_box_index(read_box, (v3s32) {p[0], p[1], p[2]})])) {
 				x[i] = (f64) a - off - 0.5 * (f64) dir;
 				v[i] = 0.0;
 				goto done;
 			}
 		}
 
-		done: continue;
+		done:
+		if (nodes != stack_nodes)
+			free(nodes);
 	}
 
 	return !v3f64_equals(*pos, old_pos);
@@ -0,0 +1,322 @@
+#include <assert.h>
+#include <stdlib.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#include "common/slab.h"
+
+#define CACHE_LINE 64
+// number of slabs a thread can keep local free lists for, other slabs go through the shared free list
+#define SLAB_CACHES 4
+
+struct SlabObject {
+	SlabObject *next;
+};
+
+// block header, objects follow it
+struct SlabBlock {
+	SlabBlock *next;
+};
+
+typedef struct {
+	Slab *slab;
+	u64 id;
+	SlabObject *free;
+	size_t num_free;
+} SlabCache;
+
+static _Thread_local SlabCache caches[SLAB_CACHES];
+
+static atomic_uint_fast64_t next_id = 1;
+
+// live slabs, tells local free lists of deleted slabs apart from those of slabs at other addresses
+static pthread_mutex_t registry_mtx = PTHREAD_MUTEX_INITIALIZER;
+static Slab *registry = NULL;
+
+// number of slabs deleted so far, threads only look for free lists of deleted slabs once it changed
+static atomic_uint_fast64_t num_deleted = 0;
+static _Thread_local u64 checked_deleted = 0;
+
+// destructor of this key gives objects in local free lists back when a thread exits
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+// header is padded to a full cache line, so objects stay aligned
+#define BLOCK_HEADER ((sizeof(SlabBlock) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE)
+
+static void *allocate_block()
+{
+#ifdef _WIN32
+	return malloc(SLAB_BLOCK_SIZE);
+#else
+	void *block;
+	if (posix_memalign(&block, SLAB_BLOCK_SIZE, SLAB_BLOCK_SIZE) != 0)
+		return NULL;
+
+#ifdef MADV_HUGEPAGE
+	// aligned blocks can be backed by transparent huge pages, reducing TLB misses
+	madvise(block, SLAB_BLOCK_SIZE, MADV_HUGEPAGE);
+#endif
+
+	return block;
+#endif
+}
+
+// slab mutex has to be locked
+static void add_block(Slab *slab)
+{
+	SlabBlock *block = allocate_block();
+	assert(block);
+
+	block->next = slab->blocks;
+	slab->blocks = block;
+	slab->num_blocks++;
+
+	// push objects in reverse so they are handed out in address order
+	char *objects = (char *) block + BLOCK_HEADER;
+	for (size_t i = slab->per_block; i > 0; i--) {
+		SlabObject *object = (SlabObject *) (objects + (i - 1) * slab->size);
+		object->next = slab->free;
+		slab->free = object;
+	}
+}
+
+// registry mutex has to be locked
+static bool is_live(SlabCache *cache)
+{
+	for (Slab *slab = registry; slab; slab = slab->next)
+		if (slab == cache->slab && slab->id == cache->id)
+			return true;
+
+	return false;
+}
+
+// free up local free lists of slabs that were deleted, their objects are gone along with the slab
+// returns false if no slab was deleted since the last check
+static bool drop_deleted_caches()
+{
+	u64 deleted = atomic_load(&num_deleted);
+
+	if (deleted == checked_deleted)
+		return false;
+
+	checked_deleted = deleted;
+
+	pthread_mutex_lock(&registry_mtx);
+	for (int i = 0; i < SLAB_CACHES; i++)
+		if (caches[i].slab && !is_live(&caches[i]))
+			caches[i].slab = NULL;
+	pthread_mutex_unlock(&registry_mtx);
+
+	return true;
+}
+
+// thread exit destructor, slabs can't be deleted while their objects are given back
+static void flush_caches(SlabCache *thread_caches)
+{
+	pthread_mutex_lock(&registry_mtx);
+
+	for (int i = 0; i < SLAB_CACHES; i++) {
+		SlabCache *cache = &thread_caches[i];
+
+		if (cache->slab && cache->free && is_live(cache)) {
+			SlabObject *last = cache->free;
+			while (last->next)
+				last = last->next;
+
+			pthread_mutex_lock(&cache->slab->mtx);
+			last->next = cache->slab->free;
+			cache->slab->free = cache->free;
+			pthread_mutex_unlock(&cache->slab->mtx);
+		}
+
+		cache->slab = NULL;
+	}
+
+	pthread_mutex_unlock(&registry_mtx);
+}
+
+static void create_exit_key()
+{
+	pthread_key_create(&exit_key, (void *) &flush_caches);
+}
+
+// returns NULL if all local free lists of this thread are taken by other slabs
+static SlabCache *get_cache(Slab *slab)
+{
+	do {
+		SlabCache *unused = NULL;
+
+		for (int i = 0; i < SLAB_CACHES; i++) {
+			SlabCache *cache = &caches[i];
+
+			if (cache->slab == slab && cache->id == slab->id)
+				return cache;
+
+			// entries of a deleted slab at the same address can be taken over, their objects are gone
+			if (!unused && (!cache->slab || cache->slab == slab))
+				unused = cache;
+		}
+
+		if (unused) {
+			*unused = (SlabCache) {
+				.slab = slab,
+				.id = slab->id,
+				.free = NULL,
+				.num_free = 0,
+			};
+
+			pthread_once(&exit_once, &create_exit_key);
+			pthread_setspecific(exit_key, caches);
+
+			return unused;
+		}
+
+		// all local free lists are taken, some of them may belong to slabs that were deleted in the meantime
+	} while (drop_deleted_caches());
+
+	return NULL;
+}
+
+Slab *slab_create(size_t size)
+{
+	Slab *slab = malloc(sizeof *slab);
+
+	if (size < sizeof(SlabObject))
+		size = sizeof(SlabObject);
+
+	// objects don't share cache lines, so threads working on neighbouring objects don't slow each other down
+	slab->size = (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+	slab->per_block = (SLAB_BLOCK_SIZE - BLOCK_HEADER) / slab->size;
+	assert(slab->per_block > 0);
+
+	slab->id = atomic_fetch_add(&next_id, 1);
+	pthread_mutex_init(&slab->mtx, NULL);
+	slab->blocks = NULL;
+	slab->free = NULL;
+	slab->num_blocks = 0;
+	atomic_init(&slab->used, 0);
+
+	pthread_mutex_lock(&registry_mtx);
+	slab->next = registry;
+	registry = slab;
+	pthread_mutex_unlock(&registry_mtx);
+
+	return slab;
+}
+
+void slab_delete(Slab *slab)
+{
+	// waits for exiting threads that are giving objects back
+	pthread_mutex_lock(&registry_mtx);
+	for (Slab **live = &registry; *live; live = &(*live)->next)
+		if (*live == slab) {
+			*live = slab->next;
+			break;
+		}
+	pthread_mutex_unlock(&registry_mtx);
+
+	atomic_fetch_add(&num_deleted, 1);
+
+	// drop local free list of the calling thread, other threads notice the changed id
+	for (int i = 0; i < SLAB_CACHES; i++)
+		if (caches[i].slab == slab)
+			caches[i].slab = NULL;
+
+	while (slab->blocks) {
+		SlabBlock *next = slab->blocks->next;
+		free(slab->blocks);
+		slab->blocks = next;
+	}
+
+	pthread_mutex_destroy(&slab->mtx);
+	free(slab);
+}
+
+void *slab_alloc(Slab *slab)
+{
+	atomic_fetch_add_explicit(&slab->used, 1, memory_order_relaxed);
+
+	SlabCache *cache = get_cache(slab);
+
+	if (cache && cache->free) {
+		SlabObject *object = cache->free;
+		cache->free = object->next;
+		cache->num_free--;
+		return object;
+	}
+
+	pthread_mutex_lock(&slab->mtx);
+
+	if (!slab->free)
+		add_block(slab);
+
+	SlabObject *object = slab->free;
+	slab->free = object->next;
+
+	// refill local free list
+	if (cache) {
+		while (slab->free && cache->num_free < SLAB_BATCH) {
+			SlabObject *next = slab->free->next;
+			slab->free->next = cache->free;
+			cache->free = slab->free;
+			cache->num_free++;
+			slab->free = next;
+		}
+	}
+
+	pthread_mutex_unlock(&slab->mtx);
+	return object;
+}
+
+void slab_free(Slab *slab, void *ptr)
+{
+	if (!ptr)
+		return;
+
+	atomic_fetch_sub_explicit(&slab->used, 1, memory_order_relaxed);
+
+	SlabObject *object = ptr;
+	SlabCache *cache = get_cache(slab);
+
+	if (cache) {
+		object->next = cache->free;
+		cache->free = object;
+
+		if (++cache->num_free < SLAB_BATCH * 2)
+			return;
+
+		// local free list grew too long, e.g. because this thread frees what others allocate
+		SlabObject *first = cache->free;
+		SlabObject *last = first;
+
+		for (size_t i = 1; i < SLAB_BATCH; i++)
+			last = last->next;
+
+		cache->free = last->next;
+		cache->num_free -= SLAB_BATCH;
+
+		pthread_mutex_lock(&slab->mtx);
+		last->next = slab->free;
+		slab->free = first;
+		pthread_mutex_unlock(&slab->mtx);
+	} else {
+		pthread_mutex_lock(&slab->mtx);
+		object->next = slab->free;
+		slab->free = object;
+		pthread_mutex_unlock(&slab->mtx);
+	}
+}
+
+SlabStats slab_stats(Slab *slab)
+{
+	pthread_mutex_lock(&slab->mtx);
+	size_t blocks = slab->num_blocks;
+	pthread_mutex_unlock(&slab->mtx);
+
+	return (SlabStats) {
+		.blocks = blocks,
+		.capacity = blocks * slab->per_block,
+		.used = atomic_load_explicit(&slab->used, memory_order_relaxed),
+	};
+}
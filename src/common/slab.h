@@ -0,0 +1,52 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include "types.h"
+
+// objects are carved from blocks of this size, which matches the size of a huge page
+#define SLAB_BLOCK_SIZE ((size_t) 2 << 20)
+// number of objects moved between a thread local free list and the shared one at once
+#define SLAB_BATCH 32
+
+typedef struct SlabObject SlabObject;
+typedef struct SlabBlock SlabBlock;
+
+typedef struct {
+	size_t blocks;   // number of blocks allocated from the system
+	size_t capacity; // number of objects that fit into all blocks
+	size_t used;     // number of objects currently allocated
+} SlabStats;
+
+typedef struct Slab {
+	size_t size;       // object size, rounded up to a multiple of the cache line size
+	size_t per_block;  // number of objects in a block
+	u64 id;            // unique, tells thread local free lists of a deleted slab apart from those of a new one
+	pthread_mutex_t mtx;
+	SlabBlock *blocks; // all blocks, released at once by slab_delete
+	SlabObject *free;  // free objects that are not in any thread local free list
+	size_t num_blocks;
+	atomic_size_t used;
+	struct Slab *next; // next live slab, threads check their local free lists against the live slabs
+} Slab;
+
+/*
+	Slab allocator:
+	- hands out objects of a fixed size from large blocks, so creating and freeing many objects doesn't fragment the heap
+	- each thread keeps a small free list per slab, only batches of objects go through the shared free list
+	- objects may be freed by a different thread than the one that allocated them
+	- local free lists of deleted slabs are reclaimed once a thread needs them for another slab,
+	  objects left in local free lists are given back to their slabs when a thread exits
+	- slab_delete releases all blocks at once, objects that were not freed yet become invalid
+	- objects are not initialized
+*/
+
+Slab *slab_create(size_t size);
+void slab_delete(Slab *slab);
+void *slab_alloc(Slab *slab);
+void slab_free(Slab *slab, void *ptr);
+SlabStats slab_stats(Slab *slab);
+
+#endif // _SLAB_H_
@@ -1,39 +1,507 @@
 #include <assert.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include "common/terrain.h"
 
+#define INDEX_INITIAL_SIZE 1024
+#define CACHE_SETS 16
+#define CACHE_WAYS 4
+
+// open addressing hash table using linear probing
+// slots are only ever filled using compare-and-swap, so readers don't need any lock
+// removed chunks leave a tombstone behind that is skipped by lookups and may be reused by inserts
+// the table is rebuilt once chunks and tombstones fill half of it, old tables stay valid for a grace period
+struct TerrainIndex {
+	size_t mask;             // number of slots minus one
+	TerrainIndex *old;       // previous table, freed by terrain_evict or terrain_delete
+	u64 retired;             // terrain clock at the time the table was replaced
+	_Atomic(TerrainChunk *) slots[];
+};
+
+typedef struct {
+	u64 last_access;
+	TerrainChunk *chunk;
+} EvictCandidate;
+
+typedef struct {
+	u64 terrain; // id of the terrain
+	u64 epoch;
+	v3s32 pos;
+	TerrainChunk *chunk;
+} CacheEntry;
+
+typedef struct {
+	CacheEntry ways[CACHE_WAYS];
+	unsigned int next; // round robin replacement
+} CacheSet;
+
+// small set associative cache of recently used chunks, one per thread
+// entries are only valid if the terrain epoch didn't change since they were stored
+static _Thread_local CacheSet cache[CACHE_SETS];
+
+// source of terrain ids, ids are never reused, so a new terrain at the address of a deleted one can't match stale entries
+static atomic_uint_fast64_t next_id = 1;
+
+// index array shared by all uniform chunks, every node refers to the first palette entry
+// it is never written to, chunks get their own array once a node of a different type is set
+static const struct {
+	u8 bits;
+	u64 words[CHUNK_VOLUME / 64];
+} uniform_indices = {1, {0}};
+
+// number of optimistic attempts before readers fall back to the chunk lock
+#define OPTIMISTIC_ATTEMPTS 4
+
+// loads a value exactly once, optimistic readers must not see different values for the same field
+#define LOAD_ONCE(x) (*(volatile __typeof__(x) *) &(x))
+
+// array replaced by a writer, kept in the chunk's retired list until no optimistic reader can be using it anymore
 typedef struct {
-	v2s32 pos;
-	Tree chunks;
-	pthread_rwlock_t lock;
-} TerrainSector;
+	void *ptr;
+	u64 retired; // terrain clock of the first eviction pass that saw the array, 0 if none has yet
+} RetiredArray;
+
+// marks slots of removed chunks
+static char tombstone;
+#define TOMBSTONE ((TerrainChunk *) &tombstone)
+
+static TerrainIndex *create_index(size_t size, TerrainIndex *old)
+{
+	TerrainIndex *index = malloc(sizeof *index + sizeof *index->slots * size);
+	index->mask = size - 1;
+	index->old = old;
+	index->retired = 0;
+
+	for (size_t i = 0; i < size; i++)
+		atomic_init(&index->slots[i], NULL);
+
+	return index;
+}
+
+static inline u64 hash_pos(v3s32 pos)
+{
+	u64 key = (u64) (pos.x & 0x1FFFFF) << 42 | (u64) (pos.y & 0x1FFFFF) << 21 | (u64) (pos.z & 0x1FFFFF);
+	key *= 0x9E3779B97F4A7C15; // fibonacci hashing
+	return key ^ (key >> 32);
+}
+
+static TerrainChunk *index_find(TerrainIndex *index, v3s32 pos, u64 hash)
+{
+	for (size_t i = hash & index->mask;; i = (i + 1) & index->mask) {
+		TerrainChunk *chunk = atomic_load_explicit(&index->slots[i], memory_order_acquire);
+
+		if (chunk == TOMBSTONE)
+			continue;
+
+		if (!chunk || v3s32_equals(chunk->pos, pos))
+			return chunk;
+	}
+}
+
+// returns true if a tombstone was reused
+static bool index_insert(TerrainIndex *index, TerrainChunk *chunk, u64 hash)
+{
+	for (size_t i = hash & index->mask;; i = (i + 1) & index->mask) {
+		TerrainChunk *expected = atomic_load_explicit(&index->slots[i], memory_order_relaxed);
+
+		if (expected != NULL && expected != TOMBSTONE)
+			continue;
 
-static TerrainChunk *allocate_chunk(v3s32 pos)
+		if (atomic_compare_exchange_strong_explicit(&index->slots[i], &expected, chunk,
+				memory_order_release, memory_order_relaxed))
+			return expected == TOMBSTONE;
+	}
+}
+
+static void index_remove(TerrainIndex *index, TerrainChunk *chunk, u64 hash)
+{
+	for (size_t i = hash & index->mask;; i = (i + 1) & index->mask) {
+		TerrainChunk *found = atomic_load_explicit(&index->slots[i], memory_order_relaxed);
+		assert(found);
+
+		if (found == chunk) {
+			atomic_store_explicit(&index->slots[i], TOMBSTONE, memory_order_release);
+			return;
+		}
+	}
+}
+
+static void free_indices(TerrainIndex *index)
+{
+	while (index) {
+		TerrainIndex *old = index->old;
+		free(index);
+		index = old;
+	}
+}
+
+// only updates the chunk if the clock has moved on, so hot chunks don't cause constant writes
+static inline void touch_chunk(Terrain *terrain, TerrainChunk *chunk)
 {
-	TerrainChunk *chunk = malloc(sizeof * chunk);
+	u64 clock = atomic_load_explicit(&terrain->clock, memory_order_relaxed);
+
+	if (atomic_load_explicit(&chunk->last_access, memory_order_relaxed) != clock)
+		atomic_store_explicit(&chunk->last_access, clock, memory_order_relaxed);
+}
+
+static TerrainChunk *cache_get(Terrain *terrain, v3s32 pos, u64 hash, u64 epoch)
+{
+	CacheEntry *ways = cache[(hash >> 8) % CACHE_SETS].ways;
+
+	for (int i = 0; i < CACHE_WAYS; i++)
+		if (ways[i].terrain == terrain->id && ways[i].epoch == epoch && v3s32_equals(ways[i].pos, pos))
+			return ways[i].chunk;
+
+	return NULL;
+}
+
+// epoch has to be obtained before looking up the chunk
+static void cache_put(Terrain *terrain, TerrainChunk *chunk, u64 hash, u64 epoch)
+{
+	CacheSet *set = &cache[(hash >> 8) % CACHE_SETS];
+
+	set->ways[set->next] = (CacheEntry) {
+		.terrain = terrain->id,
+		.epoch = epoch,
+		.pos = chunk->pos,
+		.chunk = chunk,
+	};
+
+	set->next = (set->next + 1) % CACHE_WAYS;
+}
+
+static inline size_t node_index(v3s32 offset)
+{
+	return (offset.x * CHUNK_SIZE + offset.y) * CHUNK_SIZE + offset.z;
+}
+
+// bits always divide 64, so an index never spans two words
+static inline unsigned int get_palette_index(TerrainChunkIndices *indices, size_t i)
+{
+	size_t shift = i * indices->bits;
+	return (indices->words[shift / 64] >> (shift % 64)) & ((1u << indices->bits) - 1);
+}
+
+static inline void set_palette_index(TerrainChunkIndices *indices, size_t i, unsigned int idx)
+{
+	size_t shift = i * indices->bits;
+	u64 *word = &indices->words[shift / 64];
+	u64 mask = (((u64) 1 << indices->bits) - 1) << (shift % 64);
+	*word = (*word & ~mask) | ((u64) idx << (shift % 64));
+}
+
+static TerrainChunkIndices *create_indices(u8 bits)
+{
+	TerrainChunkIndices *indices = calloc(1, sizeof *indices + sizeof *indices->words * (CHUNK_VOLUME / 64 * bits));
+	indices->bits = bits;
+	return indices;
+}
+
+static TerrainChunkPalette *create_palette(u8 bits)
+{
+	TerrainChunkPalette *palette = malloc(sizeof *palette + sizeof *palette->types * (1 << bits));
+	palette->cap = 1 << bits;
+	return palette;
+}
+
+static inline bool is_uniform(TerrainChunkData *data)
+{
+	return data->indices == (TerrainChunkIndices *) &uniform_indices;
+}
+
+// chunks start out uniform
+static void init_chunk_data(TerrainChunkData *data, NodeType type)
+{
+	data->num_types = 1;
+	data->palette = create_palette(1);
+	data->palette->types[0] = type;
+	data->indices = (TerrainChunkIndices *) &uniform_indices;
+	data->extra = NULL;
+}
+
+static void delete_chunk_data(TerrainChunkData *data)
+{
+	free(data->palette);
+	if (!is_uniform(data))
+		free(data->indices);
+	free(data->extra);
+}
+
+// free an array once no optimistic reader can be using it anymore
+// retired is the list of the chunk the array belonged to, the chunk lock protects it, so writers don't need another lock
+// arrays that were never visible to readers are freed right away (retired is NULL)
+static void retire_array(Array *retired, void *ptr)
+{
+	if (!ptr || ptr == &uniform_indices)
+		return;
+
+	if (retired)
+		array_apd(retired, &(RetiredArray) {ptr, 0});
+	else
+		free(ptr);
+}
+
+// age retired arrays of a chunk and free the ones whose grace period is over, the chunk has to be write locked
+static void free_retired_arrays(Array *retired, u64 clock)
+{
+	RetiredArray *arrays = retired->ptr;
+	size_t num_freed = 0;
+
+	// arrays are ordered by time of retirement
+	for (size_t i = 0; i < retired->siz; i++) {
+		if (arrays[i].retired == 0)
+			arrays[i].retired = clock;
+		else if (arrays[i].retired + TERRAIN_EVICT_GRACE <= clock && num_freed == i)
+			free(arrays[num_freed++].ptr);
+	}
+
+	memmove(arrays, &arrays[num_freed], sizeof *arrays * (retired->siz - num_freed));
+	retired->siz -= num_freed;
+}
+
+// all arrays of a chunk that is freed
+static void clear_retired_arrays(Array *retired)
+{
+	for (size_t i = 0; i < retired->siz; i++)
+		free(((RetiredArray *) retired->ptr)[i].ptr);
+
+	array_clr(retired);
+}
+
+// arrays have to be fully initialized before they are made visible to optimistic readers
+static inline void publish_array(void **field, void *ptr)
+{
+	atomic_thread_fence(memory_order_release);
+	LOAD_ONCE(*field) = ptr;
+}
+
+// seqlock write side, the chunk lock has to be held in write mode
+static inline void write_begin(TerrainChunk *chunk)
+{
+	atomic_fetch_add_explicit(&chunk->seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static inline void write_end(TerrainChunk *chunk)
+{
+	atomic_fetch_add_explicit(&chunk->seq, 1, memory_order_release);
+}
+
+// seqlock read side, returns false if a writer is active
+static inline bool read_begin(TerrainChunk *chunk, unsigned int *seq)
+{
+	*seq = atomic_load_explicit(&chunk->seq, memory_order_acquire);
+	return !(*seq & 1);
+}
+
+// returns true if no writer interfered since read_begin
+static inline bool read_validate(TerrainChunk *chunk, unsigned int seq)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&chunk->seq, memory_order_relaxed) == seq;
+}
+
+static inline bool has_data(NodeType type)
+{
+	return type < COUNT_NODE && node_def[type].has_data;
+}
+
+// binary search in side table, returns position of entry or where it would have to be inserted
+static size_t find_extra(TerrainChunkExtra *extra, u16 index, bool *found)
+{
+	size_t lo = 0, hi = extra ? extra->num : 0;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (extra->entries[mid].index < index)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*found = extra && lo < extra->num && extra->entries[lo].index == index;
+	return lo;
+}
+
+static void set_extra(TerrainChunkData *data, Array *retired, u16 index, TerrainNode *node)
+{
+	bool found;
+	size_t pos = find_extra(data->extra, index, &found);
+	TerrainChunkExtra *extra = data->extra;
+
+	if (has_data(node->type)) {
+		if (!found) {
+			if (!extra || extra->num == extra->cap) {
+				u16 cap = extra ? extra->cap * 2 : 16;
+				TerrainChunkExtra *grown = malloc(sizeof *grown + sizeof *grown->entries * cap);
+				grown->num = extra ? extra->num : 0;
+				grown->cap = cap;
+
+				if (extra)
+					memcpy(grown->entries, extra->entries, sizeof *extra->entries * extra->num);
+
+				publish_array((void **) &data->extra, grown);
+				retire_array(retired, extra);
+				extra = grown;
+			}
+
+			memmove(&extra->entries[pos + 1], &extra->entries[pos], sizeof *extra->entries * (extra->num - pos));
+			extra->num++;
+			extra->entries[pos].index = index;
+		}
+
+		memcpy(extra->entries[pos].data, node->data, TERRAIN_NODE_DATA_SIZE);
+	} else if (found) {
+		extra->num--;
+		memmove(&extra->entries[pos], &extra->entries[pos + 1], sizeof *extra->entries * (extra->num - pos));
+	}
+}
+
+// remove unused palette entries, increase index width if the palette is still full afterwards
+static void grow_palette(TerrainChunkData *data, Array *retired)
+{
+	unsigned int remap[1 << 8];
+	bool used[1 << 8] = {false};
+
+	for (size_t i = 0; i < CHUNK_VOLUME; i++)
+		used[get_palette_index(data->indices, i)] = true;
+
+	u16 num_types = 0;
+	for (unsigned int i = 0; i < data->num_types; i++)
+		if (used[i])
+			data->palette->types[remap[i] = num_types++] = data->palette->types[i];
+
+	TerrainChunkIndices *indices = data->indices;
+	data->num_types = num_types;
+
+	if (num_types == 1u << indices->bits) {
+		u8 bits = indices->bits * 2;
+		assert(bits <= 8); // there are less than 256 node types
+
+		TerrainChunkPalette *palette = create_palette(bits);
+		memcpy(palette->types, data->palette->types, sizeof *palette->types * num_types);
+
+		TerrainChunkIndices *grown = create_indices(bits);
+		for (size_t i = 0; i < CHUNK_VOLUME; i++)
+			set_palette_index(grown, i, remap[get_palette_index(indices, i)]);
+
+		retire_array(retired, data->palette);
+		retire_array(retired, indices);
+		publish_array((void **) &data->palette, palette);
+		publish_array((void **) &data->indices, grown);
+	} else {
+		for (size_t i = 0; i < CHUNK_VOLUME; i++)
+			set_palette_index(indices, i, remap[get_palette_index(indices, i)]);
+	}
+}
+
+static unsigned int find_palette_index(TerrainChunkData *data, Array *retired, NodeType type)
+{
+	for (unsigned int i = 0; i < data->num_types; i++)
+		if (data->palette->types[i] == type)
+			return i;
+
+	if (data->num_types == data->palette->cap)
+		grow_palette(data, retired);
+
+	data->palette->types[data->num_types] = type;
+	return data->num_types++;
+}
+
+// swap in new chunk data, old arrays are retired since optimistic readers may still be using them
+static void replace_chunk_data(TerrainChunk *chunk, TerrainChunkData *data)
+{
+	TerrainChunkData old = chunk->data;
+
+	write_begin(chunk);
+	chunk->data.num_types = data->num_types;
+	publish_array((void **) &chunk->data.palette, data->palette);
+	publish_array((void **) &chunk->data.indices, data->indices);
+	publish_array((void **) &chunk->data.extra, data->extra);
+	write_end(chunk);
+
+	retire_array(&chunk->retired, old.palette);
+	retire_array(&chunk->retired, old.indices);
+	retire_array(&chunk->retired, old.extra);
+}
+
+// copy type of node i without locking, returns false if arrays of different versions were seen
+static inline bool peek_type(TerrainChunk *chunk, size_t i, NodeType *type)
+{
+	TerrainChunkIndices *indices = LOAD_ONCE(chunk->data.indices);
+	TerrainChunkPalette *palette = LOAD_ONCE(chunk->data.palette);
+
+	u8 bits = LOAD_ONCE(indices->bits);
+	size_t shift = i * bits;
+	unsigned int idx = (LOAD_ONCE(indices->words[shift / 64]) >> (shift % 64)) & ((1u << bits) - 1);
+
+	if (idx >= LOAD_ONCE(palette->cap))
+		return false;
+
+	*type = LOAD_ONCE(palette->types[idx]);
+	return true;
+}
+
+// copy node i without locking, the result is only meaningful if the read validates
+static inline bool peek_node(TerrainChunk *chunk, size_t i, TerrainNode *node)
+{
+	if (!peek_type(chunk, i, &node->type))
+		return false;
+
+	if (!has_data(node->type))
+		return true;
+
+	TerrainChunkExtra *extra = LOAD_ONCE(chunk->data.extra);
+	if (!extra)
+		return true;
+
+	// entries may be shifted around concurrently, so num must not exceed the capacity of this array
+	size_t num = u16_min(LOAD_ONCE(extra->num), LOAD_ONCE(extra->cap));
+	size_t lo = 0, hi = num;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (LOAD_ONCE(extra->entries[mid].index) < i)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < num && LOAD_ONCE(extra->entries[lo].index) == i)
+		memcpy(node->data, extra->entries[lo].data, TERRAIN_NODE_DATA_SIZE);
+
+	return true;
+}
+
+static TerrainChunk *allocate_chunk(Terrain *terrain, v3s32 pos)
+{
+	TerrainChunk *chunk = slab_alloc(terrain->chunk_slab);
 	chunk->level = pos.y;
 	chunk->pos = pos;
 	chunk->extra = NULL;
 	pthread_rwlock_init(&chunk->lock, NULL);
-
-	CHUNK_ITERATE
-		chunk->data[x][y][z] = (TerrainNode) {NODE_UNKNOWN, NULL};
+	atomic_init(&chunk->seq, 0);
+	atomic_init(&chunk->pins, 0);
+	atomic_init(&chunk->last_access, 0);
+	init_chunk_data(&chunk->data, NODE_UNKNOWN);
+	array_ini(&chunk->retired, sizeof(RetiredArray), 8);
 
 	return chunk;
 }
 
 static void free_chunk(Terrain *terrain, TerrainChunk *chunk)
 {
-	if (terrain->callbacks.delete_node) CHUNK_ITERATE
-		terrain->callbacks.delete_node(&chunk->data[x][y][z]);
-
+	delete_chunk_data(&chunk->data);
+	clear_retired_arrays(&chunk->retired);
 	pthread_rwlock_destroy(&chunk->lock);
-	free(chunk);
+	slab_free(terrain->chunk_slab, chunk);
 }
 
 static void delete_chunk(TerrainChunk *chunk, Terrain *terrain)
@@ -44,98 +512,155 @@ static void delete_chunk(TerrainChunk *chunk, Terrain *terrain)
 	free_chunk(terrain, chunk);
 }
 
-static void delete_sector(TerrainSector *sector, Terrain *terrain)
+// chunks themselves are released along with their slab
+static void release_chunk(TerrainChunk *chunk, Terrain *terrain)
 {
-	tree_clr(&sector->chunks, &delete_chunk, terrain, NULL, 0);
-	pthread_rwlock_destroy(&sector->lock);
-	free(sector);
+	if (terrain->callbacks.delete_chunk)
+		terrain->callbacks.delete_chunk(chunk);
+
+	delete_chunk_data(&chunk->data);
+	clear_retired_arrays(&chunk->retired);
+	pthread_rwlock_destroy(&chunk->lock);
 }
 
-static TerrainSector *get_sector(Terrain *terrain, v2s32 pos, int mode)
+static inline bool index_full(Terrain *terrain, size_t size)
 {
-	if (mode == CHUNK_MODE_CREATE)
-		pthread_rwlock_wrlock(&terrain->lock);
-	else
-		pthread_rwlock_rdlock(&terrain->lock);
+	return (atomic_load(&terrain->num_chunks) + atomic_load(&terrain->num_tombstones)) * 2 > size;
+}
+
+// rebuild the index once it is half full, dropping tombstones
+// the size is doubled unless most of the used slots were tombstones
+static void grow_index(Terrain *terrain)
+{
+	pthread_rwlock_wrlock(&terrain->lock);
+
+	TerrainIndex *old = atomic_load_explicit(&terrain->index, memory_order_relaxed);
+	size_t size = old->mask + 1;
+
+	if (index_full(terrain, size)) {
+		TerrainIndex *index = create_index(atomic_load(&terrain->num_chunks) * 4 > size ? size * 2 : size, old);
 
-	TreeNode **loc = tree_nfd(&terrain->sectors, &pos, &v2s32_cmp);
-	TerrainSector *sector = NULL;
+		for (size_t i = 0; i < size; i++) {
+			TerrainChunk *chunk = atomic_load_explicit(&old->slots[i], memory_order_relaxed);
 
-	if (*loc) {
-		sector = (*loc)->dat;
-	} else if (mode == CHUNK_MODE_CREATE) {
-		sector = malloc(sizeof *sector);
-		sector->pos = pos;
-		tree_ini(&sector->chunks);
-		pthread_rwlock_init(&sector->lock, NULL);
+			if (chunk && chunk != TOMBSTONE)
+				index_insert(index, chunk, hash_pos(chunk->pos));
+		}
+
+		old->retired = atomic_load(&terrain->clock);
+		atomic_store(&terrain->num_tombstones, 0);
+		atomic_store_explicit(&terrain->index, index, memory_order_release);
+	}
+
+	pthread_rwlock_unlock(&terrain->lock);
+}
+
+// look up chunk again while holding the stripe lock, create and insert it if it still doesn't exist
+static TerrainChunk *create_chunk(Terrain *terrain, v3s32 pos, u64 hash, bool *created)
+{
+	pthread_mutex_t *stripe = &terrain->stripes[(hash >> 16) % TERRAIN_INDEX_STRIPES];
+
+	pthread_mutex_lock(stripe);
+	pthread_rwlock_rdlock(&terrain->lock);
+
+	TerrainIndex *index = atomic_load_explicit(&terrain->index, memory_order_acquire);
+	TerrainChunk *chunk = index_find(index, pos, hash);
+	bool grow = false;
+
+	if ((*created = !chunk)) {
+		chunk = allocate_chunk(terrain, pos);
+
+		if (terrain->callbacks.create_chunk)
+			terrain->callbacks.create_chunk(chunk);
+
+		atomic_store_explicit(&chunk->last_access, atomic_load(&terrain->clock), memory_order_relaxed);
+
+		if (index_insert(index, chunk, hash))
+			atomic_fetch_sub(&terrain->num_tombstones, 1);
 
-		tree_nmk(&terrain->sectors, loc, sector);
+		atomic_fetch_add(&terrain->num_chunks, 1);
+		grow = index_full(terrain, index->mask + 1);
 	}
 
 	pthread_rwlock_unlock(&terrain->lock);
+	pthread_mutex_unlock(stripe);
 
-	return sector;
+	if (grow)
+		grow_index(terrain);
+
+	return chunk;
 }
 
 Terrain *terrain_create()
 {
 	Terrain *terrain = malloc(sizeof *terrain);
-	tree_ini(&terrain->sectors);
+	atomic_init(&terrain->index, create_index(INDEX_INITIAL_SIZE, NULL));
+	atomic_init(&terrain->num_chunks, 0);
+	atomic_init(&terrain->num_tombstones, 0);
 	pthread_rwlock_init(&terrain->lock, NULL);
-	terrain->cache = NULL;
-	pthread_rwlock_init(&terrain->cache_lock, NULL);
+	for (int i = 0; i < TERRAIN_INDEX_STRIPES; i++)
+		pthread_mutex_init(&terrain->stripes[i], NULL);
+	terrain->id = atomic_fetch_add(&next_id, 1);
+	atomic_init(&terrain->epoch, 0);
+	atomic_init(&terrain->clock, 0);
+	list_ini(&terrain->graveyard);
+	terrain->chunk_slab = slab_create(sizeof(TerrainChunk));
 	return terrain;
 }
 
 void terrain_delete(Terrain *terrain)
 {
-	tree_clr(&terrain->sectors, &delete_sector, terrain, NULL, 0);
+	TerrainIndex *index = atomic_load(&terrain->index);
+
+	for (size_t i = 0; i <= index->mask; i++) {
+		TerrainChunk *chunk = atomic_load_explicit(&index->slots[i], memory_order_relaxed);
+
+		if (chunk && chunk != TOMBSTONE)
+			release_chunk(chunk, terrain);
+	}
+
+	free_indices(index);
+	list_clr(&terrain->graveyard, &release_chunk, terrain, NULL);
+	slab_delete(terrain->chunk_slab);
+
 	pthread_rwlock_destroy(&terrain->lock);
-	pthread_rwlock_destroy(&terrain->cache_lock);
+	for (int i = 0; i < TERRAIN_INDEX_STRIPES; i++)
+		pthread_mutex_destroy(&terrain->stripes[i]);
 	free(terrain);
 }
 
 TerrainChunk *terrain_get_chunk(Terrain *terrain, v3s32 pos, int mode)
 {
-	TerrainChunk *cache = NULL;
-
-	pthread_rwlock_rdlock(&terrain->cache_lock);
-	cache = terrain->cache;
-	pthread_rwlock_unlock(&terrain->cache_lock);
+	u64 hash = hash_pos(pos);
+	u64 epoch = atomic_load_explicit(&terrain->epoch, memory_order_acquire);
 
-	if (cache && v3s32_equals(cache->pos, pos))
-		return cache;
+	TerrainChunk *chunk = cache_get(terrain, pos, hash, epoch);
+	if (chunk) {
+		touch_chunk(terrain, chunk);
+		return chunk;
+	}
 
-	TerrainSector *sector = get_sector(terrain, (v2s32) {pos.x, pos.z}, mode);
-	if (!sector)
-		return NULL;
+	chunk = index_find(atomic_load_explicit(&terrain->index, memory_order_acquire), pos, hash);
 
-	if (mode == CHUNK_MODE_CREATE)
-		pthread_rwlock_wrlock(&sector->lock);
-	else
-		pthread_rwlock_rdlock(&sector->lock);
+	if (!chunk && mode == CHUNK_MODE_CREATE) {
+		bool created;
+		chunk = create_chunk(terrain, pos, hash, &created);
 
-	TreeNode **loc = tree_nfd(&sector->chunks, &pos.y, &s32_cmp);
-	TerrainChunk *chunk = NULL;
+		if (created)
+			return chunk;
+	}
 
-	if (*loc) {
-		chunk = (*loc)->dat;
+	if (!chunk)
+		return NULL;
 
-		if (terrain->callbacks.get_chunk && !terrain->callbacks.get_chunk(chunk, mode)) {
-			chunk = NULL;
-		} else {
-			pthread_rwlock_wrlock(&terrain->cache_lock);
-			terrain->cache = chunk;
-			pthread_rwlock_unlock(&terrain->cache_lock);
-		}
-	} else if (mode == CHUNK_MODE_CREATE) {
-		tree_nmk(&sector->chunks, loc, chunk = allocate_chunk(pos));
+	touch_chunk(terrain, chunk);
 
-		if (terrain->callbacks.create_chunk)
-			terrain->callbacks.create_chunk(chunk);
-	}
+	if (terrain->callbacks.get_chunk && !terrain->callbacks.get_chunk(chunk, mode))
+		return NULL;
 
-	pthread_rwlock_unlock(&sector->lock);
+	// only cache chunks that passed the strictest check, so hits are valid for any mode
+	if (mode == CHUNK_MODE_PASSIVE || !terrain->callbacks.get_chunk)
+		cache_put(terrain, chunk, hash, epoch);
 
 	return chunk;
 }
@@ -149,52 +674,400 @@ TerrainChunk *terrain_get_chunk_nodep(Terrain *terrain, v3s32 nodep, v3s32 *offs
 	return chunk;
 }
 
-Blob terrain_serialize_chunk(__attribute__((unused)) Terrain *terrain, TerrainChunk *chunk, void (*callback)(TerrainNode *node, Blob *buffer))
+void terrain_invalidate_cache(Terrain *terrain)
 {
-	bool empty = true;
+	atomic_fetch_add_explicit(&terrain->epoch, 1, memory_order_release);
+}
+
+void terrain_pin_chunk(TerrainChunk *chunk)
+{
+	// sequentially consistent, so it can't be missed by remove_chunk
+	atomic_fetch_add(&chunk->pins, 1);
+}
+
+void terrain_unpin_chunk(TerrainChunk *chunk)
+{
+	atomic_fetch_sub_explicit(&chunk->pins, 1, memory_order_release);
+}
+
+static int cmp_evict_candidate(const void *a, const void *b)
+{
+	u64 x = ((const EvictCandidate *) a)->last_access;
+	u64 y = ((const EvictCandidate *) b)->last_access;
+	return x < y ? -1 : x > y;
+}
+
+static inline bool evictable(TerrainChunk *chunk, u64 clock)
+{
+	return atomic_load_explicit(&chunk->pins, memory_order_acquire) == 0
+		&& atomic_load_explicit(&chunk->last_access, memory_order_relaxed) + TERRAIN_EVICT_IDLE <= clock;
+}
 
-	CHUNK_ITERATE {
-		if (chunk->data[x][y][z].type != NODE_AIR) {
-			empty = false;
+// free index tables that were replaced long enough ago for no lookup to be using them anymore
+static void free_retired_indices(Terrain *terrain, u64 clock)
+{
+	pthread_rwlock_rdlock(&terrain->lock);
+
+	TerrainIndex *index = atomic_load_explicit(&terrain->index, memory_order_acquire);
+
+	// tables are ordered from newest to oldest
+	for (TerrainIndex **old = &index->old; *old; old = &(*old)->old) {
+		if ((*old)->retired + TERRAIN_EVICT_GRACE <= clock) {
+			free_indices(*old);
+			*old = NULL;
 			break;
 		}
 	}
 
-	if (empty)
-		return (Blob) {0, NULL};
+	pthread_rwlock_unlock(&terrain->lock);
+}
 
-	SerializedTerrainChunk serialized_chunk;
+// free arrays retired by writers of chunks in the index
+// chunks that are locked right now are skipped, their arrays are freed by a later pass
+static void free_chunk_arrays(Terrain *terrain, u64 clock)
+{
+	pthread_rwlock_rdlock(&terrain->lock);
 
-	CHUNK_ITERATE {
-		TerrainNode *node = &chunk->data[x][y][z];
-		SerializedTerrainNode *serialized = &serialized_chunk.raw.nodes[x][y][z];
+	TerrainIndex *index = atomic_load_explicit(&terrain->index, memory_order_acquire);
 
-		serialized->type = node->type;
-		serialized->data = (Blob) {0, NULL};
+	for (size_t i = 0; i <= index->mask; i++) {
+		TerrainChunk *chunk = atomic_load_explicit(&index->slots[i], memory_order_acquire);
 
-		if (callback)
-			callback(node, &serialized->data);
+		if (!chunk || chunk == TOMBSTONE || LOAD_ONCE(chunk->retired.siz) == 0)
+			continue;
+
+		if (pthread_rwlock_trywrlock(&chunk->lock) == 0) {
+			free_retired_arrays(&chunk->retired, clock);
+			pthread_rwlock_unlock(&chunk->lock);
+		}
 	}
 
-	Blob buffer = {0, NULL};
-	SerializedTerrainChunk_write(&buffer, &serialized_chunk);
-	SerializedTerrainChunk_free(&serialized_chunk);
-	return buffer;
+	pthread_rwlock_unlock(&terrain->lock);
 }
 
-bool terrain_deserialize_chunk(Terrain *terrain, TerrainChunk *chunk, Blob buffer, void (*callback)(TerrainNode *node, Blob buffer))
+// returns false if the chunk was pinned by a thread that looked it up before it was removed, it is put back then
+static bool remove_chunk(Terrain *terrain, TerrainChunk *chunk, u64 clock)
 {
-	if (buffer.siz == 0) {
-		CHUNK_ITERATE {
-			if (terrain->callbacks.delete_node)
-				terrain->callbacks.delete_node(&chunk->data[x][y][z]);
+	u64 hash = hash_pos(chunk->pos);
+	pthread_mutex_t *stripe = &terrain->stripes[(hash >> 16) % TERRAIN_INDEX_STRIPES];
+
+	pthread_mutex_lock(stripe);
+	pthread_rwlock_rdlock(&terrain->lock);
+
+	TerrainIndex *index = atomic_load_explicit(&terrain->index, memory_order_acquire);
+	index_remove(index, chunk, hash);
 
-			chunk->data[x][y][z] = (TerrainNode) {NODE_AIR, NULL};
+	// pairs with terrain_pin_chunk, a pin taken after this point is caught by the graveyard
+	atomic_thread_fence(memory_order_seq_cst);
+	bool removed = atomic_load_explicit(&chunk->pins, memory_order_relaxed) == 0;
+
+	// the stripe lock is held, so no other chunk was created at this position in the meantime
+	if (!removed)
+		index_insert(index, chunk, hash);
+	else {
+		atomic_fetch_sub(&terrain->num_chunks, 1);
+		atomic_fetch_add(&terrain->num_tombstones, 1);
+	}
+
+	pthread_rwlock_unlock(&terrain->lock);
+	pthread_mutex_unlock(stripe);
+
+	if (removed) {
+		atomic_store_explicit(&chunk->last_access, clock, memory_order_relaxed);
+		list_apd(&terrain->graveyard, chunk);
+	}
+
+	return removed;
+}
+
+size_t terrain_evict(Terrain *terrain, size_t max, bool (*callback)(TerrainChunk *chunk, void *arg), void *arg)
+{
+	u64 clock = atomic_fetch_add(&terrain->clock, 1) + 1;
+
+	// graveyard is ordered by time of removal
+	while (terrain->graveyard.fst) {
+		TerrainChunk *chunk = terrain->graveyard.fst->dat;
+
+		if (atomic_load_explicit(&chunk->last_access, memory_order_relaxed) + TERRAIN_EVICT_GRACE > clock)
+			break;
+
+		list_nrm(&terrain->graveyard, &terrain->graveyard.fst);
+
+		// a thread that looked the chunk up before it was removed still uses it, wait for another grace period
+		if (atomic_load_explicit(&chunk->pins, memory_order_acquire) > 0) {
+			atomic_store_explicit(&chunk->last_access, clock, memory_order_relaxed);
+			list_apd(&terrain->graveyard, chunk);
+			continue;
 		}
 
+		delete_chunk(chunk, terrain);
+	}
+
+	free_retired_indices(terrain, clock);
+	free_chunk_arrays(terrain, clock);
+
+	if (max == 0)
+		return 0;
+
+	pthread_rwlock_rdlock(&terrain->lock);
+
+	TerrainIndex *index = atomic_load_explicit(&terrain->index, memory_order_acquire);
+	EvictCandidate *candidates = malloc(sizeof *candidates * (index->mask + 1));
+	size_t num_candidates = 0;
+
+	for (size_t i = 0; i <= index->mask; i++) {
+		TerrainChunk *chunk = atomic_load_explicit(&index->slots[i], memory_order_acquire);
+
+		if (chunk && chunk != TOMBSTONE && evictable(chunk, clock))
+			candidates[num_candidates++] = (EvictCandidate) {
+				.last_access = atomic_load_explicit(&chunk->last_access, memory_order_relaxed),
+				.chunk = chunk,
+			};
+	}
+
+	pthread_rwlock_unlock(&terrain->lock);
+
+	qsort(candidates, num_candidates, sizeof *candidates, &cmp_evict_candidate);
+
+	size_t evicted = 0;
+
+	for (size_t i = 0; i < num_candidates && evicted < max; i++) {
+		TerrainChunk *chunk = candidates[i].chunk;
+
+		// the chunk may have been used while the candidates were collected
+		if (!evictable(chunk, clock))
+			continue;
+
+		// thread local caches must not return the chunk while it is written back or after it was removed
+		atomic_fetch_add_explicit(&terrain->epoch, 1, memory_order_release);
+
+		if (callback && !callback(chunk, arg))
+			continue;
+
+		if (remove_chunk(terrain, chunk, clock))
+			evicted++;
+
+		// lookups between the first increment and the removal may have cached it again
+		atomic_fetch_add_explicit(&terrain->epoch, 1, memory_order_release);
+	}
+
+	free(candidates);
+
+	return evicted;
+}
+
+// interleave bits of the coordinates, so chunks close to each other are close in the lock order
+static u64 lock_order(v3s32 pos)
+{
+	u32 coords[3] = {pos.x & 0x1FFFFF, pos.y & 0x1FFFFF, pos.z & 0x1FFFFF};
+	u64 key = 0;
+
+	for (int bit = 0; bit < 21; bit++)
+		for (int i = 0; i < 3; i++)
+			key |= (u64) ((coords[i] >> bit) & 1) << (bit * 3 + 2 - i);
+
+	return key;
+}
+
+static int cmp_lock_order(TerrainChunk *const *a, TerrainChunk *const *b)
+{
+	u64 x = lock_order((*a)->pos);
+	u64 y = lock_order((*b)->pos);
+	return x < y ? -1 : x > y;
+}
+
+void terrain_lock_set_ini(TerrainLockSet *set)
+{
+	array_ini(&set->chunks, sizeof(TerrainChunk *), 8);
+}
+
+bool terrain_lock_set_add(TerrainLockSet *set, TerrainChunk *chunk)
+{
+	size_t idx;
+	if (array_fnd(&set->chunks, &chunk, &idx, &cmp_lock_order) != -1)
+		return true;
+
+	TerrainChunk **chunks = set->chunks.ptr;
+
+	// nothing that comes after it is locked, so waiting for it is fine
+	if (idx == set->chunks.siz) {
+		assert(pthread_rwlock_wrlock(&chunk->lock) == 0);
+		array_apd(&set->chunks, &chunk);
 		return true;
 	}
 
+	if (pthread_rwlock_trywrlock(&chunk->lock) == 0) {
+		array_put(&set->chunks, &chunk, idx);
+		return true;
+	}
+
+	// waiting while holding chunks that come after it could deadlock, release them and lock everything in order
+	for (size_t i = idx; i < set->chunks.siz; i++)
+		pthread_rwlock_unlock(&chunks[i]->lock);
+
+	array_put(&set->chunks, &chunk, idx);
+	chunks = set->chunks.ptr;
+
+	for (size_t i = idx; i < set->chunks.siz; i++)
+		assert(pthread_rwlock_wrlock(&chunks[i]->lock) == 0);
+
+	return false;
+}
+
+TerrainChunk *terrain_lock_set_get(TerrainLockSet *set, v3s32 pos)
+{
+	TerrainChunk **chunks = set->chunks.ptr;
+	u64 order = lock_order(pos);
+	size_t lo = 0, hi = set->chunks.siz;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (lock_order(chunks[mid]->pos) < order)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo < set->chunks.siz && v3s32_equals(chunks[lo]->pos, pos) ? chunks[lo] : NULL;
+}
+
+void terrain_lock_set_release(TerrainLockSet *set)
+{
+	TerrainChunk **chunks = set->chunks.ptr;
+
+	for (size_t i = 0; i < set->chunks.siz; i++)
+		pthread_rwlock_unlock(&chunks[i]->lock);
+
+	array_clr(&set->chunks);
+}
+
+// serialized chunks start with a length in the legacy format, so this can never be mistaken for one
+#define SERIALIZE_MAGIC 0xFFFFFFFF
+#define SERIALIZE_VERSION 1
+
+typedef enum {
+	ENCODING_RLE,    // runs of (palette index, length)
+	ENCODING_PACKED, // bit packed palette indices
+} SerializeEncoding;
+
+static inline u8 bits_for_types(unsigned int num_types)
+{
+	u8 bits = 1;
+	while ((1u << bits) < num_types)
+		bits *= 2;
+	return bits;
+}
+
+Blob terrain_serialize_chunk(__attribute__((unused)) Terrain *terrain, TerrainChunk *chunk, void (*callback)(TerrainNode *node, Blob *buffer))
+{
+	TerrainChunkData *data = &chunk->data;
+
+	// find used palette entries and count runs
+	bool used[1 << 8] = {false};
+	u16 num_runs = 0;
+	unsigned int last = -1;
+
+	if (is_uniform(data)) {
+		used[0] = true;
+		num_runs = 1;
+	} else for (size_t i = 0; i < CHUNK_VOLUME; i++) {
+		unsigned int idx = get_palette_index(data->indices, i);
+		used[idx] = true;
+
+		if (idx != last) {
+			last = idx;
+			num_runs++;
+		}
+	}
+
+	// remove unused entries from palette
+	u8 remap[1 << 8];
+	u16 palette[1 << 8];
+	u16 num_types = 0;
+	bool empty = true;
+
+	for (unsigned int i = 0; i < data->num_types; i++) {
+		if (used[i]) {
+			remap[i] = num_types;
+			palette[num_types++] = data->palette->types[i];
+
+			if (data->palette->types[i] != NODE_AIR)
+				empty = false;
+		}
+	}
+
+	if (empty)
+		return (Blob) {0, NULL};
+
+	u8 bits = bits_for_types(num_types);
+	u8 encoding = (size_t) num_runs * 3 < CHUNK_VOLUME / 8 * bits ? ENCODING_RLE : ENCODING_PACKED;
+
+	Blob buffer = {0, NULL};
+
+	u32_write(&buffer, &(u32) {SERIALIZE_MAGIC});
+	u8_write(&buffer, &(u8) {SERIALIZE_VERSION});
+	u8_write(&buffer, &encoding);
+
+	u16_write(&buffer, &num_types);
+	for (u16 i = 0; i < num_types; i++)
+		u16_write(&buffer, &palette[i]);
+
+	if (encoding == ENCODING_RLE && is_uniform(data)) {
+		u16_write(&buffer, &num_runs);
+		u8_write(&buffer, &(u8) {0});
+		u16_write(&buffer, &(u16) {CHUNK_VOLUME});
+	} else if (encoding == ENCODING_RLE) {
+		u16_write(&buffer, &num_runs);
+
+		for (size_t i = 0; i < CHUNK_VOLUME;) {
+			unsigned int idx = get_palette_index(data->indices, i);
+			u16 len = 0;
+
+			while (i < CHUNK_VOLUME && get_palette_index(data->indices, i) == idx) {
+				i++;
+				len++;
+			}
+
+			u8_write(&buffer, &remap[idx]);
+			u16_write(&buffer, &len);
+		}
+	} else {
+		TerrainChunkIndices *packed = create_indices(bits);
+
+		for (size_t i = 0; i < CHUNK_VOLUME; i++)
+			set_palette_index(packed, i, remap[get_palette_index(data->indices, i)]);
+
+		for (size_t i = 0; i < CHUNK_VOLUME / 64 * bits; i++)
+			u64_write(&buffer, &packed->words[i]);
+
+		free(packed);
+	}
+
+	// sparse list of nodes that carry data, side table is already sorted by index
+	u16 num_extra = data->extra ? data->extra->num : 0;
+	u16_write(&buffer, &num_extra);
+
+	for (u16 i = 0; i < num_extra; i++) {
+		TerrainNodeExtra *extra = &data->extra->entries[i];
+		TerrainNode node = {.type = data->palette->types[get_palette_index(data->indices, extra->index)]};
+		memcpy(node.data, extra->data, TERRAIN_NODE_DATA_SIZE);
+
+		Blob payload = {0, NULL};
+		if (callback)
+			callback(&node, &payload);
+
+		u16_write(&buffer, &extra->index);
+		Blob_write(&buffer, &payload);
+		Blob_free(&payload);
+	}
+
+	return buffer;
+}
+
+// read chunk in the format used before format versions were introduced
+static bool deserialize_legacy(TerrainChunk *chunk, Blob buffer, void (*callback)(TerrainNode *node, Blob buffer))
+{
 	// it's important to copy Blobs that have been malloc'd before reading from them
 	// because reading from a Blob modifies its data and size pointer,
 	// but does not free anything
@@ -202,36 +1075,326 @@ bool terrain_deserialize_chunk(Terrain *terrain, TerrainChunk *chunk, Blob buffe
 	bool success = SerializedTerrainChunk_read(&buffer, &serialized_chunk);
 
 	if (success) CHUNK_ITERATE {
-		if (terrain->callbacks.delete_node)
-			terrain->callbacks.delete_node(&chunk->data[x][y][z]);
-
-		TerrainNode *node = &chunk->data[x][y][z];
 		SerializedTerrainNode *serialized = &serialized_chunk.raw.nodes[x][y][z];
-
-		node->type = serialized->type;
+		TerrainNode node = {.type = serialized->type};
 
 		if (callback)
-			callback(node, serialized->data);
+			callback(&node, serialized->data);
+
+		terrain_chunk_set_node(chunk, (v3s32) {x, y, z}, node);
 	}
 
 	SerializedTerrainChunk_free(&serialized_chunk);
 	return success;
 }
 
+static bool deserialize_indices(TerrainChunkData *data, Blob *buffer, u8 encoding)
+{
+	if (encoding == ENCODING_RLE) {
+		u16 num_runs;
+		if (!u16_read(buffer, &num_runs))
+			return false;
+
+		size_t i = 0;
+
+		for (u16 run = 0; run < num_runs; run++) {
+			u8 idx;
+			u16 len;
+
+			if (!u8_read(buffer, &idx) || !u16_read(buffer, &len))
+				return false;
+
+			if (idx >= data->num_types || len > CHUNK_VOLUME - i)
+				return false;
+
+			// indices start out as zero, which also keeps uniform chunks from being written to
+			if (idx != 0)
+				for (u16 j = 0; j < len; j++)
+					set_palette_index(data->indices, i + j, idx);
+
+			i += len;
+		}
+
+		return i == CHUNK_VOLUME;
+	} else if (encoding == ENCODING_PACKED) {
+		for (size_t i = 0; i < CHUNK_VOLUME / 64 * data->indices->bits; i++) {
+			u64 word;
+			if (!u64_read(buffer, &word))
+				return false;
+
+			if (is_uniform(data)) {
+				if (word != 0)
+					return false;
+			} else {
+				data->indices->words[i] = word;
+			}
+		}
+
+		for (size_t i = 0; i < CHUNK_VOLUME; i++)
+			if (get_palette_index(data->indices, i) >= data->num_types)
+				return false;
+
+		return true;
+	}
+
+	return false;
+}
+
+static bool deserialize_extra(TerrainChunkData *data, Blob *buffer, void (*callback)(TerrainNode *node, Blob buffer))
+{
+	u16 num_extra;
+	if (!u16_read(buffer, &num_extra))
+		return false;
+
+	for (u16 i = 0; i < num_extra; i++) {
+		u16 index;
+		u32 siz;
+
+		if (!u16_read(buffer, &index) || index >= CHUNK_VOLUME || !u32_read(buffer, &siz) || siz > buffer->siz)
+			return false;
+
+		// payload is read in place instead of copying it
+		Blob payload = {siz, buffer->data};
+		buffer->data = (u8 *) buffer->data + siz;
+		buffer->siz -= siz;
+
+		TerrainNode node = {.type = data->palette->types[get_palette_index(data->indices, index)]};
+
+		if (callback)
+			callback(&node, payload);
+
+		// data isn't visible to readers yet
+		set_extra(data, NULL, index, &node);
+	}
+
+	return true;
+}
+
+bool terrain_deserialize_chunk(__attribute__((unused)) Terrain *terrain, TerrainChunk *chunk, Blob buffer, void (*callback)(TerrainNode *node, Blob buffer))
+{
+	if (buffer.siz == 0) {
+		terrain_chunk_fill(chunk, NODE_AIR);
+		return true;
+	}
+
+	Blob peek = buffer;
+	u32 magic;
+
+	if (!u32_read(&peek, &magic) || magic != SERIALIZE_MAGIC)
+		return deserialize_legacy(chunk, buffer, callback);
+
+	u8 version, encoding;
+	u16 num_types;
+
+	if (!u8_read(&peek, &version) || version != SERIALIZE_VERSION
+			|| !u8_read(&peek, &encoding)
+			|| !u16_read(&peek, &num_types) || num_types == 0 || num_types > 1 << 8)
+		return false;
+
+	// build chunk data directly instead of setting nodes one by one
+	u8 bits = bits_for_types(num_types);
+	TerrainChunkData data = {
+		.num_types = num_types,
+		.palette = create_palette(bits),
+		.indices = num_types == 1
+			? (TerrainChunkIndices *) &uniform_indices
+			: create_indices(bits),
+		.extra = NULL,
+	};
+
+	bool success = true;
+
+	for (u16 i = 0; i < num_types && success; i++) {
+		u16 type;
+		success = u16_read(&peek, &type);
+		data.palette->types[i] = type;
+	}
+
+	success = success
+		&& deserialize_indices(&data, &peek, encoding)
+		&& deserialize_extra(&data, &peek, callback);
+
+	if (!success) {
+		delete_chunk_data(&data);
+		return false;
+	}
+
+	replace_chunk_data(chunk, &data);
+	return true;
+}
+
 TerrainNode terrain_get_node(Terrain *terrain, v3s32 pos)
 {
 	v3s32 offset;
 	TerrainChunk *chunk = terrain_get_chunk_nodep(terrain, pos, &offset, CHUNK_MODE_PASSIVE);
 	if (!chunk)
-		return (TerrainNode) {COUNT_NODE, NULL};
+		return (TerrainNode) {.type = COUNT_NODE};
+
+	return terrain_chunk_read_node(chunk, offset);
+}
+
+// copy types of the nodes in part of a chunk, returns false if a writer interfered
+static bool peek_box(TerrainChunk *chunk, aabb3s32 box, aabb3s32 part, v3s32 base, NodeType *buffer)
+{
+	unsigned int seq;
+	if (!read_begin(chunk, &seq))
+		return false;
+
+	for (s32 x = part.min.x; x <= part.max.x; x++)
+	for (s32 y = part.min.y; y <= part.max.y; y++)
+	for (s32 z = part.min.z; z <= part.max.z; z++) {
+		v3s32 pos = {x, y, z};
+		if (!peek_type(chunk, node_index(v3s32_sub(pos, base)), &buffer[terrain_box_index(box, pos)]))
+			return false;
+	}
+
+	return read_validate(chunk, seq);
+}
+
+void terrain_read_box(Terrain *terrain, aabb3s32 box, NodeType *buffer)
+{
+	v3s32 cmin = terrain_chunkp(box.min);
+	v3s32 cmax = terrain_chunkp(box.max);
+
+	for (s32 cx = cmin.x; cx <= cmax.x; cx++)
+	for (s32 cy = cmin.y; cy <= cmax.y; cy++)
+	for (s32 cz = cmin.z; cz <= cmax.z; cz++) {
+		v3s32 chunkp = {cx, cy, cz};
+		v3s32 base = v3s32_scale(chunkp, CHUNK_SIZE);
+
+		v3s32 last = v3s32_add(base, (v3s32) {CHUNK_SIZE - 1, CHUNK_SIZE - 1, CHUNK_SIZE - 1});
+
+		// part of the box covered by this chunk
+		aabb3s32 part = {
+			v3s32_clamp(box.min, base, last),
+			v3s32_clamp(box.max, base, last),
+		};
+
+		TerrainChunk *chunk = terrain_get_chunk(terrain, chunkp, CHUNK_MODE_PASSIVE);
+
+		bool done = false;
+		for (int attempt = 0; chunk && attempt < OPTIMISTIC_ATTEMPTS && !done; attempt++)
+			done = peek_box(chunk, box, part, base, buffer);
+
+		if (done)
+			continue;
+
+		if (chunk)
+			assert(pthread_rwlock_rdlock(&chunk->lock) == 0);
+
+		for (s32 x = part.min.x; x <= part.max.x; x++)
+		for (s32 y = part.min.y; y <= part.max.y; y++)
+		for (s32 z = part.min.z; z <= part.max.z; z++) {
+			v3s32 pos = {x, y, z};
+			buffer[terrain_box_index(box, pos)] = chunk
+				? terrain_chunk_get_type(chunk, v3s32_sub(pos, base))
+				: COUNT_NODE;
+		}
+
+		if (chunk)
+			pthread_rwlock_unlock(&chunk->lock);
+	}
+}
+
+NodeType terrain_chunk_get_type(TerrainChunk *chunk, v3s32 offset)
+{
+	return chunk->data.palette->types[get_palette_index(chunk->data.indices, node_index(offset))];
+}
+
+TerrainNode terrain_chunk_get_node(TerrainChunk *chunk, v3s32 offset)
+{
+	size_t i = node_index(offset);
+	TerrainNode node = {.type = chunk->data.palette->types[get_palette_index(chunk->data.indices, i)]};
+
+	if (has_data(node.type)) {
+		bool found;
+		size_t pos = find_extra(chunk->data.extra, i, &found);
+
+		if (found)
+			memcpy(node.data, chunk->data.extra->entries[pos].data, TERRAIN_NODE_DATA_SIZE);
+	}
+
+	return node;
+}
+
+NodeType terrain_chunk_read_type(TerrainChunk *chunk, v3s32 offset)
+{
+	size_t i = node_index(offset);
+
+	for (int attempt = 0; attempt < OPTIMISTIC_ATTEMPTS; attempt++) {
+		unsigned int seq;
+		NodeType type;
+
+		if (read_begin(chunk, &seq) && peek_type(chunk, i, &type) && read_validate(chunk, seq))
+			return type;
+	}
 
 	assert(pthread_rwlock_rdlock(&chunk->lock) == 0);
-	TerrainNode node = chunk->data[offset.x][offset.y][offset.z];
+	NodeType type = terrain_chunk_get_type(chunk, offset);
+	pthread_rwlock_unlock(&chunk->lock);
+
+	return type;
+}
+
+TerrainNode terrain_chunk_read_node(TerrainChunk *chunk, v3s32 offset)
+{
+	size_t i = node_index(offset);
+
+	for (int attempt = 0; attempt < OPTIMISTIC_ATTEMPTS; attempt++) {
+		unsigned int seq;
+		TerrainNode node = {0};
+
+		if (read_begin(chunk, &seq) && peek_node(chunk, i, &node) && read_validate(chunk, seq))
+			return node;
+	}
+
+	assert(pthread_rwlock_rdlock(&chunk->lock) == 0);
+	TerrainNode node = terrain_chunk_get_node(chunk, offset);
 	pthread_rwlock_unlock(&chunk->lock);
 
 	return node;
 }
 
+void terrain_chunk_set_node(TerrainChunk *chunk, v3s32 offset, TerrainNode node)
+{
+	size_t i = node_index(offset);
+
+	write_begin(chunk);
+
+	unsigned int idx = find_palette_index(&chunk->data, &chunk->retired, node.type);
+
+	if (is_uniform(&chunk->data)) {
+		// materialize index array on first write of a different type
+		if (idx != 0)
+			publish_array((void **) &chunk->data.indices, create_indices(1));
+	}
+
+	if (!is_uniform(&chunk->data))
+		set_palette_index(chunk->data.indices, i, idx);
+
+	set_extra(&chunk->data, &chunk->retired, i, &node);
+
+	write_end(chunk);
+}
+
+bool terrain_chunk_uniform(TerrainChunk *chunk, NodeType *type)
+{
+	if (!is_uniform(&chunk->data))
+		return false;
+
+	if (type)
+		*type = chunk->data.palette->types[0];
+
+	return true;
+}
+
+void terrain_chunk_fill(TerrainChunk *chunk, NodeType type)
+{
+	TerrainChunkData data;
+	init_chunk_data(&data, type);
+	replace_chunk_data(chunk, &data);
+}
+
 v3s32 terrain_chunkp(v3s32 pos)
 {
 	return (v3s32) {
@@ -1,11 +1,14 @@
 #ifndef _TERRAIN_H_
 #define _TERRAIN_H_
 
+#include <dragonstd/array.h>
 #include <dragonstd/list.h>
 #include <dragonstd/tree.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <pthread.h>
 #include "common/node.h"
+#include "common/slab.h"
 #include "types.h"
 
 #define CHUNK_ITERATE \
@@ -13,15 +16,55 @@
 	for (s32 y = 0; y < CHUNK_SIZE; y++) \
 	for (s32 z = 0; z < CHUNK_SIZE; z++)
 
+#define CHUNK_VOLUME (CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE)
+
 #define CHUNK_MODE_PASSIVE 0
 #define CHUNK_MODE_CREATE 1
 
+#define TERRAIN_INDEX_STRIPES 64
+
+// number of eviction passes a chunk has to stay unused before it may be evicted
+#define TERRAIN_EVICT_IDLE 4
+// number of eviction passes evicted chunks are kept around before they are freed
+#define TERRAIN_EVICT_GRACE 4
+
+// large enough for any node data type
+#define TERRAIN_NODE_DATA_SIZE 32
+
 typedef struct TerrainNode {
 	NodeType type;
-	void *data;
+	_Alignas(8) u8 data[TERRAIN_NODE_DATA_SIZE]; // only meaningful if node_def[type].has_data
 } TerrainNode;
 
-typedef TerrainNode TerrainChunkData[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE];
+typedef struct {
+	u16 index; // node index in [x][y][z] order
+	_Alignas(8) u8 data[TERRAIN_NODE_DATA_SIZE];
+} TerrainNodeExtra;
+
+// arrays of chunk data carry their own size, so optimistic readers that see a mix of old and new arrays never read out of bounds
+typedef struct {
+	u8 bits;     // bits per palette index: 1, 2, 4 or 8, never changes once the array is in use
+	u64 words[]; // CHUNK_VOLUME / 64 * bits words of bit packed palette indices
+} TerrainChunkIndices;
+
+typedef struct {
+	u16 cap;           // number of entries, 1 << bits of the index array it was allocated for
+	NodeType types[];  // maps palette indices to node types
+} TerrainChunkPalette;
+
+typedef struct {
+	u16 num;                    // number of nodes that carry data
+	u16 cap;                    // allocated entries
+	TerrainNodeExtra entries[]; // data of nodes that carry data, sorted by index
+} TerrainChunkExtra;
+
+// palette compressed node storage, nodes are indexed in [x][y][z] order
+typedef struct {
+	u16 num_types;                // number of used palette entries
+	TerrainChunkPalette *palette;
+	TerrainChunkIndices *indices; // shared read only array of zeros while the chunk is uniform
+	TerrainChunkExtra *extra;     // NULL if no node carries data
+} TerrainChunkData;
 
 typedef struct {
 	s32 level;
@@ -29,32 +72,123 @@ typedef struct {
 	TerrainChunkData data;
 	void *extra;
 	pthread_rwlock_t lock;
+	atomic_uint seq;                  // odd while a writer modifies data, used by optimistic readers
+	atomic_uint pins;                 // the chunk is never evicted while pinned
+	atomic_uint_fast64_t last_access; // terrain clock at the last lookup, or at removal for evicted chunks
+	Array retired;                    // arrays replaced by writers that readers may still use, protected by the chunk lock
 } TerrainChunk;
 
+typedef struct TerrainIndex TerrainIndex;
+
 typedef struct {
-	Tree sectors;
-	pthread_rwlock_t lock;
-	TerrainChunk *cache;
-	pthread_rwlock_t cache_lock;
+	_Atomic(TerrainIndex *) index;                  // hash table of chunks, read without locking
+	atomic_size_t num_chunks;                       // number of chunks in the index
+	atomic_size_t num_tombstones;                   // number of slots of removed chunks in the index
+	pthread_rwlock_t lock;                          // write locked while the index is resized
+	pthread_mutex_t stripes[TERRAIN_INDEX_STRIPES]; // serialize creation of chunks that hash to the same stripe
+	u64 id;                                         // unique for the lifetime of the process, keys thread local caches
+	atomic_uint_fast64_t epoch;                     // changes whenever chunks are removed, invalidates thread local caches
+	atomic_uint_fast64_t clock;                     // advanced by every eviction pass
+	List graveyard;                                 // evicted chunks waiting to be freed, only used by terrain_evict
+	Slab *chunk_slab;                               // chunks are allocated from here and released at once by terrain_delete
 	struct {
 		void (*create_chunk)(TerrainChunk *chunk);
 		void (*delete_chunk)(TerrainChunk *chunk);
 		bool (*get_chunk)(TerrainChunk *chunk, int mode);
-		void (*delete_node)(TerrainNode *node);
 	} callbacks;
 } Terrain;
 
+// chunks that are write locked together, see terrain_lock_set_add
+typedef struct {
+	Array chunks; // TerrainChunk *, sorted by lock order
+} TerrainLockSet;
+
 Terrain *terrain_create();
 void terrain_delete(Terrain *terrain);
 
 TerrainChunk *terrain_get_chunk(Terrain *terrain, v3s32 pos, int mode);
 TerrainChunk *terrain_get_chunk_nodep(Terrain *terrain, v3s32 node_pos, v3s32 *offset, int mode);
 
+// lookups are cached per thread, a cached chunk is returned without asking callbacks.get_chunk again
+// has to be called after changing a chunk in a way that makes callbacks.get_chunk reject it when it accepted it before
+void terrain_invalidate_cache(Terrain *terrain);
+
 Blob terrain_serialize_chunk(Terrain *terrain, TerrainChunk *chunk, void (*callback)(TerrainNode *node, Blob *buffer));
 bool terrain_deserialize_chunk(Terrain *terrain, TerrainChunk *chunk, Blob buffer, void (*callback)(TerrainNode *node, Blob buffer));
 
 TerrainNode terrain_get_node(Terrain *terrain, v3s32 pos);
 
+// read the types of all nodes in box (min and max inclusive) into buffer, in [x][y][z] order
+// every chunk overlapping the box is looked up only once and read optimistically
+// nodes in chunks that are not loaded are set to COUNT_NODE
+void terrain_read_box(Terrain *terrain, aabb3s32 box, NodeType *buffer);
+
+// number of nodes in box and index of pos in buffer filled by terrain_read_box
+static inline size_t terrain_box_volume(aabb3s32 box)
+{
+	return (size_t) (box.max.x - box.min.x + 1) * (box.max.y - box.min.y + 1) * (box.max.z - box.min.z + 1);
+}
+
+static inline size_t terrain_box_index(aabb3s32 box, v3s32 pos)
+{
+	return ((size_t) (pos.x - box.min.x) * (box.max.y - box.min.y + 1) + (pos.y - box.min.y))
+		* (box.max.z - box.min.z + 1) + (pos.z - box.min.z);
+}
+
+/*
+	Optimistic reads:
+	- writers hold the chunk lock in write mode, the accessors that modify a chunk also make its sequence number
+	  odd while they are working and even again afterwards
+	- readers may instead use the terrain_chunk_read_* accessors (and terrain_get_node, terrain_read_box) without locking,
+	  they copy what they need and retry if the sequence number changed in the meantime
+	- after a few failed attempts they fall back to the read lock, so readers can't be starved by a busy writer
+	- arrays replaced by writers are not freed right away, they are kept with the chunk and freed by terrain_evict
+	  TERRAIN_EVICT_GRACE passes later (or along with the chunk), so writers don't share any lock
+*/
+
+/*
+	Chunk eviction:
+	- pointers returned by terrain_get_chunk stay valid for at least TERRAIN_EVICT_GRACE eviction passes
+	- code that keeps a chunk around for longer than that (queues, lists) has to pin it
+	- terrain_evict removes up to max unpinned chunks that weren't looked up for TERRAIN_EVICT_IDLE passes,
+	  least recently used first, and frees chunks evicted by earlier passes once their grace period is over
+	- callback is asked before each removal and may refuse it, it should write the chunk back if needed
+	- a chunk that gets pinned while it is removed is put back, the callback may have been called for it anyway
+	- chunks that are pinned once their grace period is over are kept until they are unpinned
+	- terrain_evict must not be called by multiple threads at once
+*/
+
+void terrain_pin_chunk(TerrainChunk *chunk);
+void terrain_unpin_chunk(TerrainChunk *chunk);
+size_t terrain_evict(Terrain *terrain, size_t max, bool (*callback)(TerrainChunk *chunk, void *arg), void *arg);
+
+/*
+	Locking multiple chunks:
+	- chunks in a lock set are always locked in a global order (Morton order of their positions),
+	  so threads that lock multiple chunks at once can't deadlock
+	- terrain_lock_set_add blocks only if the new chunk comes after all chunks that are already locked
+	- otherwise it tries to lock it and, if that fails, unlocks the chunks that come after it and locks them again in order
+	- in that case it returns false: other threads may have modified those chunks, so anything that was read
+	  from them has to be read again (the set stays locked, so restarting right away won't run into the same chunks again)
+	- a thread holding a lock set must not lock other chunks outside of it
+*/
+
+void terrain_lock_set_ini(TerrainLockSet *set);
+bool terrain_lock_set_add(TerrainLockSet *set, TerrainChunk *chunk);
+TerrainChunk *terrain_lock_set_get(TerrainLockSet *set, v3s32 pos); // returns NULL if no chunk at pos is in the set
+void terrain_lock_set_release(TerrainLockSet *set); // unlocks all chunks and empties the set
+
+// chunk node accessors, the chunk lock has to be held by the caller
+NodeType terrain_chunk_get_type(TerrainChunk *chunk, v3s32 offset);
+TerrainNode terrain_chunk_get_node(TerrainChunk *chunk, v3s32 offset);
+// optimistic variants, may be called without holding the chunk lock
+NodeType terrain_chunk_read_type(TerrainChunk *chunk, v3s32 offset);
+TerrainNode terrain_chunk_read_node(TerrainChunk *chunk, v3s32 offset);
+void terrain_chunk_set_node(TerrainChunk *chunk, v3s32 offset, TerrainNode node);
+void terrain_chunk_fill(TerrainChunk *chunk, NodeType type); // type must not carry data, makes chunk uniform
+// returns true if all nodes have the same type (nodes may still carry different data)
+bool terrain_chunk_uniform(TerrainChunk *chunk, NodeType *type);
+
 v3s32 terrain_chunkp(v3s32 pos);
 v3s32 terrain_offset(v3s32 pos);
 
@@ -2,16 +2,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include "server/biomes.h"
+#include "server/column_cache.h"
 #include "server/server_terrain.h"
-#include "server/terrain_gen.h"
 #include "server/voxel_depth_search.h"
 
+static f64 get_biome_factor(BiomeDef *def, f64 noise)
+{
+	return (noise * 0.5 - 0.5 + def->probability) / def->probability;
+}
+
 Biome get_biome(v2s32 pos, f64 *factor)
 {
 	for (Biome i = 0; i < COUNT_BIOME; i++) {
 		BiomeDef *def = &biomes[i];
 		f64 f = def->probability == 1.0 ? 1.0
-			: (smooth2d(U32(pos.x) / def->threshold, U32(pos.y) / def->threshold, 0, seed + def->offset) * 0.5 - 0.5 + def->probability) / def->probability;
+			: get_biome_factor(def, smooth2d(U32(pos.x) / def->threshold, U32(pos.y) / def->threshold, 0, seed + def->offset));
 
 		if (f > 0.0) {
 			if (factor)
@@ -23,6 +28,41 @@ Biome get_biome(v2s32 pos, f64 *factor)
 	return COUNT_BIOME;
 }
 
+void get_biome_tile(Biome *biome, f64 *factor, v2s32 pos, v2s32 size)
+{
+	s32 count = size.x * size.y;
+	f64 noise[count];
+
+	for (s32 i = 0; i < count; i++)
+		biome[i] = COUNT_BIOME;
+
+	for (Biome b = 0; b < COUNT_BIOME; b++) {
+		BiomeDef *def = &biomes[b];
+
+		if (def->probability != 1.0)
+			smooth2d_tile(noise, pos, size, def->threshold, 0, seed + def->offset);
+
+		bool done = true;
+
+		for (s32 i = 0; i < count; i++) {
+			if (biome[i] != COUNT_BIOME)
+				continue;
+
+			f64 f = def->probability == 1.0 ? 1.0 : get_biome_factor(def, noise[i]);
+
+			if (f > 0.0) {
+				biome[i] = b;
+				factor[i] = f;
+			} else {
+				done = false;
+			}
+		}
+
+		if (done)
+			break;
+	}
+}
+
 // mountain biome
 
 static s32 height_mountain(BiomeArgsHeight *args)
@@ -35,6 +75,18 @@ static NodeType generate_mountain(BiomeArgsGenerate *args)
 	return args->diff <= 0 ? NODE_STONE : NODE_AIR;
 }
 
+static NodeType uniform_mountain(BiomeArgsUniform *args)
+{
+	if (args->max_y - args->height <= 0)
+		return NODE_STONE;
+
+	// snow and trees can appear right above the surface
+	if (args->min_y - args->height > 1)
+		return NODE_AIR;
+
+	return COUNT_NODE;
+}
+
 // ocean biome
 
 typedef enum {
@@ -55,7 +107,7 @@ static f64 ocean_level_start[COUNT_OCEAN] = {
 typedef struct {
 	bool has_vulcano;
 	v2s32 vulcano_pos;
-} OceanChunkData;
+} OceanColumnData;
 
 typedef struct {
 	bool vulcano;
@@ -116,30 +168,30 @@ static s32 calculate_ocean_floor(f64 factor, s32 height)
 	return height;
 }
 
-static void before_chunk_ocean(BiomeArgsChunk *args)
+static void before_column_ocean(BiomeArgsColumn *args)
 {
-	OceanChunkData *chunk_data = args->chunk_data;
+	OceanColumnData *column_data = args->column_data;
 
-	chunk_data->vulcano_pos = (v2s32) {
-		floor((f64) args->chunk->pos.x * CHUNK_SIZE / vulcano_diameter + 0.5) * vulcano_diameter,
-		floor((f64) args->chunk->pos.z * CHUNK_SIZE / vulcano_diameter + 0.5) * vulcano_diameter
+	column_data->vulcano_pos = (v2s32) {
+		floor((f64) args->pos.x / vulcano_diameter + 0.5) * vulcano_diameter,
+		floor((f64) args->pos.y / vulcano_diameter + 0.5) * vulcano_diameter
 	};
 
 	f64 factor;
-	chunk_data->has_vulcano = noise2d(chunk_data->vulcano_pos.x, chunk_data->vulcano_pos.y, 0, seed + OFFSET_VULCANO) > 0.0
-		&& get_biome((v2s32) {chunk_data->vulcano_pos.x, chunk_data->vulcano_pos.y}, &factor) == BIOME_OCEAN
+	column_data->has_vulcano = noise2d(column_data->vulcano_pos.x, column_data->vulcano_pos.y, 0, seed + OFFSET_VULCANO) > 0.0
+		&& get_biome((v2s32) {column_data->vulcano_pos.x, column_data->vulcano_pos.y}, &factor) == BIOME_OCEAN
 		&& get_ocean_level(factor) == OCEAN_DEEP;
 }
 
 static void before_row_ocean(BiomeArgsRow *args)
 {
-	OceanChunkData *chunk_data = args->chunk_data;
+	OceanColumnData *column_data = args->column_data;
 	OceanRowData *row_data = args->row_data;
 
 	row_data->vulcano = false;
 
-	if (chunk_data->has_vulcano) {
-		f64 dist = distance(args->pos, chunk_data->vulcano_pos);
+	if (column_data->has_vulcano) {
+		f64 dist = distance(args->pos, column_data->vulcano_pos);
 
 		if (dist < vulcano_radius) {
 			f64 crater_factor = pow(asin(1.0 - dist / vulcano_radius), 2.0);
@@ -201,24 +253,54 @@ static NodeType generate_ocean(BiomeArgsGenerate *args)
 	return ocean_get_node_at(args->pos, args->diff, args->row_data);
 }
 
+static NodeType uniform_ocean(BiomeArgsUniform *args)
+{
+	OceanRowData *row_data = args->row_data;
+
+	s32 min_diff = args->min_y - args->height;
+	s32 max_diff = args->max_y - args->height;
+
+	// this has to match ocean_get_node_at
+	if (row_data->vulcano && row_data->vulcano_crater) {
+		if (max_diff <= -5 && args->max_y <= 45)
+			return NODE_LAVA;
+		else if (max_diff <= -5 && args->min_y > 45)
+			return NODE_AIR;
+		else if (min_diff > 1)
+			return NODE_AIR;
+	} else {
+		if (max_diff <= -5)
+			return NODE_STONE;
+		else if (min_diff > 1 && args->max_y <= 0)
+			return NODE_WATER;
+		else if (min_diff > 1 && args->min_y > 0)
+			return NODE_AIR;
+	}
+
+	return COUNT_NODE;
+}
+
 // hills biome
 
+// boulders that don't reach the ground within this many nodes are assumed to be grounded
+#define BOULDER_SEARCH_BUDGET 4096
+
 typedef struct {
-	Tree boulder_visit;
+	DepthSearch boulder_search;
 	bool boulder_success[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE];
 } HillsChunkData;
 
 static void before_chunk_hills(BiomeArgsChunk *args)
 {
 	HillsChunkData *chunk_data = args->chunk_data;
-	tree_ini(&chunk_data->boulder_visit);
+	voxel_depth_search_ini(&chunk_data->boulder_search, BOULDER_SEARCH_BUDGET);
 	memset(chunk_data->boulder_success, 0, sizeof chunk_data->boulder_success);
 }
 
 static void after_chunk_hills(BiomeArgsChunk *args)
 {
 	HillsChunkData *chunk_data = args->chunk_data;
-	tree_clr(&chunk_data->boulder_visit, &free, NULL, NULL, 0);
+	voxel_depth_search_dst(&chunk_data->boulder_search);
 }
 
 static s32 height_hills(BiomeArgsHeight *args)
@@ -234,7 +316,7 @@ static bool is_boulder(s32 diff, v3s32 pos)
 
 static void boulder_search_callback(DepthSearchNode *node)
 {
-	s32 diff = node->pos.y - terrain_gen_get_base_height((v2s32) {node->pos.x, node->pos.z});
+	s32 diff = node->pos.y - column_cache_get_base_height((v2s32) {node->pos.x, node->pos.z});
 
 	if (diff <= 0)
 		node->type = DEPTH_SEARCH_TARGET;
@@ -244,14 +326,26 @@ static void boulder_search_callback(DepthSearchNode *node)
 		node->type = DEPTH_SEARCH_BLOCK;
 }
 
+static NodeType uniform_hills(BiomeArgsUniform *args)
+{
+	// boulders are stone too
+	if (args->max_y - args->height <= -5)
+		return NODE_STONE;
+
+	// no boulders, snow or trees up there
+	if (args->min_y - args->height >= 16)
+		return NODE_AIR;
+
+	return COUNT_NODE;
+}
+
 static NodeType generate_hills(BiomeArgsGenerate *args)
 {
 	HillsChunkData *chunk_data = args->chunk_data;
 
-	if (is_boulder(args->diff, args->pos) && (args->diff <= 0 || voxel_depth_search(args->pos,
-			(void *) &boulder_search_callback, NULL,
-			&chunk_data->boulder_success[args->offset.x][args->offset.y][args->offset.z],
-			&chunk_data->boulder_visit)))
+	if (is_boulder(args->diff, args->pos) && (args->diff <= 0 || voxel_depth_search(&chunk_data->boulder_search,
+			args->pos, (void *) &boulder_search_callback, NULL,
+			&chunk_data->boulder_success[args->offset.x][args->offset.y][args->offset.z])))
 		return NODE_STONE;
 
 	if (args->diff <= -5)
@@ -272,12 +366,14 @@ BiomeDef biomes[COUNT_BIOME] = {
 		.snow = true,
 		.height = &height_mountain,
 		.generate = &generate_mountain,
+		.uniform = &uniform_mountain,
+		.column_data_size = 0,
+		.before_column = NULL,
 		.chunk_data_size = 0,
 		.before_chunk = NULL,
 		.after_chunk = NULL,
 		.row_data_size = 0,
 		.before_row = NULL,
-		.after_row = NULL,
 	},
 	{
 		.probability = 0.2,
@@ -286,12 +382,14 @@ BiomeDef biomes[COUNT_BIOME] = {
 		.snow = false,
 		.height = &height_ocean,
 		.generate = &generate_ocean,
-		.chunk_data_size = sizeof(OceanChunkData),
-		.before_chunk = &before_chunk_ocean,
+		.uniform = &uniform_ocean,
+		.column_data_size = sizeof(OceanColumnData),
+		.before_column = &before_column_ocean,
+		.chunk_data_size = 0,
+		.before_chunk = NULL,
 		.after_chunk = NULL,
 		.row_data_size = sizeof(OceanRowData),
 		.before_row = &before_row_ocean,
-		.after_row = NULL,
 	},
 	{
 		.probability = 1.0,
@@ -300,11 +398,13 @@ BiomeDef biomes[COUNT_BIOME] = {
 		.snow = true,
 		.height = &height_hills,
 		.generate = &generate_hills,
+		.uniform = &uniform_hills,
+		.column_data_size = 0,
+		.before_column = NULL,
 		.chunk_data_size = sizeof(HillsChunkData),
 		.before_chunk = &before_chunk_hills,
 		.after_chunk = &after_chunk_hills,
 		.row_data_size = 0,
 		.before_row = NULL,
-		.after_row = NULL,
 	},
 };
@@ -14,15 +14,19 @@ typedef enum {
 
 typedef struct {
 	TerrainChunk *chunk;
-	List *changed_chunks;
 	void *chunk_data;
 } BiomeArgsChunk;
 
+typedef struct {
+	v2s32 pos; // position of the first row of the column, in nodes
+	void *column_data;
+} BiomeArgsColumn;
+
 typedef struct {
 	v2s32 pos;
 	f64 factor;
 	void *row_data;
-	void *chunk_data;
+	void *column_data;
 } BiomeArgsRow;
 
 typedef struct {
@@ -30,7 +34,7 @@ typedef struct {
 	f64 factor;
 	f32 height;
 	void *row_data;
-	void *chunk_data;
+	void *column_data;
 } BiomeArgsHeight;
 
 typedef struct {
@@ -41,11 +45,24 @@ typedef struct {
 	f64 temperature;
 	f64 factor;
 	TerrainChunk *chunk;
-	List *changed_chunks;
 	void *row_data;
 	void *chunk_data;
 } BiomeArgsGenerate;
 
+typedef struct {
+	s32 min_y;
+	s32 max_y;
+	s32 height;
+	void *row_data;
+} BiomeArgsUniform;
+
+/*
+	Biome callbacks:
+	- column and row data only depend on x and z, they are computed once for a whole column of chunks
+	  and shared by all chunks in it (see column_cache.h), so they must not be modified after before_row
+	- chunk data is allocated for every chunk that contains the biome, between before_chunk and after_chunk
+*/
+
 typedef struct {
 	f64 probability;
 	SeedOffset offset;
@@ -53,17 +70,20 @@ typedef struct {
 	bool snow;
 	s32 (*height)(BiomeArgsHeight *args);
 	NodeType (*generate)(BiomeArgsGenerate *args);
+	NodeType (*uniform)(BiomeArgsUniform *args); // type of all nodes from min_y to max_y without decorations, or COUNT_NODE
+	size_t column_data_size;
+	void (*before_column)(BiomeArgsColumn *args);
 	size_t chunk_data_size;
 	void (*before_chunk)(BiomeArgsChunk *args);
 	void (*after_chunk)(BiomeArgsChunk *args);
 	size_t row_data_size;
 	void (*before_row)(BiomeArgsRow *args);
-	void (*after_row)(BiomeArgsRow *args);
 } BiomeDef;
 
 extern BiomeDef biomes[];
 
 Biome get_biome(v2s32 pos, f64 *factor);
+void get_biome_tile(Biome *biome, f64 *factor, v2s32 pos, v2s32 size); // see smooth2d_tile for the layout
 NodeType ocean_get_node_at(v3s32 pos, s32 diff, void *_row_data);
 
 #endif // _BIOMES_H_
@@ -0,0 +1,145 @@
+#include <dragonstd/tree.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "server/column_cache.h"
+
+typedef struct ColumnCacheEntry {
+	ColumnMap map; // first member, so entries can be found from the maps handed out
+	v2s32 pos;
+	unsigned int refs;
+	bool ready; // false while the map is computed by the thread that created the entry
+	struct ColumnCacheEntry *prev; // neighbours in the list of unused entries
+	struct ColumnCacheEntry *next;
+} ColumnCacheEntry;
+
+static pthread_mutex_t mtx;
+static pthread_cond_t cv_ready;
+static Tree entries;
+// unused entries, least recently used first
+static ColumnCacheEntry *unused_first;
+static ColumnCacheEntry *unused_last;
+static size_t num_unused;
+
+static int cmp_entry(const ColumnCacheEntry *entry, const v2s32 *pos)
+{
+	return v2s32_cmp(&entry->pos, pos);
+}
+
+static void delete_entry(ColumnCacheEntry *entry)
+{
+	terrain_gen_column_dst(&entry->map);
+	free(entry);
+}
+
+// mtx has to be locked
+static void unlink_unused(ColumnCacheEntry *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		unused_first = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		unused_last = entry->prev;
+
+	num_unused--;
+}
+
+// public functions
+
+void column_cache_init()
+{
+	pthread_mutex_init(&mtx, NULL);
+	pthread_cond_init(&cv_ready, NULL);
+	tree_ini(&entries);
+	unused_first = unused_last = NULL;
+	num_unused = 0;
+}
+
+// all maps have to be released
+void column_cache_deinit()
+{
+	tree_clr(&entries, &delete_entry, NULL, NULL, 0);
+	pthread_cond_destroy(&cv_ready);
+	pthread_mutex_destroy(&mtx);
+}
+
+ColumnMap *column_cache_get(v2s32 pos)
+{
+	pthread_mutex_lock(&mtx);
+
+	ColumnCacheEntry *entry = tree_get(&entries, &pos, &cmp_entry, NULL);
+
+	if (entry) {
+		if (entry->refs++ == 0)
+			unlink_unused(entry);
+
+		while (!entry->ready)
+			pthread_cond_wait(&cv_ready, &mtx);
+
+		pthread_mutex_unlock(&mtx);
+		return &entry->map;
+	}
+
+	entry = malloc(sizeof *entry);
+	entry->pos = pos;
+	entry->refs = 1;
+	entry->ready = false;
+	tree_add(&entries, &entry->pos, entry, &cmp_entry, NULL);
+
+	pthread_mutex_unlock(&mtx);
+
+	// other threads asking for this column wait instead of computing it as well
+	terrain_gen_column_ini(&entry->map, pos);
+
+	pthread_mutex_lock(&mtx);
+	entry->ready = true;
+	pthread_cond_broadcast(&cv_ready);
+	pthread_mutex_unlock(&mtx);
+
+	return &entry->map;
+}
+
+void column_cache_release(ColumnMap *map)
+{
+	ColumnCacheEntry *entry = (ColumnCacheEntry *) map;
+
+	pthread_mutex_lock(&mtx);
+
+	if (--entry->refs == 0) {
+		entry->prev = unused_last;
+		entry->next = NULL;
+
+		if (unused_last)
+			unused_last->next = entry;
+		else
+			unused_first = entry;
+
+		unused_last = entry;
+		num_unused++;
+	}
+
+	while (num_unused > COLUMN_CACHE_SIZE) {
+		ColumnCacheEntry *evict = unused_first;
+		unlink_unused(evict);
+		tree_del(&entries, &evict->pos, &cmp_entry, NULL, NULL, NULL);
+		delete_entry(evict);
+	}
+
+	pthread_mutex_unlock(&mtx);
+}
+
+s32 column_cache_get_base_height(v2s32 pos)
+{
+	v3s32 chunkp = terrain_chunkp((v3s32) {pos.x, 0, pos.y});
+	v3s32 offset = terrain_offset((v3s32) {pos.x, 0, pos.y});
+
+	ColumnMap *map = column_cache_get((v2s32) {chunkp.x, chunkp.z});
+	s32 height = map->columns[offset.x][offset.z].base_height;
+	column_cache_release(map);
+
+	return height;
+}
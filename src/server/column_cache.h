@@ -0,0 +1,25 @@
+#ifndef _COLUMN_CACHE_H_
+#define _COLUMN_CACHE_H_
+
+#include "server/terrain_gen.h"
+#include "types.h"
+
+// number of unused column maps kept around, a map is about 20 KiB
+#define COLUMN_CACHE_SIZE 1024
+
+/*
+	Column cache:
+	- keeps the 2D values of columns of chunks (ColumnMap), so chunks stacked on top of each other don't compute them again
+	- column_cache_get returns the map of a column, computing it if needed, it has to be released again
+	- maps are read only and may be used by multiple threads at once
+	- if multiple threads ask for the same map, only one computes it and the others wait for it
+	- unused maps are evicted least recently used first once there are more than COLUMN_CACHE_SIZE
+*/
+
+void column_cache_init();
+void column_cache_deinit();
+ColumnMap *column_cache_get(v2s32 pos); // pos is in chunks
+void column_cache_release(ColumnMap *map);
+s32 column_cache_get_base_height(v2s32 pos); // same as terrain_gen_get_base_height, pos is in nodes
+
+#endif // _COLUMN_CACHE_H_
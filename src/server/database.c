@@ -1,4 +1,9 @@
+#define _GNU_SOURCE // don't worry, GNU extensions are only used when available
+#include <assert.h>
+#include <dragonstd/array.h>
 #include <endian.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +19,13 @@ static sqlite3 *terrain_database;
 static sqlite3 *meta_database;
 static sqlite3 *players_database;
 
+static Array writer_queue;            // chunks waiting to be written by the writer thread
+static bool writer_cancel;            // stop the writer thread
+static pthread_t writer_thread;       // writes queued chunks in the background
+static pthread_mutex_t mtx_writer;    // protects writer_queue and writer_cancel
+static pthread_cond_t cv_writer;      // wakes up the writer thread early
+static pthread_mutex_t mtx_write;     // held while writing chunks
+
 // utility functions
 
 // prepare a SQLite3 statement
@@ -65,6 +77,207 @@ static inline void bind_v3f32(sqlite3_stmt *stmt, int idx, v3f32 pos)
 	sqlite3_bind_blob(stmt, idx, buffer.data, buffer.siz, &free);
 }
 
+// stage of all nodes of a chunk that has no stages saved
+static inline TerrainGenStage default_stage(bool generated)
+{
+	return generated ? STAGE_TERRAIN : STAGE_VOID;
+}
+
+// stages that can't be read are replaced by the default, like for chunks without saved stages
+static void reset_stages(TerrainChunk *chunk, bool generated)
+{
+	fprintf(stderr, "[warning] failed deserializing terrain generation stages of chunk at (%d, %d, %d), using defaults\n",
+		chunk->pos.x, chunk->pos.y, chunk->pos.z);
+	gen_stage_fill(&((TerrainChunkMeta *) chunk->extra)->tgsb, default_stage(generated));
+}
+
+// read the generation stages of a chunk from a loaded row
+static void load_stages(sqlite3_stmt *stmt, int stages_idx, int tgsb_idx, bool generated, TerrainChunk *chunk)
+{
+	TerrainChunkMeta *meta = chunk->extra;
+	Blob stages = {sqlite3_column_bytes(stmt, stages_idx), (void *) sqlite3_column_blob(stmt, stages_idx)};
+	Blob tgsb = {sqlite3_column_bytes(stmt, tgsb_idx), (void *) sqlite3_column_blob(stmt, tgsb_idx)};
+
+	gen_stage_fill(&meta->tgsb, default_stage(generated));
+
+	if (stages.data && stages.siz == 1) {
+		// all nodes have the same stage
+		gen_stage_fill(&meta->tgsb, *(u8 *) stages.data & 3);
+	} else if (stages.data) {
+		PackedTerrainGenStages packed = {0};
+
+		if (PackedTerrainGenStages_read(&stages, &packed)) {
+			meta->tgsb.packed = malloc(sizeof *meta->tgsb.packed);
+			*meta->tgsb.packed = packed.raw;
+			gen_stage_compact(&meta->tgsb);
+		} else {
+			reset_stages(chunk, generated);
+		}
+	} else if (tgsb.data) {
+		// legacy format, 32 bits per node
+		TerrainGenStageBuffer *legacy = calloc(1, sizeof *legacy);
+
+		if (TerrainGenStageBuffer_read(&tgsb, legacy)) {
+			CHUNK_ITERATE
+				gen_stage_set(&meta->tgsb, (v3s32) {x, y, z}, legacy->raw.nodes[x][y][z]);
+
+			gen_stage_compact(&meta->tgsb);
+		} else {
+			reset_stages(chunk, generated);
+		}
+
+		free(legacy);
+	}
+}
+
+// bind the generation stages of a chunk, nothing is stored if they match the default
+static void bind_stages(sqlite3_stmt *stmt, int idx, TerrainChunkMeta *meta)
+{
+	TerrainGenStage stage;
+
+	if (!gen_stage_uniform(&meta->tgsb, &stage)) {
+		Blob buffer = {0, NULL};
+		PackedTerrainGenStages_write(&buffer, &(PackedTerrainGenStages) {*meta->tgsb.packed});
+		sqlite3_bind_blob(stmt, idx, buffer.data, buffer.siz, &free);
+	} else if (stage != default_stage(meta->state > CHUNK_STATE_CREATED)) {
+		u8 byte = stage;
+		sqlite3_bind_blob(stmt, idx, &byte, 1, SQLITE_TRANSIENT);
+	} else {
+		sqlite3_bind_null(stmt, idx);
+	}
+}
+
+#define SAVE_CHUNK_SQL "REPLACE INTO terrain (pos, generated, data, tgsb, stages) VALUES(?1, ?2, ?3, NULL, ?4)"
+
+// write a chunk using a prepared SAVE_CHUNK_SQL statement, the statement is reset afterwards so it can be reused
+// chunk has to be read locked
+static void save_chunk(sqlite3_stmt *stmt, TerrainChunk *chunk)
+{
+	TerrainChunkMeta *meta = chunk->extra;
+
+	Blob pos = {0, NULL};
+	v3s32_write(&pos, &chunk->pos);
+	Blob data = terrain_serialize_chunk(server_terrain, chunk, &server_node_serialize);
+
+	sqlite3_bind_blob(stmt, 1, pos.data, pos.siz, &free);
+	sqlite3_bind_int(stmt, 2, meta->state > CHUNK_STATE_CREATED);
+	sqlite3_bind_blob(stmt, 3, data.data, data.siz, &free);
+	bind_stages(stmt, 4, meta);
+
+	if (sqlite3_step(stmt) != SQLITE_DONE)
+		print_chunk_error(chunk, "saving");
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
+// run a statement on the terrain database that has no result
+static void exec_terrain(const char *sql)
+{
+	int rc;
+
+	// other threads share the connection, a commit has to wait for their statements to finish
+	while ((rc = sqlite3_exec(terrain_database, sql, NULL, NULL, NULL)) == SQLITE_BUSY)
+		sched_yield();
+
+	if (rc != SQLITE_OK)
+		fprintf(stderr, "[warning] failed to run %s on terrain database: %s\n", sql, sqlite3_errmsg(terrain_database));
+}
+
+// write all queued chunks in a single transaction
+static void write_queue()
+{
+	// only one thread may write at a time, transactions are per connection
+	pthread_mutex_lock(&mtx_write);
+
+	pthread_mutex_lock(&mtx_writer);
+	Array queue = writer_queue;
+	array_ini(&writer_queue, sizeof(TerrainChunk *), DATABASE_WRITE_BATCH);
+	pthread_mutex_unlock(&mtx_writer);
+
+	if (queue.siz > 0) {
+		sqlite3_stmt *stmt = prepare_statement(terrain_database, SAVE_CHUNK_SQL);
+
+		if (!stmt)
+			fprintf(stderr, "[warning] failed preparing to save chunks: %s\n", sqlite3_errmsg(terrain_database));
+
+		exec_terrain("BEGIN;");
+
+		for (size_t i = 0; i < queue.siz; i++) {
+			TerrainChunk *chunk = ((TerrainChunk **) queue.ptr)[i];
+			TerrainChunkMeta *meta = chunk->extra;
+
+			pthread_mutex_lock(&meta->mtx);
+			meta->queued = false;
+
+			if (stmt && meta->dirty) {
+				assert(pthread_rwlock_rdlock(&chunk->lock) == 0);
+				save_chunk(stmt, chunk);
+				pthread_rwlock_unlock(&chunk->lock);
+
+				meta->dirty = false;
+			}
+
+			pthread_mutex_unlock(&meta->mtx);
+		}
+
+		if (stmt)
+			sqlite3_finalize(stmt);
+
+		exec_terrain("COMMIT;");
+
+		// chunks may only be evicted once they are in the database
+		for (size_t i = 0; i < queue.siz; i++) {
+			TerrainChunk *chunk = ((TerrainChunk **) queue.ptr)[i];
+			TerrainChunkMeta *meta = chunk->extra;
+
+			// chunks changed again after they were saved have to wait for the next commit
+			pthread_mutex_lock(&meta->mtx);
+			if (!meta->dirty)
+				meta->committed = true;
+			pthread_mutex_unlock(&meta->mtx);
+
+			terrain_unpin_chunk(chunk);
+		}
+	}
+
+	array_clr(&queue);
+	pthread_mutex_unlock(&mtx_write);
+}
+
+static void *writer_thread_func()
+{
+#ifdef __GLIBC__
+	pthread_setname_np(pthread_self(), "database");
+#endif // __GLIBC__
+
+	pthread_mutex_lock(&mtx_writer);
+
+	while (!writer_cancel) {
+		if (writer_queue.siz < DATABASE_WRITE_BATCH) {
+			struct timespec timeout;
+			clock_gettime(CLOCK_REALTIME, &timeout);
+			timeout.tv_sec += DATABASE_WRITE_INTERVAL / 1000;
+			timeout.tv_nsec += DATABASE_WRITE_INTERVAL % 1000 * 1000000;
+			if (timeout.tv_nsec >= 1000000000) {
+				timeout.tv_sec++;
+				timeout.tv_nsec -= 1000000000;
+			}
+
+			pthread_cond_timedwait(&cv_writer, &mtx_writer, &timeout);
+			if (writer_cancel)
+				break;
+		}
+
+		pthread_mutex_unlock(&mtx_writer);
+		write_queue();
+		pthread_mutex_lock(&mtx_writer);
+	}
+
+	pthread_mutex_unlock(&mtx_writer);
+	return NULL;
+}
+
 // public functions
 
 // open and initialize SQLite3 databases
@@ -75,7 +288,7 @@ void database_init(const char *world_path)
 		const char *path;
 		const char *init;
 	} databases[3] = {
-		{&terrain_database, "terrain.sqlite", "CREATE TABLE IF NOT EXISTS terrain (pos  BLOB PRIMARY KEY, generated INTEGER, data BLOB, tgsb BLOB);"},
+		{&terrain_database, "terrain.sqlite", "CREATE TABLE IF NOT EXISTS terrain (pos  BLOB PRIMARY KEY, generated INTEGER, data BLOB, tgsb BLOB, stages BLOB);"},
 		{&meta_database,    "meta.sqlite",    "CREATE TABLE IF NOT EXISTS meta    (key  TEXT PRIMARY KEY, value INTEGER                          );"},
 		{&players_database, "players.sqlite", "CREATE TABLE IF NOT EXISTS players (name TEXT PRIMARY KEY, pos BLOB, rot BLOB                     );"},
 	};
@@ -97,6 +310,9 @@ void database_init(const char *world_path)
 		}
 	}
 
+	// worlds saved before stages were packed lack the stages column, this fails harmlessly if it exists
+	sqlite3_exec(terrain_database, "ALTER TABLE terrain ADD COLUMN stages BLOB;", NULL, NULL, NULL);
+
 	s64 saved_seed;
 
 	if (database_load_meta("seed", &saved_seed)) {
@@ -113,11 +329,31 @@ void database_init(const char *world_path)
 		set_time_of_day(time_of_day);
 	else
 		set_time_of_day(12 * MINUTES_PER_HOUR);
+
+	array_ini(&writer_queue, sizeof(TerrainChunk *), DATABASE_WRITE_BATCH);
+	writer_cancel = false;
+	pthread_mutex_init(&mtx_writer, NULL);
+	pthread_cond_init(&cv_writer, NULL);
+	pthread_mutex_init(&mtx_write, NULL);
+	pthread_create(&writer_thread, NULL, &writer_thread_func, NULL);
 }
 
 // close databases
 void database_deinit()
 {
+	pthread_mutex_lock(&mtx_writer);
+	writer_cancel = true;
+	pthread_cond_signal(&cv_writer);
+	pthread_mutex_unlock(&mtx_writer);
+
+	pthread_join(writer_thread, NULL);
+	write_queue();
+
+	array_clr(&writer_queue);
+	pthread_mutex_destroy(&mtx_writer);
+	pthread_cond_destroy(&cv_writer);
+	pthread_mutex_destroy(&mtx_write);
+
 	database_save_meta("time_of_day", (s64) get_time_of_day());
 
 	sqlite3_close(terrain_database);
@@ -125,10 +361,11 @@ void database_deinit()
 	sqlite3_close(players_database);
 }
 
-// load a chunk from terrain database (initializes state, tgs buffer and data), returns false on failure
-bool database_load_chunk(TerrainChunk *chunk)
+// load a chunk from terrain database (initializes tgs buffer and data, sets generated), returns false on failure
+// chunk has to be write locked
+bool database_load_chunk(TerrainChunk *chunk, bool *generated)
 {
-	sqlite3_stmt *stmt = prepare_chunk_statement(chunk, "loading", "SELECT generated, data, tgsb FROM terrain WHERE pos=?");
+	sqlite3_stmt *stmt = prepare_chunk_statement(chunk, "loading", "SELECT generated, data, tgsb, stages FROM terrain WHERE pos=?");
 
 	if (!stmt)
 		return false;
@@ -137,13 +374,10 @@ bool database_load_chunk(TerrainChunk *chunk)
 	bool found = rc == SQLITE_ROW;
 
 	if (found) {
-		TerrainChunkMeta *meta = chunk->extra;
-
-		meta->state = sqlite3_column_int(stmt, 0) ? CHUNK_STATE_READY : CHUNK_STATE_CREATED;
+		*generated = sqlite3_column_int(stmt, 0);
 		Blob data = {sqlite3_column_bytes(stmt, 1), (void *) sqlite3_column_blob(stmt, 1)};
-		Blob tgsb = {sqlite3_column_bytes(stmt, 2), (void *) sqlite3_column_blob(stmt, 2)};
 
-		TerrainGenStageBuffer_read(&tgsb, &meta->tgsb);
+		load_stages(stmt, 3, 2, *generated, chunk);
 		if (!terrain_deserialize_chunk(server_terrain, chunk, data, &server_node_deserialize)) {
 			fprintf(stderr, "[error] failed deserializing chunk at (%d, %d, %d)\n", chunk->pos.x, chunk->pos.y, chunk->pos.z);
 			abort();
@@ -156,29 +390,49 @@ bool database_load_chunk(TerrainChunk *chunk)
 	return found;
 }
 
-// save a chunk to terrain database
+// save a chunk to terrain database right away
+// chunk has to be read locked, meta mutex must not be locked (the writer locks it while holding mtx_write)
 void database_save_chunk(TerrainChunk *chunk)
 {
-	sqlite3_stmt *stmt = prepare_chunk_statement(chunk, "saving", "REPLACE INTO terrain (pos, generated, data, tgsb) VALUES(?1, ?2, ?3, ?4)");
+	// don't join or race a transaction of the writer, it shares the connection
+	pthread_mutex_lock(&mtx_write);
 
-	if (!stmt)
-		return;
+	sqlite3_stmt *stmt = prepare_statement(terrain_database, SAVE_CHUNK_SQL);
 
-	TerrainChunkMeta *meta = chunk->extra;
+	if (stmt) {
+		save_chunk(stmt, chunk);
+		sqlite3_finalize(stmt);
+	} else {
+		print_chunk_error(chunk, "saving");
+	}
 
-	Blob data = terrain_serialize_chunk(server_terrain, chunk, &server_node_serialize);
+	pthread_mutex_unlock(&mtx_write);
+}
 
-	Blob tgsb = {0, NULL};
-	TerrainGenStageBuffer_write(&tgsb, &meta->tgsb);
+// queue a dirty chunk for the writer thread, it is pinned until it has been written
+// meta mutex has to be locked
+void database_queue_chunk(TerrainChunk *chunk)
+{
+	TerrainChunkMeta *meta = chunk->extra;
 
-	sqlite3_bind_int(stmt, 2, meta->state > CHUNK_STATE_CREATED);
-	sqlite3_bind_blob(stmt, 3, data.data, data.siz, &free);
-	sqlite3_bind_blob(stmt, 4, tgsb.data, tgsb.siz, &free);
+	// repeated changes are written at once
+	if (meta->queued)
+		return;
 
-	if (sqlite3_step(stmt) != SQLITE_DONE)
-		print_chunk_error(chunk, "saving");
+	meta->queued = true;
+	terrain_pin_chunk(chunk);
 
-	sqlite3_finalize(stmt);
+	pthread_mutex_lock(&mtx_writer);
+	array_apd(&writer_queue, &chunk);
+	if (writer_queue.siz == DATABASE_WRITE_BATCH)
+		pthread_cond_signal(&cv_writer);
+	pthread_mutex_unlock(&mtx_writer);
+}
+
+// write all queued chunks, returns once chunks queued before the call are in the database
+void database_flush()
+{
+	write_queue();
 }
 
 // load a meta entry
@@ -5,10 +5,27 @@
 #include "common/terrain.h"
 #include "types.h"
 
+// time between writes of queued chunks, in milliseconds
+#define DATABASE_WRITE_INTERVAL 1000
+// number of queued chunks that are written without waiting for the interval
+#define DATABASE_WRITE_BATCH 256
+
+/*
+	Chunk writer:
+	- changed chunks are queued and written by a writer thread, callers don't wait for the database
+	- a chunk that changes again before it is written is only written once
+	- queued chunks are written in a single transaction, every DATABASE_WRITE_INTERVAL or once DATABASE_WRITE_BATCH are queued
+	- queued chunks are pinned until they have been committed, so they can't be evicted before that
+	- after the commit, chunks that were not changed again are marked as committed in their meta data
+	- database_flush writes everything queued so far, database_deinit flushes as well
+*/
+
 void database_init(const char *world_path);                                                  // open and initialize SQLite3 databases
 void database_deinit();                                                // close databases
-bool database_load_chunk(TerrainChunk *chunk);                         // load a chunk from terrain database (initializes state, tgs buffer and data), returns false on failure
-void database_save_chunk(TerrainChunk *chunk);                         // save a chunk to terrain database
+bool database_load_chunk(TerrainChunk *chunk, bool *generated);        // load a chunk from terrain database (initializes tgs buffer and data, sets generated), returns false on failure
+void database_save_chunk(TerrainChunk *chunk);                         // save a chunk to terrain database right away, meta mutex must not be locked
+void database_queue_chunk(TerrainChunk *chunk);                        // save a chunk in the background, meta mutex has to be locked
+void database_flush();                                                 // write all queued chunks
 bool database_load_meta(const char *key, s64 *value_ptr);              // load a meta entry
 void database_save_meta(const char *key, s64 value);                   // save / update a meta entry
 bool database_load_player(char *name, v3f64 *pos, v3f32 *rot);         // load player data from database
@@ -0,0 +1,135 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "server/gen_batch.h"
+
+static int cmp_batch_chunk(const GenBatchChunk *batch_chunk, const v3s32 *pos)
+{
+	return v3s32_cmp(&batch_chunk->chunk->pos, pos);
+}
+
+// the chunk has to be pinned by the caller, the entry takes over the pin
+static GenBatchChunk *create_batch_chunk(GenBatch *batch, TerrainChunk *chunk)
+{
+	GenBatchChunk *batch_chunk = malloc(sizeof *batch_chunk);
+	batch_chunk->chunk = chunk;
+	array_ini(&batch_chunk->writes, sizeof(GenBatchWrite), 64);
+	batch_chunk->changed = false;
+
+	tree_add(&batch->chunks, &chunk->pos, batch_chunk, &cmp_batch_chunk, NULL);
+	return batch_chunk;
+}
+
+static void apply_batch_chunk(GenBatchChunk *batch_chunk)
+{
+	if (batch_chunk->writes.siz == 0)
+		return;
+
+	TerrainChunk *chunk = batch_chunk->chunk;
+	TerrainChunkMeta *meta = chunk->extra;
+
+	server_terrain_wait_loaded(chunk);
+	assert(pthread_rwlock_wrlock(&chunk->lock) == 0);
+
+	for (size_t i = 0; i < batch_chunk->writes.siz; i++) {
+		GenBatchWrite *write = &((GenBatchWrite *) batch_chunk->writes.ptr)[i];
+		v3s32 offset = {
+			write->index / (CHUNK_SIZE * CHUNK_SIZE),
+			write->index / CHUNK_SIZE % CHUNK_SIZE,
+			write->index % CHUNK_SIZE,
+		};
+
+		if (write->tgs < gen_stage_get(&meta->tgsb, offset))
+			continue;
+
+		gen_stage_set(&meta->tgsb, offset, write->tgs);
+		terrain_chunk_set_node(chunk, offset, write->node);
+		batch_chunk->changed = true;
+	}
+
+	pthread_rwlock_unlock(&chunk->lock);
+
+	batch_chunk->writes.siz = 0;
+}
+
+static void send_batch_chunk(GenBatchChunk *batch_chunk)
+{
+	apply_batch_chunk(batch_chunk);
+
+	if (batch_chunk->changed)
+		server_terrain_lock_and_send_chunk(batch_chunk->chunk);
+
+	terrain_unpin_chunk(batch_chunk->chunk);
+	array_clr(&batch_chunk->writes);
+	free(batch_chunk);
+}
+
+// public functions
+
+void gen_batch_ini(GenBatch *batch)
+{
+	tree_ini(&batch->chunks);
+	batch->last = NULL;
+	batch->has_clip = false;
+}
+
+void gen_batch_set_node(GenBatch *batch, v3s32 pos, TerrainNode node, TerrainGenStage tgs)
+{
+	if (batch->has_clip && (
+			pos.x < batch->clip.min.x || pos.x > batch->clip.max.x ||
+			pos.y < batch->clip.min.y || pos.y > batch->clip.max.y ||
+			pos.z < batch->clip.min.z || pos.z > batch->clip.max.z))
+		return;
+
+	v3s32 chunkp = terrain_chunkp(pos);
+	v3s32 offset = terrain_offset(pos);
+	GenBatchChunk *batch_chunk = batch->last;
+
+	// lookups are skipped while writes stay in the same chunk
+	if (!batch_chunk || !v3s32_equals(batch_chunk->chunk->pos, chunkp)) {
+		batch_chunk = tree_get(&batch->chunks, &chunkp, &cmp_batch_chunk, NULL);
+
+		if (!batch_chunk) {
+			TerrainChunk *chunk = terrain_get_chunk(server_terrain, chunkp, CHUNK_MODE_CREATE);
+			terrain_pin_chunk(chunk);
+			batch_chunk = create_batch_chunk(batch, chunk);
+		}
+
+		batch->last = batch_chunk;
+	}
+
+	array_apd(&batch_chunk->writes, &(GenBatchWrite) {
+		.index = (offset.x * CHUNK_SIZE + offset.y) * CHUNK_SIZE + offset.z,
+		.tgs = tgs,
+		.node = node,
+	});
+}
+
+void gen_batch_clip(GenBatch *batch, aabb3s32 box)
+{
+	batch->has_clip = true;
+	batch->clip = box;
+}
+
+void gen_batch_add_changed(GenBatch *batch, TerrainChunk *chunk)
+{
+	GenBatchChunk *batch_chunk = tree_get(&batch->chunks, &chunk->pos, &cmp_batch_chunk, NULL);
+
+	if (batch_chunk)
+		// the entry holds a pin already
+		terrain_unpin_chunk(chunk);
+	else
+		batch_chunk = create_batch_chunk(batch, chunk);
+
+	batch_chunk->changed = true;
+}
+
+void gen_batch_apply(GenBatch *batch)
+{
+	tree_trv(&batch->chunks, &apply_batch_chunk, NULL, NULL, 0);
+}
+
+void gen_batch_send(GenBatch *batch)
+{
+	tree_clr(&batch->chunks, &send_batch_chunk, NULL, NULL, 0);
+	batch->last = NULL;
+}
@@ -0,0 +1,52 @@
+#ifndef _GEN_BATCH_H_
+#define _GEN_BATCH_H_
+
+#include <dragonstd/array.h>
+#include <dragonstd/tree.h>
+#include <stdbool.h>
+#include "common/terrain.h"
+#include "server/server_terrain.h"
+#include "types.h"
+
+typedef struct {
+	u16 index; // node index in [x][y][z] order
+	TerrainGenStage tgs;
+	TerrainNode node;
+} GenBatchWrite;
+
+// writes to a single chunk
+typedef struct {
+	TerrainChunk *chunk; // pinned as long as it is in the batch
+	Array writes;        // GenBatchWrite, in order of the calls to gen_batch_set_node
+	bool changed;        // some write was applied or the chunk was added with gen_batch_add_changed
+} GenBatchChunk;
+
+typedef struct {
+	Tree chunks;         // GenBatchChunk by chunk position
+	GenBatchChunk *last; // chunk of the previous write, most writes go to the same chunk as the one before
+	bool has_clip;
+	aabb3s32 clip;       // writes outside of this box are dropped if has_clip is set
+} GenBatch;
+
+/*
+	Generation write batch:
+	- collects writes of terrain generation (trees, schematics) and applies them grouped by chunk,
+	  so each chunk is looked up and locked once per batch instead of once per node
+	- writes only take effect once the batch is applied or sent, code that reads terrain it has written has to apply first
+	- writes to the same node take effect in order, the terraingen stage rules of server_terrain_gen_node apply
+	- the batch is also the set of chunks changed by it, gen_batch_send sends each of them once
+	- writes can be clipped to a box, terrain generation uses this to only write to the chunk it generates
+*/
+
+void gen_batch_ini(GenBatch *batch);
+void gen_batch_set_node(GenBatch *batch, v3s32 pos, TerrainNode node, TerrainGenStage tgs);
+// drop all following writes outside of box (min and max inclusive)
+void gen_batch_clip(GenBatch *batch, aabb3s32 box);
+// add a chunk that was changed outside the batch so it is sent along, takes over a pin held by the caller
+void gen_batch_add_changed(GenBatch *batch, TerrainChunk *chunk);
+// apply all buffered writes, chunk locks must not be held by the caller
+void gen_batch_apply(GenBatch *batch);
+// apply all buffered writes, send changed chunks and empty the batch
+void gen_batch_send(GenBatch *batch);
+
+#endif // _GEN_BATCH_H_
@@ -0,0 +1,489 @@
+#include <dragonstd/array.h>
+#include <dragonstd/tree.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include "server/gen_scheduler.h"
+#include "server/server_config.h"
+
+typedef enum {
+	TASK_WAITING,
+	TASK_RUNNING,
+	TASK_CANCELLED, // handed to the cancel callback, waiting for gen_scheduler_drop
+} GenTaskState;
+
+typedef struct {
+	v3s32 pos; // first member, tasks are looked up by chunk position
+	TerrainChunk *chunk;
+	GenTaskState state;
+	GenLane lane;
+	u64 player;   // owner of urgent tasks, 0 for background tasks
+	s64 priority; // smaller comes first: squared distance to the owner for urgent tasks, sequence number for background tasks
+	size_t index; // position in the heap while waiting
+} GenTask;
+
+// urgent tasks owned by a player
+typedef struct {
+	u64 player;
+	Array heap; // GenTask *
+	unsigned int running;
+} GenPlayerQueue;
+
+typedef struct {
+	u64 id;
+	v3s32 pos; // chunk the player is in
+} GenPlayerPos;
+
+static pthread_mutex_t mtx;
+static pthread_cond_t cv;
+static bool stop;
+static void (*cancel_callback)(TerrainChunk *chunk);
+static Tree tasks;             // all tasks known to the scheduler
+static Array queues;           // GenPlayerQueue *
+static Array background;       // heap of GenTask *
+static s64 background_seq;     // next background priority
+static size_t num_waiting[COUNT_GEN_LANE];
+static size_t num_running;
+static size_t num_cancelled;
+static struct timespec last_reprioritize;
+
+// heap of waiting tasks ordered by priority
+
+static GenTask **heap_at(Array *heap, size_t i)
+{
+	return &((GenTask **) heap->ptr)[i];
+}
+
+static void heap_swap(Array *heap, size_t a, size_t b)
+{
+	GenTask *tmp = *heap_at(heap, a);
+	*heap_at(heap, a) = *heap_at(heap, b);
+	*heap_at(heap, b) = tmp;
+
+	(*heap_at(heap, a))->index = a;
+	(*heap_at(heap, b))->index = b;
+}
+
+static void heap_up(Array *heap, size_t i)
+{
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+
+		if ((*heap_at(heap, parent))->priority <= (*heap_at(heap, i))->priority)
+			break;
+
+		heap_swap(heap, i, parent);
+		i = parent;
+	}
+}
+
+static void heap_down(Array *heap, size_t i)
+{
+	for (;;) {
+		size_t min = i;
+
+		for (size_t child = 2 * i + 1; child <= 2 * i + 2 && child < heap->siz; child++)
+			if ((*heap_at(heap, child))->priority < (*heap_at(heap, min))->priority)
+				min = child;
+
+		if (min == i)
+			break;
+
+		heap_swap(heap, i, min);
+		i = min;
+	}
+}
+
+static void heap_push(Array *heap, GenTask *task)
+{
+	task->index = heap->siz;
+	array_apd(heap, &task);
+	heap_up(heap, task->index);
+}
+
+static void heap_remove(Array *heap, GenTask *task)
+{
+	size_t i = task->index;
+	size_t last = heap->siz - 1;
+
+	if (i != last) {
+		heap_swap(heap, i, last);
+		heap->siz--;
+		heap_down(heap, i);
+		heap_up(heap, i);
+	} else {
+		heap->siz--;
+	}
+}
+
+// utility functions
+
+static int cmp_task(const GenTask *task, const v3s32 *pos)
+{
+	return v3s32_cmp(&task->pos, pos);
+}
+
+static f64 seconds_since(struct timespec *ts)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - ts->tv_sec) + (now.tv_nsec - ts->tv_nsec) / 1.0e9;
+}
+
+static s64 distance_squared(v3s32 a, v3s32 b)
+{
+	s64 x = a.x - b.x;
+	s64 y = a.y - b.y;
+	s64 z = a.z - b.z;
+	return x * x + y * y + z * z;
+}
+
+// same check as used for sending chunks to players
+static bool within_load_distance(v3s32 ppos, v3s32 cpos)
+{
+	s32 dist = server_config.load_distance;
+
+	return abs(ppos.x - cpos.x) <= dist
+		&& abs(ppos.y - cpos.y) <= dist
+		&& abs(ppos.z - cpos.z) <= dist;
+}
+
+static v3s32 get_player_chunkp(ServerPlayer *player)
+{
+	pthread_rwlock_rdlock(&player->lock_pos);
+	v3s32 pos = terrain_chunkp((v3s32) {player->pos.x, player->pos.y, player->pos.z});
+	pthread_rwlock_unlock(&player->lock_pos);
+
+	return pos;
+}
+
+static void add_player_pos(ServerPlayer *player, Array *players)
+{
+	array_apd(players, &(GenPlayerPos) {
+		.id = player->id,
+		.pos = get_player_chunkp(player),
+	});
+}
+
+// mtx has to be locked
+static GenPlayerQueue *get_queue(u64 player)
+{
+	for (size_t i = 0; i < queues.siz; i++) {
+		GenPlayerQueue *queue = ((GenPlayerQueue **) queues.ptr)[i];
+
+		if (queue->player == player)
+			return queue;
+	}
+
+	GenPlayerQueue *queue = malloc(sizeof *queue);
+	queue->player = player;
+	array_ini(&queue->heap, sizeof(GenTask *), 64);
+	queue->running = 0;
+
+	array_apd(&queues, &queue);
+	return queue;
+}
+
+// mtx has to be locked
+static void push_task(GenTask *task)
+{
+	task->state = TASK_WAITING;
+	num_waiting[task->lane]++;
+
+	if (task->lane == GEN_LANE_URGENT)
+		heap_push(&get_queue(task->player)->heap, task);
+	else
+		heap_push(&background, task);
+
+	pthread_cond_signal(&cv);
+}
+
+// mtx has to be locked
+static void set_lane(GenTask *task, GenLane lane, u64 player, v3s32 ppos)
+{
+	task->lane = lane;
+
+	if (lane == GEN_LANE_URGENT) {
+		task->player = player;
+		task->priority = distance_squared(task->pos, ppos);
+	} else {
+		task->player = 0;
+		task->priority = background_seq++;
+	}
+}
+
+// assign waiting urgent tasks to the nearest player in load distance, drop tasks that have none
+// cancelled tasks are added to the cancelled list, mtx has to be locked
+static void reprioritize(Array *players, Array *cancelled)
+{
+	Array waiting;
+	array_ini(&waiting, sizeof(GenTask *), 64);
+
+	for (size_t i = 0; i < queues.siz; i++) {
+		Array *heap = &((GenPlayerQueue **) queues.ptr)[i]->heap;
+
+		for (size_t j = 0; j < heap->siz; j++)
+			array_apd(&waiting, heap_at(heap, j));
+
+		heap->siz = 0;
+	}
+
+	for (size_t i = 0; i < waiting.siz; i++) {
+		GenTask *task = ((GenTask **) waiting.ptr)[i];
+		GenPlayerPos *nearest = NULL;
+		s64 nearest_dist = 0;
+
+		for (size_t j = 0; j < players->siz; j++) {
+			GenPlayerPos *player = &((GenPlayerPos *) players->ptr)[j];
+
+			if (!within_load_distance(player->pos, task->pos))
+				continue;
+
+			s64 dist = distance_squared(player->pos, task->pos);
+
+			if (!nearest || dist < nearest_dist) {
+				nearest = player;
+				nearest_dist = dist;
+			}
+		}
+
+		if (nearest) {
+			task->player = nearest->id;
+			task->priority = nearest_dist;
+			heap_push(&get_queue(task->player)->heap, task);
+		} else {
+			task->state = TASK_CANCELLED;
+			num_waiting[GEN_LANE_URGENT]--;
+			num_cancelled++;
+			array_apd(cancelled, &task->chunk);
+		}
+	}
+
+	array_clr(&waiting);
+
+	// forget about players that left
+	for (size_t i = 0; i < queues.siz;) {
+		GenPlayerQueue *queue = ((GenPlayerQueue **) queues.ptr)[i];
+
+		if (queue->heap.siz == 0 && queue->running == 0) {
+			array_clr(&queue->heap);
+			free(queue);
+
+			((GenPlayerQueue **) queues.ptr)[i] = ((GenPlayerQueue **) queues.ptr)[--queues.siz];
+		} else {
+			i++;
+		}
+	}
+}
+
+// take the next task, preferring the player with the fewest running tasks, mtx has to be locked
+static GenTask *pop_task()
+{
+	GenPlayerQueue *best = NULL;
+
+	for (size_t i = 0; i < queues.siz; i++) {
+		GenPlayerQueue *queue = ((GenPlayerQueue **) queues.ptr)[i];
+
+		if (queue->heap.siz == 0)
+			continue;
+
+		if (!best || queue->running < best->running || (queue->running == best->running
+				&& (*heap_at(&queue->heap, 0))->priority < (*heap_at(&best->heap, 0))->priority))
+			best = queue;
+	}
+
+	Array *heap = best ? &best->heap : &background;
+
+	if (heap->siz == 0)
+		return NULL;
+
+	GenTask *task = *heap_at(heap, 0);
+	heap_remove(heap, task);
+
+	if (best)
+		best->running++;
+
+	num_waiting[task->lane]--;
+	num_running++;
+	task->state = TASK_RUNNING;
+
+	return task;
+}
+
+static void delete_task(GenTask *task)
+{
+	free(task);
+}
+
+// public functions
+
+void gen_scheduler_init(void (*cancel)(TerrainChunk *chunk))
+{
+	pthread_mutex_init(&mtx, NULL);
+	pthread_cond_init(&cv, NULL);
+	stop = false;
+	cancel_callback = cancel;
+	tree_ini(&tasks);
+	array_ini(&queues, sizeof(GenPlayerQueue *), 8);
+	array_ini(&background, sizeof(GenTask *), 64);
+	background_seq = 0;
+	num_running = 0;
+	num_cancelled = 0;
+	clock_gettime(CLOCK_MONOTONIC, &last_reprioritize);
+
+	for (GenLane lane = 0; lane < COUNT_GEN_LANE; lane++)
+		num_waiting[lane] = 0;
+}
+
+// generation threads have to be stopped
+void gen_scheduler_deinit()
+{
+	tree_clr(&tasks, &delete_task, NULL, NULL, 0);
+
+	for (size_t i = 0; i < queues.siz; i++) {
+		GenPlayerQueue *queue = ((GenPlayerQueue **) queues.ptr)[i];
+		array_clr(&queue->heap);
+		free(queue);
+	}
+
+	array_clr(&queues);
+	array_clr(&background);
+	pthread_cond_destroy(&cv);
+	pthread_mutex_destroy(&mtx);
+}
+
+void gen_scheduler_add(TerrainChunk *chunk, GenLane lane, ServerPlayer *player)
+{
+	u64 id = player ? player->id : 0;
+	v3s32 ppos = player ? get_player_chunkp(player) : (v3s32) {0, 0, 0};
+
+	pthread_mutex_lock(&mtx);
+
+	GenTask *task = tree_get(&tasks, &chunk->pos, &cmp_task, NULL);
+
+	if (!task) {
+		task = malloc(sizeof *task);
+		task->pos = chunk->pos;
+		task->chunk = chunk;
+
+		set_lane(task, lane, id, ppos);
+		tree_add(&tasks, &task->pos, task, &cmp_task, NULL);
+		push_task(task);
+	} else if (task->state == TASK_CANCELLED) {
+		// requested again before the drop was confirmed
+		set_lane(task, lane, id, ppos);
+		push_task(task);
+	} else if (task->state == TASK_WAITING && task->lane == GEN_LANE_BACKGROUND && lane == GEN_LANE_URGENT) {
+		heap_remove(&background, task);
+		num_waiting[GEN_LANE_BACKGROUND]--;
+
+		set_lane(task, lane, id, ppos);
+		push_task(task);
+	}
+
+	pthread_mutex_unlock(&mtx);
+}
+
+bool gen_scheduler_drop(TerrainChunk *chunk)
+{
+	pthread_mutex_lock(&mtx);
+
+	GenTask *task = tree_get(&tasks, &chunk->pos, &cmp_task, NULL);
+	bool drop = task && task->state == TASK_CANCELLED;
+
+	if (drop) {
+		tree_del(&tasks, &task->pos, &cmp_task, NULL, NULL, NULL);
+		free(task);
+	}
+
+	pthread_mutex_unlock(&mtx);
+	return drop;
+}
+
+TerrainChunk *gen_scheduler_next()
+{
+	pthread_mutex_lock(&mtx);
+
+	for (;;) {
+		if (stop) {
+			pthread_mutex_unlock(&mtx);
+			return NULL;
+		}
+
+		if (num_waiting[GEN_LANE_URGENT] > 0 && seconds_since(&last_reprioritize) >= GEN_REPRIORITIZE_INTERVAL) {
+			clock_gettime(CLOCK_MONOTONIC, &last_reprioritize);
+
+			// positions are collected first so mtx isn't held while iterating players
+			pthread_mutex_unlock(&mtx);
+
+			Array players;
+			array_ini(&players, sizeof(GenPlayerPos), 8);
+			server_player_iterate(&add_player_pos, &players);
+
+			Array cancelled;
+			array_ini(&cancelled, sizeof(TerrainChunk *), 64);
+
+			pthread_mutex_lock(&mtx);
+			reprioritize(&players, &cancelled);
+			pthread_mutex_unlock(&mtx);
+
+			for (size_t i = 0; i < cancelled.siz; i++)
+				cancel_callback(((TerrainChunk **) cancelled.ptr)[i]);
+
+			array_clr(&cancelled);
+			array_clr(&players);
+
+			pthread_mutex_lock(&mtx);
+			continue;
+		}
+
+		GenTask *task = pop_task();
+
+		if (task) {
+			pthread_mutex_unlock(&mtx);
+			return task->chunk;
+		}
+
+		pthread_cond_wait(&cv, &mtx);
+	}
+}
+
+void gen_scheduler_done(TerrainChunk *chunk)
+{
+	pthread_mutex_lock(&mtx);
+
+	GenTask *task = tree_get(&tasks, &chunk->pos, &cmp_task, NULL);
+
+	if (task->lane == GEN_LANE_URGENT)
+		get_queue(task->player)->running--;
+
+	num_running--;
+	tree_del(&tasks, &task->pos, &cmp_task, NULL, NULL, NULL);
+	free(task);
+
+	pthread_mutex_unlock(&mtx);
+}
+
+void gen_scheduler_stop()
+{
+	pthread_mutex_lock(&mtx);
+	stop = true;
+	pthread_cond_broadcast(&cv);
+	pthread_mutex_unlock(&mtx);
+}
+
+GenSchedulerStats gen_scheduler_stats()
+{
+	pthread_mutex_lock(&mtx);
+
+	GenSchedulerStats stats = {
+		.running = num_running,
+		.cancelled = num_cancelled,
+	};
+
+	for (GenLane lane = 0; lane < COUNT_GEN_LANE; lane++)
+		stats.waiting[lane] = num_waiting[lane];
+
+	pthread_mutex_unlock(&mtx);
+	return stats;
+}
@@ -0,0 +1,52 @@
+#ifndef _GEN_SCHEDULER_H_
+#define _GEN_SCHEDULER_H_
+
+#include <stdbool.h>
+#include "common/terrain.h"
+#include "server/server_player.h"
+#include "types.h"
+
+// minimum time between two re-prioritizations of waiting chunks, in seconds
+#define GEN_REPRIORITIZE_INTERVAL 0.1
+
+typedef enum {
+	GEN_LANE_URGENT,     // chunks requested by players, nearest first
+	GEN_LANE_BACKGROUND, // bulk generation, in order of addition, only runs if no urgent chunks are waiting
+	COUNT_GEN_LANE,
+} GenLane;
+
+typedef struct {
+	size_t waiting[COUNT_GEN_LANE]; // chunks waiting for a generation thread
+	size_t running;                 // chunks currently being generated
+	size_t cancelled;               // urgent chunks dropped since startup because all players left
+} GenSchedulerStats;
+
+/*
+	Generation scheduler:
+	- decides which chunk the generation threads work on next
+	- urgent chunks belong to the nearest player that has them in load distance and are ordered by distance to that player,
+	  this is updated as players move, at most every GEN_REPRIORITIZE_INTERVAL seconds
+	- threads are shared fairly: the next chunk is taken from the player with the fewest chunks being generated,
+	  so a single player that quickly requests lots of chunks can't starve the others
+	- urgent chunks that are out of load distance of every player are dropped, the cancel callback is called for them
+	  without holding any scheduler lock, it has to lock the chunk meta mutex and confirm the drop with gen_scheduler_drop
+	- a chunk is known to the scheduler from gen_scheduler_add until gen_scheduler_done or a confirmed drop
+	- gen_scheduler_add and gen_scheduler_drop have to be called with the chunk meta mutex locked
+*/
+
+void gen_scheduler_init(void (*cancel)(TerrainChunk *chunk));
+void gen_scheduler_deinit();
+// add a chunk, or move a waiting background chunk to the urgent lane, or keep a chunk that is about to be dropped
+// player is the player that requested the chunk, NULL for background chunks
+void gen_scheduler_add(TerrainChunk *chunk, GenLane lane, ServerPlayer *player);
+// returns false if the chunk was added again since it was passed to the cancel callback
+bool gen_scheduler_drop(TerrainChunk *chunk);
+// wait for the next chunk to generate, returns NULL once gen_scheduler_stop is called
+TerrainChunk *gen_scheduler_next();
+// generation of a chunk returned by gen_scheduler_next has finished
+void gen_scheduler_done(TerrainChunk *chunk);
+// wake up all threads waiting in gen_scheduler_next
+void gen_scheduler_stop();
+GenSchedulerStats gen_scheduler_stats();
+
+#endif // _GEN_SCHEDULER_H_
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include "server/gen_stage.h"
+
+// a word holds the stages of 32 nodes
+#define NODES_PER_WORD 32
+
+static inline size_t node_index(v3s32 offset)
+{
+	return (offset.x * CHUNK_SIZE + offset.y) * CHUNK_SIZE + offset.z;
+}
+
+// all nodes of a word having the same stage
+static inline u64 uniform_word(TerrainGenStage stage)
+{
+	return 0x5555555555555555 * stage;
+}
+
+void gen_stage_ini(GenStageBuffer *buffer, TerrainGenStage stage)
+{
+	buffer->uniform = stage;
+	buffer->packed = NULL;
+}
+
+void gen_stage_dst(GenStageBuffer *buffer)
+{
+	if (buffer->packed)
+		free(buffer->packed);
+}
+
+TerrainGenStage gen_stage_get(GenStageBuffer *buffer, v3s32 offset)
+{
+	if (!buffer->packed)
+		return buffer->uniform;
+
+	size_t index = node_index(offset);
+	return buffer->packed->words[index / NODES_PER_WORD] >> (index % NODES_PER_WORD * 2) & 3;
+}
+
+void gen_stage_set(GenStageBuffer *buffer, v3s32 offset, TerrainGenStage stage)
+{
+	if (!buffer->packed) {
+		if (stage == buffer->uniform)
+			return;
+
+		buffer->packed = malloc(sizeof *buffer->packed);
+		for (size_t i = 0; i < TERRAIN_GEN_STAGE_WORDS; i++)
+			buffer->packed->words[i] = uniform_word(buffer->uniform);
+	}
+
+	size_t index = node_index(offset);
+	u64 *word = &buffer->packed->words[index / NODES_PER_WORD];
+	int shift = index % NODES_PER_WORD * 2;
+
+	*word = (*word & ~((u64) 3 << shift)) | (u64) stage << shift;
+}
+
+void gen_stage_fill(GenStageBuffer *buffer, TerrainGenStage stage)
+{
+	gen_stage_dst(buffer);
+	gen_stage_ini(buffer, stage);
+}
+
+bool gen_stage_uniform(GenStageBuffer *buffer, TerrainGenStage *stage)
+{
+	if (!buffer->packed) {
+		*stage = buffer->uniform;
+		return true;
+	}
+
+	TerrainGenStage first = buffer->packed->words[0] & 3;
+	u64 word = uniform_word(first);
+
+	for (size_t i = 0; i < TERRAIN_GEN_STAGE_WORDS; i++)
+		if (buffer->packed->words[i] != word)
+			return false;
+
+	*stage = first;
+	return true;
+}
+
+void gen_stage_compact(GenStageBuffer *buffer)
+{
+	TerrainGenStage stage;
+	if (buffer->packed && gen_stage_uniform(buffer, &stage))
+		gen_stage_fill(buffer, stage);
+}
@@ -0,0 +1,34 @@
+#ifndef _GEN_STAGE_H_
+#define _GEN_STAGE_H_
+
+#include "types.h"
+
+typedef enum {
+	STAGE_VOID,     // initial air, can be overridden by anything
+	STAGE_TERRAIN,  // basic terrain, can be overridden by anything except the void
+	STAGE_TREES,    // trees replace terrain
+	STAGE_PLAYER,   // player-placed nodes or things placed after terrain generation
+} TerrainGenStage;
+
+typedef struct {
+	TerrainGenStage uniform;           // stage of all nodes while packed is NULL
+	PackedTerrainGenStagesRaw *packed; // 2 bits per node, nodes are indexed in [x][y][z] order
+} GenStageBuffer;
+
+/*
+	Generation stage buffer:
+	- stores the TerrainGenStage of every node of a chunk, to make sure terrain generation only overrides things it should
+	- stages are packed into 2 bits per node (1 KiB per chunk)
+	- most chunks end up with all nodes in the same stage, those don't keep a packed array at all
+	- the buffer is protected by the chunk lock
+*/
+
+void gen_stage_ini(GenStageBuffer *buffer, TerrainGenStage stage);
+void gen_stage_dst(GenStageBuffer *buffer);
+TerrainGenStage gen_stage_get(GenStageBuffer *buffer, v3s32 offset);
+void gen_stage_set(GenStageBuffer *buffer, v3s32 offset, TerrainGenStage stage);
+void gen_stage_fill(GenStageBuffer *buffer, TerrainGenStage stage); // set all nodes to stage
+bool gen_stage_uniform(GenStageBuffer *buffer, TerrainGenStage *stage); // returns true if all nodes have the same stage
+void gen_stage_compact(GenStageBuffer *buffer); // free the packed array if all nodes have the same stage
+
+#endif // _GEN_STAGE_H_
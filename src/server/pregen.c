@@ -0,0 +1,140 @@
+#include <dragonstd/array.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "common/interrupt.h"
+#include "server/database.h"
+#include "server/pregen.h"
+#include "server/server_terrain.h"
+
+// number of chunks queued at once
+#define QUEUE_SIZE (2 * PREGEN_BATCH)
+// time between checks whether a chunk is finished, in microseconds
+#define POLL_INTERVAL 10000
+
+static f64 now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+// chunk positions in the order they are generated: ring by ring around the spawn, whole columns at once
+static void add_region(Array *positions, s32 radius)
+{
+	for (s32 r = 0; r <= radius; r++)
+	for (s32 x = -r; x <= r; x++)
+	// inner rows of the ring only have their first and last column on it
+	for (s32 z = -r; z <= r; z += (abs(x) == r) ? 1 : 2 * r)
+	for (s32 y = PREGEN_MIN_Y; y <= PREGEN_MAX_Y; y++)
+		array_apd(positions, &(v3s32) {x, y, z});
+}
+
+static TerrainChunk *enqueue_chunk(v3s32 pos)
+{
+	TerrainChunk *chunk = terrain_get_chunk(server_terrain, pos, CHUNK_MODE_CREATE);
+	// keep the chunk in memory until it is done
+	terrain_pin_chunk(chunk);
+	server_terrain_generate_chunk(pos);
+	return chunk;
+}
+
+// wait until a chunk has been generated and saved, returns false if interrupted
+static bool wait_chunk(TerrainChunk *chunk)
+{
+	TerrainChunkMeta *meta = chunk->extra;
+
+	while (!interrupt.set) {
+		pthread_mutex_lock(&meta->mtx);
+		TerrainChunkState state = meta->state;
+		bool committed = meta->committed;
+		pthread_mutex_unlock(&meta->mtx);
+
+		// the database writer sets committed once the generated chunk is in the database
+		if (state == CHUNK_STATE_READY && committed)
+			return true;
+
+		// a player may have requested the chunk and left again before it was generated
+		if (state == CHUNK_STATE_CREATED)
+			server_terrain_generate_chunk(chunk->pos);
+
+		usleep(POLL_INTERVAL);
+	}
+
+	return false;
+}
+
+static void print_progress(size_t done, size_t total, size_t generated, f64 elapsed)
+{
+	f64 rate = elapsed > 0.0 ? generated / elapsed : 0.0;
+	unsigned long eta = rate > 0.0 ? (total - done) / rate : 0;
+
+	fprintf(stderr, "[verbose] pregenerating... %zu/%zu chunks (%.1f%%), %.0f chunks/s, %luh %02lum %02lus remaining\n",
+		done, total, 100.0 * done / total, rate, eta / 3600, eta / 60 % 60, eta % 60);
+}
+
+// public functions
+
+bool pregen_run(s32 radius)
+{
+	Array positions;
+	array_ini(&positions, sizeof(v3s32), PREGEN_BATCH);
+	add_region(&positions, radius);
+
+	size_t total = positions.siz;
+	size_t start = 0;
+
+	// resume where a run with the same radius stopped
+	s64 saved_radius, saved_done;
+	if (database_load_meta("pregen_radius", &saved_radius) && saved_radius == radius
+			&& database_load_meta("pregen_done", &saved_done) && saved_done >= 0 && (size_t) saved_done <= total) {
+		start = saved_done;
+		fprintf(stderr, "[info] resuming pregeneration of %zu chunks at %zu\n", total, start);
+	} else {
+		database_save_meta("pregen_radius", radius);
+		database_save_meta("pregen_done", 0);
+		fprintf(stderr, "[info] pregenerating %zu chunks within a radius of %d chunks\n", total, radius);
+	}
+
+	TerrainChunk *queue[QUEUE_SIZE];
+	size_t done = start;
+	size_t queued = start;
+	bool interrupted = false;
+	f64 start_time = now();
+
+	while (done < total && !interrupted) {
+		while (queued < total && queued < done + QUEUE_SIZE) {
+			queue[queued % QUEUE_SIZE] = enqueue_chunk(((v3s32 *) positions.ptr)[queued]);
+			queued++;
+		}
+
+		size_t end = done + PREGEN_BATCH < total ? done + PREGEN_BATCH : total;
+
+		for (; done < end; done++) {
+			TerrainChunk *chunk = queue[done % QUEUE_SIZE];
+
+			if (!wait_chunk(chunk)) {
+				interrupted = true;
+				break;
+			}
+
+			terrain_unpin_chunk(chunk);
+		}
+
+		database_save_meta("pregen_done", done);
+		print_progress(done, total, done - start, now() - start_time);
+	}
+
+	for (; done < queued; done++)
+		terrain_unpin_chunk(queue[done % QUEUE_SIZE]);
+
+	array_clr(&positions);
+
+	if (interrupted)
+		fprintf(stderr, "[info] pregeneration interrupted, it resumes when started again with the same radius\n");
+	else
+		fprintf(stderr, "[info] pregeneration finished\n");
+
+	return !interrupted;
+}
@@ -0,0 +1,26 @@
+#ifndef _PREGEN_H_
+#define _PREGEN_H_
+
+#include <stdbool.h>
+#include "types.h"
+
+// chunks per progress checkpoint, progress is saved and reported after each batch
+#define PREGEN_BATCH 1024
+// vertical range of pregenerated chunks, same as the spawn region
+#define PREGEN_MIN_Y -10
+#define PREGEN_MAX_Y 10
+
+/*
+	Pregeneration:
+	- generates all chunks within radius (in chunks, horizontally) around the spawn, columns nearest to the spawn first
+	- chunks use the background lane of the generation scheduler, chunks requested by players always go first
+	- two batches are queued at once, so generation threads don't run out of work at the end of a batch
+	- a chunk counts as done once the database writer has committed it, transactions are up to the writer (see database.h)
+	- progress is checkpointed to the world after each batch of PREGEN_BATCH chunks, pregeneration with the same radius resumes there after an interruption
+	- stops early if the interrupt flag is set
+*/
+
+// returns true if the whole region has been generated
+bool pregen_run(s32 radius);
+
+#endif // _PREGEN_H_
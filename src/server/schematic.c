@@ -68,25 +68,19 @@ void schematic_load(List *schematic, const char *path, SchematicMapping *mapping
 	fclose(file);
 }
 
-void schematic_place(List *schematic, v3s32 pos, TerrainGenStage tgs, List *changed_chunks)
+void schematic_place(List *schematic, v3s32 pos, TerrainGenStage tgs, GenBatch *batch)
 {
 	LIST_ITERATE(schematic, list_node) {
 		SchematicNode *node = list_node->dat;
 
-		server_terrain_gen_node(
+		gen_batch_set_node(batch,
 			v3s32_add(pos, node->pos),
-			server_node_copy(node->node),
-			tgs, changed_chunks);
+			node->node,
+			tgs);
 	}
 }
 
-static void delete_schematic_node(SchematicNode *node)
-{
-	server_node_delete(&node->node);
-	free(node);
-}
-
 void schematic_delete(List *schematic)
 {
-	list_clr(schematic, &delete_schematic_node, NULL, NULL);
+	list_clr(schematic, &free, NULL, NULL);
 }
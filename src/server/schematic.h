@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include "common/node.h"
+#include "server/gen_batch.h"
 #include "server/server_terrain.h"
 #include "types.h"
 
@@ -20,7 +21,7 @@ typedef struct {
 } SchematicNode;
 
 void schematic_load(List *schematic, const char *path, SchematicMapping *mappings, size_t num_mappings);
-void schematic_place(List *schematic, v3s32 pos, TerrainGenStage tgs, List *changed_chunks);
+void schematic_place(List *schematic, v3s32 pos, TerrainGenStage tgs, GenBatch *batch);
 void schematic_delete(List *schematic);
 
 #endif // _SCHEMATIC_H_
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // don't worry, GNU extensions are only used when available
 #include <dragonnet/addr.h>
 #include <dragonnet/init.h>
 #include <getopt.h>
@@ -8,6 +9,7 @@
 #include "common/init.h"
 #include "common/interrupt.h"
 #include "server/database.h"
+#include "server/pregen.h"
 #include "server/server.h"
 #include "server/server_config.h"
 #include "server/server_item.h"
@@ -57,6 +59,17 @@ static void on_ToServerInventorySwap(DragonnetPeer *peer, ToServerInventorySwap
 	server_player_inventory_swap(peer->user, pkt);
 }
 
+// pregenerate while players are connected
+static void *pregen_thread(s32 *radius)
+{
+#ifdef __GLIBC__
+	pthread_setname_np(pthread_self(), "pregen");
+#endif // __GLIBC__
+
+	pregen_run(*radius);
+	return NULL;
+}
+
 // server entry point
 int main(int argc, char **argv)
 {
@@ -66,22 +79,25 @@ int main(int argc, char **argv)
 	bool exit_on_eof = false;
 	char *world_path = ".";
 	bool ipc = false;
+	s32 pregen_radius = -1;
 
 	struct option long_options[] = {
 		{"config",      required_argument, 0, 'c' },
 		{"exit-on-eof", no_argument,       0, 'e' },
 		{"world",       required_argument, 0, 'w' },
 		{"ipc",         no_argument,       0, 'i' },
+		{"pregen",      required_argument, 0, 'p' },
 		{}
 	};
 
 	int option;
-	while ((option = getopt_long(argc, argv, "c:ew:i", long_options, NULL)) != -1) {
+	while ((option = getopt_long(argc, argv, "c:ew:ip:", long_options, NULL)) != -1) {
 		switch (option) {
 			case 'c': config_path = optarg; break;
 			case 'e': exit_on_eof = true; break;
 			case 'w': world_path = optarg; break;
 			case 'i': ipc = true; break;
+			case 'p': pregen_radius = atoi(optarg); break;
 		}
 	}
 
@@ -89,11 +105,34 @@ int main(int argc, char **argv)
 
 	server_config_load(config_path);
 
-	if (argc-optind < 1) {
+	// without an address, the server only pregenerates the world and exits
+	bool offline = argc-optind < 1;
+
+	if (offline && pregen_radius < 0) {
 		fprintf(stderr, "[error] missing address\n");
 		exit(EXIT_FAILURE);
 	}
 
+	srand(time(0));
+
+	if (offline) {
+		interrupt_init();
+		database_init(world_path);
+		server_terrain_init();
+		server_player_init();
+
+		server_terrain_prepare_spawn();
+		bool finished = pregen_run(pregen_radius);
+
+		server_player_deinit();
+		server_terrain_deinit();
+		database_deinit();
+		interrupt_deinit();
+
+		dragonnet_deinit();
+		return finished ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	if (!(server = dragonnet_listener_new(argv[optind]))) {
 		fprintf(stderr, "[error] failed to listen to connections\n");
 		return EXIT_FAILURE;
@@ -111,8 +150,6 @@ int main(int argc, char **argv)
 	server->on_recv_type[DRAGONNET_TYPE_ToServerRequestChunk ] = (void *) &on_ToServerRequestChunk;
 	server->on_recv_type[DRAGONNET_TYPE_ToServerInventorySwap] = (void *) &on_ToServerInventorySwap;
 
-	srand(time(0));
-
 	interrupt_init();
 	database_init(world_path);
 	server_terrain_init();
@@ -121,11 +158,19 @@ int main(int argc, char **argv)
 	server_terrain_prepare_spawn();
 	dragonnet_listener_run(server);
 
+	pthread_t pregen;
+	if (pregen_radius >= 0)
+		pthread_create(&pregen, NULL, (void *) &pregen_thread, &pregen_radius);
+
 	flag_slp(&interrupt);
 
 	fprintf(stderr, "[info] shutting down\n");
 	dragonnet_listener_close(server);
 
+	// stops on its own once interrupted
+	if (pregen_radius >= 0)
+		pthread_join(pregen, NULL);
+
 	server_player_deinit();
 	server_terrain_deinit();
 	database_deinit();
@@ -4,6 +4,8 @@
 struct ServerConfig server_config = {
 	.load_distance = 10,
 	.terrain_gen_threads = 4,
+	.terrain_load_threads = 2,
+	.max_loaded_chunks = 16384,
 	.movement = {
 		.speed_normal = 4.317,
 		.speed_flight = 25.0,
@@ -23,6 +25,16 @@ static ConfigEntry config_entries[] = {
 		.key = "terrain_gen_threads",
 		.value = &server_config.terrain_gen_threads,
 	},
+	{
+		.type = CONFIG_UINT,
+		.key = "terrain_load_threads",
+		.value = &server_config.terrain_load_threads,
+	},
+	{
+		.type = CONFIG_UINT,
+		.key = "max_loaded_chunks",
+		.value = &server_config.max_loaded_chunks,
+	},
 	{
 		.type = CONFIG_FLOAT,
 		.key = "movement.speed_normal",
@@ -4,6 +4,8 @@
 extern struct ServerConfig {
 	unsigned int load_distance;
 	unsigned int terrain_gen_threads;
+	unsigned int terrain_load_threads;
+	unsigned int max_loaded_chunks;
 	struct {
 		double speed_normal;
 		double speed_flight;
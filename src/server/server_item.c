@@ -17,15 +17,15 @@ static void use_dig(__attribute__((unused)) ServerPlayer *player, ItemStack *sta
 	TerrainChunkMeta *meta = chunk->extra;
 	assert(pthread_rwlock_wrlock(&chunk->lock) == 0);
 
-	TerrainNode *node = &chunk->data[offset.x][offset.y][offset.z];
+	NodeType node = terrain_chunk_get_type(chunk, offset);
 
-	if (!(node_def[node->type].dig_class & item_def[stack->type].dig_class)) {
+	if (!(node_def[node].dig_class & item_def[stack->type].dig_class)) {
 		pthread_rwlock_unlock(&chunk->lock);
 		return;
 	}
 
-	server_terrain_replace_node(node, server_node_create(NODE_AIR));
-	meta->tgsb.raw.nodes[offset.x][offset.y][offset.z] = STAGE_PLAYER;
+	terrain_chunk_set_node(chunk, offset, server_node_create(NODE_AIR));
+	gen_stage_set(&meta->tgsb, offset, STAGE_PLAYER);
 
 	pthread_rwlock_unlock(&chunk->lock);
 
@@ -1,6 +1,7 @@
-#include <stdlib.h>
 #include "server/server_node.h"
 
+_Static_assert(sizeof(TreeData) <= TERRAIN_NODE_DATA_SIZE, "TreeData does not fit into TerrainNode");
+
 TerrainNode server_node_create(NodeType type)
 {
 	switch (type) {
@@ -8,7 +9,7 @@ TerrainNode server_node_create(NodeType type)
 			return server_node_create_tree(type, (TreeData) {{0.5f, 0.5f, 0.5f}, 0, {0, 0, 0}});
 
 		default:
-			return (TerrainNode) {type, NULL};
+			return (TerrainNode) {.type = type};
 	}
 }
 
@@ -25,39 +26,16 @@ TerrainNode server_node_create_color(NodeType type, v3f32 color)
 
 TerrainNode server_node_create_tree(NodeType type, TreeData data)
 {
-	TerrainNode node = {type, malloc(sizeof data)};
+	TerrainNode node = {.type = type};
 	*((TreeData *) node.data) = data;
 	return node;
 }
 
-TerrainNode server_node_copy(TerrainNode node)
-{
-	switch (node.type) {
-		NODES_TREE
-			return server_node_create_tree(node.type, *((TreeData *) node.data));
-
-		default:
-			return server_node_create(node.type);
-	}
-}
-
-void server_node_delete(TerrainNode *node)
-{
-	switch (node->type) {
-		NODES_TREE
-			free(node->data);
-			break;
-
-		default:
-			break;
-	}
-}
-
 void server_node_deserialize(TerrainNode *node, Blob buffer)
 {
 	switch (node->type) {
 		NODES_TREE
-			TreeData_read(&buffer, node->data = malloc(sizeof(TreeData)));
+			TreeData_read(&buffer, (TreeData *) node->data);
 			break;
 
 		default:
@@ -69,7 +47,7 @@ void server_node_serialize(TerrainNode *node, Blob *buffer)
 {
 	switch (node->type) {
 		NODES_TREE
-			TreeData_write(buffer, node->data);
+			TreeData_write(buffer, (TreeData *) node->data);
 			break;
 
 		default:
@@ -7,25 +7,39 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "common/interrupt.h"
+#include "common/slab.h"
 #include "common/terrain.h"
+#include "server/column_cache.h"
 #include "server/database.h"
+#include "server/gen_scheduler.h"
 #include "server/schematic.h"
 #include "server/server_config.h"
 #include "server/server_node.h"
 #include "server/server_terrain.h"
 #include "server/terrain_gen.h"
+#include "server/tree.h"
 
 // this file is too long
 Terrain *server_terrain;
 
 static atomic_bool cancel;                 // remove the smooth
-static Queue terrain_gen_tasks;            // this is terry the fat shark
 static pthread_t *terrain_gen_threads;     // thread pool
 static s32 spawn_height;                   // elevation to spawn players at
 static unsigned int num_gen_chunks;        // number of enqueued / generating chunks
 static pthread_mutex_t mtx_num_gen_chunks; // lock to protect the above
+static pthread_t evict_thread;             // unloads chunks nobody needs
+static pthread_mutex_t mtx_evict;          // used to wake up the evict thread on shutdown
+static pthread_cond_t cv_evict;            // same
+static atomic_size_t num_evicted;          // chunks evicted since startup
+static atomic_size_t num_saved;            // dirty chunks queued for writing on eviction
+static Slab *meta_slab;                    // chunk metadata is allocated from here
+static Queue load_queue;                   // chunks waiting to be loaded from the database
+static pthread_t *terrain_load_threads;    // load chunks from the database
+static pthread_mutex_t mtx_loaded;         // used to wait for chunks to be loaded
+static pthread_cond_t cv_loaded;           // same
 
 // utility functions
 
@@ -60,24 +74,32 @@ static void send_chunk_to_client(ServerPlayer *player, TerrainChunk *chunk)
 static void terrain_gen_step()
 {
 	// big chunkus
-	TerrainChunk *chunk = queue_deq(&terrain_gen_tasks, NULL);
+	TerrainChunk *chunk = gen_scheduler_next();
 
 	if (!chunk)
 		return;
 
 	TerrainChunkMeta *meta = chunk->extra;
 
-	List changed_chunks;
-	list_ini(&changed_chunks);
-	list_apd(&changed_chunks, chunk);
+	GenBatch batch;
+	gen_batch_ini(&batch);
+	gen_batch_add_changed(&batch, chunk); // takes over the pin from generate_chunk
 
-	terrain_gen_chunk(chunk, &changed_chunks);
+	terrain_gen_chunk(chunk, &batch);
+	// trees may reach into the chunk itself, they have to be in place before it is sent
+	gen_batch_apply(&batch);
+
+	// most chunks end up with a single stage, they don't need to keep per node stages
+	assert(pthread_rwlock_wrlock(&chunk->lock) == 0);
+	gen_stage_compact(&meta->tgsb);
+	pthread_rwlock_unlock(&chunk->lock);
 
 	pthread_mutex_lock(&meta->mtx);
 	meta->state = CHUNK_STATE_READY;
 	pthread_mutex_unlock(&meta->mtx);
 
-	server_terrain_lock_and_send_chunks(&changed_chunks);
+	gen_scheduler_done(chunk);
+	gen_batch_send(&batch);
 
 	pthread_mutex_lock(&mtx_num_gen_chunks);
 	num_gen_chunks--;
@@ -99,7 +121,8 @@ static void *terrain_gen_thread()
 	}
 
 // enqueue chunk
-static void generate_chunk(TerrainChunk *chunk)
+// meta mutex has to be locked, player is the player that requested the chunk (NULL for background generation)
+static void generate_chunk(TerrainChunk *chunk, GenLane lane, ServerPlayer *player)
 {
 	if (cancel)
 		return;
@@ -111,29 +134,215 @@ static void generate_chunk(TerrainChunk *chunk)
 	TerrainChunkMeta *meta = chunk->extra;
 
 	meta->state = CHUNK_STATE_GENERATING;
-	queue_enq(&terrain_gen_tasks, chunk);
+	terrain_pin_chunk(chunk);
+	gen_scheduler_add(chunk, lane, player);
 }
 
-// callback for initializing a newly created chunk
-// load chunk from database or initialize state, tgstage buffer and data
-static void on_create_chunk(TerrainChunk *chunk)
+// load a chunk from the database, chunks that were not saved before stay empty
+static bool terrain_load_step()
 {
-	TerrainChunkMeta *meta = chunk->extra = malloc(sizeof *meta);
-	pthread_mutex_init(&meta->mtx, NULL);
+	TerrainChunk *chunk = queue_deq(&load_queue, NULL);
 
-	if (database_load_chunk(chunk)) {
-		meta->data = terrain_serialize_chunk(server_terrain, chunk, &server_node_serialize_client);
-	} else {
+	// cancelled
+	if (!chunk)
+		return false;
+
+	TerrainChunkMeta *meta = chunk->extra;
+	bool generated = false;
+
+	// the chunk is hidden from everyone until it is loaded, nobody else is waiting for this lock
+	assert(pthread_rwlock_wrlock(&chunk->lock) == 0);
+	Blob data = database_load_chunk(chunk, &generated)
+		? terrain_serialize_chunk(server_terrain, chunk, &server_node_serialize_client)
+		: (Blob) {0, NULL};
+	pthread_rwlock_unlock(&chunk->lock);
+
+	pthread_mutex_lock(&meta->mtx);
+
+	meta->data = data;
+	meta->state = generated ? CHUNK_STATE_READY : CHUNK_STATE_CREATED;
+	meta->committed = generated;
+
+	ServerPlayer *requester = meta->requester;
+	meta->requester = NULL;
+
+	// serve requests that came in while loading
+	if (meta->state == CHUNK_STATE_READY) {
+		if (requester)
+			server_player_iterate(&send_chunk_to_client, chunk);
+	} else if (requester) {
+		generate_chunk(chunk, GEN_LANE_URGENT, requester);
+	} else if (meta->generate) {
+		generate_chunk(chunk, GEN_LANE_BACKGROUND, NULL);
+	}
+
+	// generate_chunk counted the chunk again
+	if (meta->generate) {
+		pthread_mutex_lock(&mtx_num_gen_chunks);
+		num_gen_chunks--;
+		pthread_mutex_unlock(&mtx_num_gen_chunks);
+	}
+
+	pthread_mutex_unlock(&meta->mtx);
+
+	if (requester)
+		refcount_drp(&requester->rc);
+
+	pthread_mutex_lock(&mtx_loaded);
+	pthread_cond_broadcast(&cv_loaded);
+	pthread_mutex_unlock(&mtx_loaded);
+
+	terrain_unpin_chunk(chunk);
+	return true;
+}
+
+static void *terrain_load_thread()
+{
+#ifdef __GLIBC__
+	pthread_setname_np(pthread_self(), "terrain_load");
+#endif // __GLIBC__
+
+	while (terrain_load_step());
+
+	return NULL;
+}
+
+// chunk that was never loaded because of shutdown
+static void cancel_load(TerrainChunk *chunk)
+{
+	TerrainChunkMeta *meta = chunk->extra;
+
+	if (meta->requester)
+		refcount_drp(&meta->requester->rc);
+	meta->requester = NULL;
+
+	terrain_unpin_chunk(chunk);
+}
+
+// callback for chunks that the scheduler dropped because no player is near them anymore
+static void on_cancel_chunk(TerrainChunk *chunk)
+{
+	TerrainChunkMeta *meta = chunk->extra;
+	pthread_mutex_lock(&meta->mtx);
+
+	// the chunk may have been requested again in the meantime
+	bool dropped = gen_scheduler_drop(chunk);
+
+	if (dropped)
 		meta->state = CHUNK_STATE_CREATED;
-		meta->data = (Blob) {0, NULL};
 
-		CHUNK_ITERATE {
-			chunk->data[x][y][z] = server_node_create(NODE_AIR);
-			meta->tgsb.raw.nodes[x][y][z] = STAGE_VOID;
-		}
+	pthread_mutex_unlock(&meta->mtx);
+
+	if (dropped) {
+		terrain_unpin_chunk(chunk);
+
+		pthread_mutex_lock(&mtx_num_gen_chunks);
+		num_gen_chunks--;
+		pthread_mutex_unlock(&mtx_num_gen_chunks);
 	}
 }
 
+typedef struct {
+	v3s32 pos;
+	bool near;
+} PlayerNearArg;
+
+// set flag if a player is close enough to a chunk to access it
+static void check_player_near(ServerPlayer *player, PlayerNearArg *arg)
+{
+	if (within_load_distance(player, arg->pos, server_config.load_distance))
+		arg->near = true;
+}
+
+// callback for deciding whether a chunk can be evicted
+// keep chunks that are generating, pinned or close to a player, queue dirty chunks for writing
+static bool on_evict_chunk(TerrainChunk *chunk, __attribute__((unused)) void *arg)
+{
+	TerrainChunkMeta *meta = chunk->extra;
+	pthread_mutex_lock(&meta->mtx);
+
+	bool evict = meta->state != CHUNK_STATE_GENERATING && meta->state != CHUNK_STATE_LOADING
+		&& !meta->queued && atomic_load(&chunk->pins) == 0;
+
+	if (evict) {
+		PlayerNearArg near = {.pos = chunk->pos, .near = false};
+		server_player_iterate(&check_player_near, &near);
+		evict = !near.near;
+	}
+
+	// the writer pins the chunk until it has been written, it can be evicted by a later pass
+	if (evict && meta->dirty) {
+		database_queue_chunk(chunk);
+		evict = false;
+		num_saved++;
+	}
+
+	pthread_mutex_unlock(&meta->mtx);
+	return evict;
+}
+
+// evict least recently used chunks if there are more than allowed
+static void evict_step()
+{
+	size_t loaded = atomic_load(&server_terrain->num_chunks);
+	size_t max = loaded > server_config.max_loaded_chunks ? loaded - server_config.max_loaded_chunks : 0;
+
+	size_t evicted = terrain_evict(server_terrain, max, &on_evict_chunk, NULL);
+
+	if (evicted) {
+		num_evicted += evicted;
+		fprintf(stderr, "[verbose] evicted %zu chunks, %zu loaded\n", evicted, loaded - evicted);
+	}
+}
+
+static void *evict_thread_func()
+{
+#ifdef __GLIBC__
+	pthread_setname_np(pthread_self(), "terrain_evict");
+#endif // __GLIBC__
+
+	pthread_mutex_lock(&mtx_evict);
+
+	while (!cancel) {
+		struct timespec timeout;
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_sec += 1;
+
+		pthread_cond_timedwait(&cv_evict, &mtx_evict, &timeout);
+		if (cancel)
+			break;
+
+		pthread_mutex_unlock(&mtx_evict);
+		evict_step();
+		pthread_mutex_lock(&mtx_evict);
+	}
+
+	pthread_mutex_unlock(&mtx_evict);
+	return NULL;
+}
+
+// callback for initializing a newly created chunk
+// initialize meta data and queue the chunk for loading, this is called with terrain locks held and must not block
+static void on_create_chunk(TerrainChunk *chunk)
+{
+	TerrainChunkMeta *meta = chunk->extra = slab_alloc(meta_slab);
+	pthread_mutex_init(&meta->mtx, NULL);
+	meta->state = CHUNK_STATE_LOADING;
+	meta->data = (Blob) {0, NULL};
+	meta->dirty = false;
+	meta->queued = false;
+	meta->committed = false;
+	meta->generate = false;
+	meta->requester = NULL;
+	gen_stage_ini(&meta->tgsb, STAGE_VOID);
+
+	// stays like this if the chunk was not saved before
+	terrain_chunk_fill(chunk, NODE_AIR);
+
+	terrain_pin_chunk(chunk);
+	queue_enq(&load_queue, chunk);
+}
+
 // callback for deleting a chunk
 // free meta data
 static void on_delete_chunk(TerrainChunk *chunk)
@@ -141,8 +350,9 @@ static void on_delete_chunk(TerrainChunk *chunk)
 	TerrainChunkMeta *meta = chunk->extra;
 	pthread_mutex_destroy(&meta->mtx);
 
+	gen_stage_dst(&meta->tgsb);
 	Blob_free(&meta->data);
-	free(meta);
+	slab_free(meta_slab, meta);
 }
 
 // callback for determining whether a chunk should be returned by terrain_get_chunk
@@ -164,8 +374,8 @@ static bool on_get_chunk(TerrainChunk *chunk, int mode)
 // generate a hut for new players to spawn in
 static void generate_spawn_hut()
 {
-	List changed_chunks;
-	list_ini(&changed_chunks);
+	GenBatch batch;
+	gen_batch_ini(&batch);
 
 	List spawn_hut;
 	schematic_load(&spawn_hut, ASSET_PATH "schematics/spawn_hut.txt", (SchematicMapping[]) {
@@ -182,9 +392,11 @@ static void generate_spawn_hut()
 	}, 2);
 
 	schematic_place(&spawn_hut, (v3s32) {0, spawn_height, 0},
-		STAGE_PLAYER, &changed_chunks);
+		STAGE_PLAYER, &batch);
 
 	schematic_delete(&spawn_hut);
+	// terrain below the hut is read to place the posts
+	gen_batch_apply(&batch);
 
 	// dynamic part of spawn hut - cannot be generated by a schematic
 
@@ -203,9 +415,22 @@ static void generate_spawn_hut()
 		(f32) 0x35 / 0xff};
 
 	for (int i = 0; i < 6; i++) {
+		// column below the post, read one chunk height at a time
+		NodeType column[CHUNK_SIZE];
+		s32 column_min = spawn_height;
+
 		for (s32 y = spawn_height - 1;; y--) {
 			v3s32 pos = {posts[i].x, y, posts[i].y};
-			NodeType node = terrain_get_node(server_terrain, pos).type;
+
+			if (y < column_min) {
+				column_min = y - CHUNK_SIZE + 1;
+				terrain_read_box(server_terrain, (aabb3s32) {
+					{posts[i].x, column_min, posts[i].y},
+					{posts[i].x, y, posts[i].y},
+				}, column);
+			}
+
+			NodeType node = column[y - column_min];
 
 			if (i >= 4) {
 				if (node != NODE_AIR)
@@ -217,14 +442,14 @@ static void generate_spawn_hut()
 			if (node_def[node].solid)
 				break;
 
-			server_terrain_gen_node(pos, node == NODE_LAVA
+			gen_batch_set_node(&batch, pos, node == NODE_LAVA
 					? server_node_create(NODE_VULCANO_STONE)
 					: server_node_create_color(NODE_OAK_WOOD, wood_color),
-				STAGE_PLAYER, &changed_chunks);
+				STAGE_PLAYER);
 		}
 	}
 
-	server_terrain_lock_and_send_chunks(&changed_chunks);
+	gen_batch_send(&batch);
 }
 
 // public functions
@@ -232,36 +457,74 @@ static void generate_spawn_hut()
 // called on server startup
 void server_terrain_init()
 {
+	meta_slab = slab_create(sizeof(TerrainChunkMeta));
 	server_terrain = terrain_create();
 	server_terrain->callbacks.create_chunk   = &on_create_chunk;
 	server_terrain->callbacks.delete_chunk   = &on_delete_chunk;
 	server_terrain->callbacks.get_chunk      = &on_get_chunk;
-	server_terrain->callbacks.delete_node    = &server_node_delete;
 
 	cancel = false;
-	queue_ini(&terrain_gen_tasks);
+	tree_init();
+	column_cache_init();
+
+	queue_ini(&load_queue);
+	pthread_mutex_init(&mtx_loaded, NULL);
+	pthread_cond_init(&cv_loaded, NULL);
+	terrain_load_threads = malloc(sizeof *terrain_load_threads * server_config.terrain_load_threads);
+
+	for (unsigned int i = 0; i < server_config.terrain_load_threads; i++)
+		pthread_create(&terrain_load_threads[i], NULL, &terrain_load_thread, NULL);
+
+	gen_scheduler_init(&on_cancel_chunk);
 	terrain_gen_threads = malloc(sizeof *terrain_gen_threads * server_config.terrain_gen_threads);
 	num_gen_chunks = 0;
 	pthread_mutex_init(&mtx_num_gen_chunks, NULL);
 
 	for (unsigned int i = 0; i < server_config.terrain_gen_threads; i++)
 		pthread_create(&terrain_gen_threads[i], NULL, (void *) &terrain_gen_thread, NULL);
+
+	atomic_init(&num_evicted, 0);
+	atomic_init(&num_saved, 0);
+	pthread_mutex_init(&mtx_evict, NULL);
+	pthread_cond_init(&cv_evict, NULL);
+	pthread_create(&evict_thread, NULL, &evict_thread_func, NULL);
 }
 
 // called on server shutdown
 void server_terrain_deinit()
 {
-	queue_fin(&terrain_gen_tasks);
+	pthread_mutex_lock(&mtx_evict);
 	cancel = true;
-	queue_cnl(&terrain_gen_tasks);
+	pthread_cond_signal(&cv_evict);
+	pthread_mutex_unlock(&mtx_evict);
+
+	gen_scheduler_stop();
+	pthread_join(evict_thread, NULL);
+	pthread_mutex_destroy(&mtx_evict);
+	pthread_cond_destroy(&cv_evict);
 
 	for (unsigned int i = 0; i < server_config.terrain_gen_threads; i++)
 		pthread_join(terrain_gen_threads[i], NULL);
 	free(terrain_gen_threads);
+	column_cache_deinit();
+
+	// generation may wait for chunks to load, stop loading after it
+	queue_cnl(&load_queue);
+	for (unsigned int i = 0; i < server_config.terrain_load_threads; i++)
+		pthread_join(terrain_load_threads[i], NULL);
+	free(terrain_load_threads);
+	queue_clr(&load_queue, &cancel_load, NULL, NULL);
+	queue_dst(&load_queue);
+	pthread_mutex_destroy(&mtx_loaded);
+	pthread_cond_destroy(&cv_loaded);
+
+	// queued chunks have to be written before they are deleted
+	database_flush();
 
 	pthread_mutex_destroy(&mtx_num_gen_chunks);
-	queue_dst(&terrain_gen_tasks);
+	gen_scheduler_deinit();
 	terrain_delete(server_terrain);
+	slab_delete(meta_slab);
 }
 
 // handle chunk request from client (thread safe)
@@ -273,11 +536,20 @@ void server_terrain_requested_chunk(ServerPlayer *player, v3s32 pos)
 
 		pthread_mutex_lock(&meta->mtx);
 		switch (meta->state) {
+			case CHUNK_STATE_LOADING:
+				// served once loaded
+				if (!meta->requester)
+					meta->requester = refcount_grb(&player->rc);
+				break;
+
 			case CHUNK_STATE_CREATED:
-				generate_chunk(chunk);
+				generate_chunk(chunk, GEN_LANE_URGENT, player);
 				break;
 
 			case CHUNK_STATE_GENERATING:
+				// moves background chunks to the urgent lane
+				if (!cancel)
+					gen_scheduler_add(chunk, GEN_LANE_URGENT, player);
 				break;
 
 			case CHUNK_STATE_READY:
@@ -320,32 +592,20 @@ void server_terrain_prepare_spawn()
 				if (interrupt.set)
 					return;
 
-				TerrainChunk *chunk = terrain_get_chunk(server_terrain, (v3s32) {x, y, z}, CHUNK_MODE_CREATE);
-				TerrainChunkMeta *meta = chunk->extra;
-
-				pthread_mutex_lock(&meta->mtx);
-				if (meta->state == CHUNK_STATE_CREATED)
-					generate_chunk(chunk);
-				pthread_mutex_unlock(&meta->mtx);
-
+				// there are no players yet, so this must not be dropped
+				server_terrain_generate_chunk((v3s32) {x, y, z});
 				update_percentage();
 			}
 		}
 	}
 
-	for (;;) {
+	while (server_terrain_num_gen_chunks() > 0) {
 		update_percentage();
-
-		pthread_mutex_lock(&mtx_num_gen_chunks);
-		bool done = (num_gen_chunks == 0);
-		pthread_mutex_unlock(&mtx_num_gen_chunks);
-
-		if (done)
-			break;
-
 		sched_yield();
 	}
 
+	update_percentage();
+
 	s64 saved_spawn_height;
 	if (database_load_meta("spawn_height", &saved_spawn_height)) {
 		spawn_height = saved_spawn_height;
@@ -359,10 +619,55 @@ void server_terrain_prepare_spawn()
 	}
 }
 
-void server_terrain_replace_node(TerrainNode *ptr, TerrainNode new)
+// generate a chunk in the background if it was not generated yet (thread safe)
+void server_terrain_generate_chunk(v3s32 pos)
+{
+	TerrainChunk *chunk = terrain_get_chunk(server_terrain, pos, CHUNK_MODE_CREATE);
+	TerrainChunkMeta *meta = chunk->extra;
+
+	pthread_mutex_lock(&meta->mtx);
+	if (meta->state == CHUNK_STATE_CREATED)
+		generate_chunk(chunk, GEN_LANE_BACKGROUND, NULL);
+	else if (meta->state == CHUNK_STATE_LOADING && !meta->generate) {
+		// counted as waiting for generation already, so callers waiting for generation to finish don't miss it
+		meta->generate = true;
+
+		pthread_mutex_lock(&mtx_num_gen_chunks);
+		num_gen_chunks++;
+		pthread_mutex_unlock(&mtx_num_gen_chunks);
+	}
+	pthread_mutex_unlock(&meta->mtx);
+}
+
+// number of chunks waiting for or being generated
+unsigned int server_terrain_num_gen_chunks()
 {
-	server_node_delete(ptr);
-	*ptr = new;
+	pthread_mutex_lock(&mtx_num_gen_chunks);
+	unsigned int num = num_gen_chunks;
+	pthread_mutex_unlock(&mtx_num_gen_chunks);
+
+	return num;
+}
+
+// wait until a chunk has been loaded from the database (thread safe)
+void server_terrain_wait_loaded(TerrainChunk *chunk)
+{
+	TerrainChunkMeta *meta = chunk->extra;
+
+	pthread_mutex_lock(&mtx_loaded);
+
+	for (;;) {
+		pthread_mutex_lock(&meta->mtx);
+		bool loading = meta->state == CHUNK_STATE_LOADING;
+		pthread_mutex_unlock(&meta->mtx);
+
+		if (!loading)
+			break;
+
+		pthread_cond_wait(&cv_loaded, &mtx_loaded);
+	}
+
+	pthread_mutex_unlock(&mtx_loaded);
 }
 
 void server_terrain_gen_node(v3s32 pos, TerrainNode node, TerrainGenStage new_tgs, List *changed_chunks)
@@ -371,21 +676,19 @@ void server_terrain_gen_node(v3s32 pos, TerrainNode node, TerrainGenStage new_tg
 	TerrainChunk *chunk = terrain_get_chunk_nodep(server_terrain, pos, &offset, CHUNK_MODE_CREATE);
 	TerrainChunkMeta *meta = chunk->extra;
 
+	server_terrain_wait_loaded(chunk);
 	assert(pthread_rwlock_wrlock(&chunk->lock) == 0);
 
-	u32 *tgs = &meta->tgsb.raw.nodes[offset.x][offset.y][offset.z];
-
-	if (new_tgs < *tgs) {
+	if (new_tgs < gen_stage_get(&meta->tgsb, offset)) {
 		pthread_rwlock_unlock(&chunk->lock);
-		server_node_delete(&node);
 		return;
 	}
 
-	*tgs = new_tgs;
-	server_terrain_replace_node(&chunk->data[offset.x][offset.y][offset.z], node);
+	gen_stage_set(&meta->tgsb, offset, new_tgs);
+	terrain_chunk_set_node(chunk, offset, node);
 
 	if (changed_chunks)
-		list_add(changed_chunks, chunk, chunk, &cmp_ref, NULL);
+		server_terrain_add_changed_chunk(changed_chunks, chunk);
 	else
 		server_terrain_send_chunk(chunk);
 
@@ -403,6 +706,8 @@ s32 server_terrain_spawn_height()
 void server_terrain_send_chunk(TerrainChunk *chunk)
 {
 	TerrainChunkMeta *meta = chunk->extra;
+	meta->dirty = true;
+	meta->committed = false;
 
 	if (meta->state == CHUNK_STATE_GENERATING)
 		return;
@@ -411,10 +716,11 @@ void server_terrain_send_chunk(TerrainChunk *chunk)
 
 	Blob_free(&meta->data);
 	meta->data = terrain_serialize_chunk(server_terrain, chunk, &server_node_serialize_client);
-	database_save_chunk(chunk);
 
 	pthread_rwlock_unlock(&chunk->lock);
 
+	database_queue_chunk(chunk);
+
 	if (meta->state == CHUNK_STATE_CREATED)
 		return;
 
@@ -430,7 +736,30 @@ void server_terrain_lock_and_send_chunk(TerrainChunk *chunk)
 	pthread_mutex_unlock(&meta->mtx);
 }
 
+static void lock_send_and_unpin_chunk(TerrainChunk *chunk)
+{
+	server_terrain_lock_and_send_chunk(chunk);
+	terrain_unpin_chunk(chunk);
+}
+
 void server_terrain_lock_and_send_chunks(List *changed_chunks)
 {
-	list_clr(changed_chunks, &server_terrain_lock_and_send_chunk, NULL, NULL);
+	list_clr(changed_chunks, &lock_send_and_unpin_chunk, NULL, NULL);
+}
+
+void server_terrain_add_changed_chunk(List *changed_chunks, TerrainChunk *chunk)
+{
+	if (list_add(changed_chunks, chunk, chunk, &cmp_ref, NULL))
+		terrain_pin_chunk(chunk);
+}
+
+ServerTerrainStats server_terrain_stats()
+{
+	return (ServerTerrainStats) {
+		.loaded = atomic_load(&server_terrain->num_chunks),
+		.evicted = atomic_load(&num_evicted),
+		.saved = atomic_load(&num_saved),
+		.chunk_memory = slab_stats(server_terrain->chunk_slab),
+		.meta_memory = slab_stats(meta_slab),
+	};
 }
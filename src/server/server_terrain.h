@@ -4,22 +4,17 @@
 #include <dragonstd/list.h>
 #include <pthread.h>
 #include "common/terrain.h"
+#include "server/gen_stage.h"
 #include "server/server_player.h"
 #include "types.h"
 
 typedef enum {
+	CHUNK_STATE_LOADING,    // chunk is being loaded from the database, its data is not valid yet
 	CHUNK_STATE_CREATED,    // chunk exists but was not yet generated
 	CHUNK_STATE_GENERATING, // currently generating in a seperate thread
 	CHUNK_STATE_READY,      // generation finished
 } TerrainChunkState;
 
-typedef enum {
-	STAGE_VOID,     // initial air, can be overridden by anything
-	STAGE_TERRAIN,  // basic terrain, can be overridden by anything except the void
-	STAGE_TREES,    // trees replace terrain
-	STAGE_PLAYER,   // player-placed nodes or things placed after terrain generation
-} TerrainGenStage;
-
 typedef struct {
 	TerrainGenStage tgs;
 	List *changed_chunks;
@@ -29,8 +24,13 @@ typedef struct {
 	pthread_mutex_t mtx;        // UwU please hit me senpai
 	Blob data;                  // the big cum
 	TerrainChunkState state;    // generation state of the chunk
+	bool dirty;                 // chunk was changed since it was last saved
+	bool queued;                // chunk is waiting for the database writer
+	bool committed;             // chunk is in the database as it is now, set by the database writer after committing
 	pthread_t gen_thread;       // thread that is generating chunk
-	TerrainGenStageBuffer tgsb; // buffer to make sure terraingen only overrides things it should
+	GenStageBuffer tgsb;        // buffer to make sure terraingen only overrides things it should
+	bool generate;              // generate in the background once loaded
+	ServerPlayer *requester;    // player that requested the chunk while it was loading, holds a reference
 } TerrainChunkMeta; // OMG META VERSE WEB 3.0 VIRTUAL REALITY
 
 /*
@@ -39,7 +39,7 @@ typedef struct {
 	- meta mutex protects everything else in meta
 	- if both meta mutex and chunk are going to be locked, meta must be locked first
 	- you may not lock multiple meta mutexes at once
-	- if multiple chunk locks are being obtained at once, EDEADLK must be handled
+	- if multiple chunk locks are being obtained at once, a TerrainLockSet must be used
 	- when locking a single chunk, assert return value of zero
 
 	After changing the data in a chunk:
@@ -54,8 +54,24 @@ typedef struct {
 		- use server_terrain_lock_and_send_chunks to clear the list
 
 	Note: Unless changed_chunks is given to server_terrain_gen_node, it sends chunks automatically
+
+	Terrain generation writes lots of nodes at once and uses a GenBatch (see gen_batch.h) instead of changed_chunks.
+
+	Chunks in changed_chunks lists and in the generation queue are pinned so they can't be evicted.
+
+	Chunks are loaded from the database by load threads, terrain_get_chunk with CHUNK_MODE_CREATE may return a chunk that is still loading.
+	Use server_terrain_wait_loaded before accessing its data, without holding the meta mutex or chunk lock.
+	Chunks that are loading are pinned as well.
 */
 
+typedef struct {
+	size_t loaded;  // chunks currently in memory
+	size_t evicted; // chunks evicted since startup
+	size_t saved;   // dirty chunks queued for writing on eviction
+	SlabStats chunk_memory; // allocator statistics of chunks
+	SlabStats meta_memory;  // allocator statistics of chunk metadata
+} ServerTerrainStats;
+
 // terrain object, data is stored here
 extern Terrain *server_terrain;
 
@@ -67,8 +83,12 @@ void server_terrain_deinit();
 void server_terrain_requested_chunk(ServerPlayer *player, v3s32 pos);
 // prepare spawn region
 void server_terrain_prepare_spawn();
-// delete old node and put new
-void server_terrain_replace_node(TerrainNode *ptr, TerrainNode new);
+// generate a chunk in the background if it was not generated yet (thread safe)
+void server_terrain_generate_chunk(v3s32 pos);
+// number of chunks waiting for or being generated, including chunks that are loaded before that
+unsigned int server_terrain_num_gen_chunks();
+// wait until a chunk has been loaded from the database (thread safe)
+void server_terrain_wait_loaded(TerrainChunk *chunk);
 // set node with terraingen stage
 void server_terrain_gen_node(v3s32 pos, TerrainNode node, TerrainGenStage new_tgs, List *changed_chunks);
 // get the spawn height because idk
@@ -79,5 +99,9 @@ void server_terrain_send_chunk(TerrainChunk *chunk);
 void server_terrain_lock_and_send_chunk(TerrainChunk *chunk);
 // lock and send multiple chunks at once
 void server_terrain_lock_and_send_chunks(List *list);
+// add chunk to changed_chunks list and pin it
+void server_terrain_add_changed_chunk(List *changed_chunks, TerrainChunk *chunk);
+// counters for monitoring chunk eviction
+ServerTerrainStats server_terrain_stats();
 
 #endif // _SERVER_TERRAIN_H_
@@ -1,35 +1,192 @@
 #include <assert.h>
 #include <math.h>
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <time.h>
 #include "common/environment.h"
 #include "common/perlin.h"
 #include "server/biomes.h"
+#include "server/column_cache.h"
 #include "server/server_node.h"
 #include "server/server_terrain.h"
 #include "server/terrain_gen.h"
 #include "server/tree.h"
 
-s32 terrain_gen_get_base_height(v2s32 pos)
+static atomic_bool profile = false;
+static struct {
+	atomic_uint_fast64_t chunks;
+	atomic_uint_fast64_t uniform_chunks;
+	atomic_uint_fast64_t biome_ns[COUNT_BIOME];
+	atomic_uint_fast64_t tree_ns[NUM_TREES];
+	atomic_uint_fast64_t trees[NUM_TREES];
+} profile_totals;
+
+static u64 profile_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static s32 calculate_base_height(f64 height, f64 hillyness)
 {
 	return 1.0
-		* (pnoise2d(U32(pos.x) /  32.0, U32(pos.y) /  32.0, 0.45, 5, seed + OFFSET_HEIGHT)    * 16.0 + 0.0)
-		* (pnoise2d(U32(pos.x) / 256.0, U32(pos.y) / 256.0, 0.45, 5, seed + OFFSET_HILLYNESS) *  0.5 + 0.5)
+		* (height    * 16.0 + 0.0)
+		* (hillyness *  0.5 + 0.5)
 		+ 32.0;
 }
 
-// generate a chunk (does not manage chunk state or threading)
-void terrain_gen_chunk(TerrainChunk *chunk, List *changed_chunks)
+s32 terrain_gen_get_base_height(v2s32 pos)
+{
+	return calculate_base_height(
+		pnoise2d(U32(pos.x) /  32.0, U32(pos.y) /  32.0, 0.45, 5, seed + OFFSET_HEIGHT),
+		pnoise2d(U32(pos.x) / 256.0, U32(pos.y) / 256.0, 0.45, 5, seed + OFFSET_HILLYNESS));
+}
+
+// set all nodes of a chunk that are not protected by a later stage
+static void fill_chunk(TerrainChunk *chunk, NodeType node)
 {
 	TerrainChunkMeta *meta = chunk->extra;
 
-	BiomeArgsChunk chunk_args;
+	assert(pthread_rwlock_wrlock(&chunk->lock) == 0);
+
+	TerrainGenStage stage;
+	if (gen_stage_uniform(&meta->tgsb, &stage) && stage <= STAGE_TERRAIN) {
+		gen_stage_fill(&meta->tgsb, STAGE_TERRAIN);
+		terrain_chunk_fill(chunk, node);
+	} else CHUNK_ITERATE {
+		if (gen_stage_get(&meta->tgsb, (v3s32) {x, y, z}) <= STAGE_TERRAIN) {
+			gen_stage_set(&meta->tgsb, (v3s32) {x, y, z}, STAGE_TERRAIN);
+			terrain_chunk_set_node(chunk, (v3s32) {x, y, z}, server_node_create(node));
+		}
+	}
+
+	pthread_rwlock_unlock(&chunk->lock);
+}
+
+static size_t get_row_data_size()
+{
+	size_t row_data_size = 0;
+	for (Biome i = 0; i < COUNT_BIOME; i++)
+		if (biomes[i].row_data_size > row_data_size)
+			row_data_size = biomes[i].row_data_size;
+
+	return row_data_size;
+}
+
+// compute 2D values of a column of chunks
+void terrain_gen_column_ini(ColumnMap *map, v2s32 pos)
+{
+	BiomeArgsColumn column_args;
 	BiomeArgsRow row_args;
 	BiomeArgsHeight height_args;
-	BiomeArgsGenerate generate_args;
 	TreeArgsCondition condition_args;
 
-	chunk_args.chunk = condition_args.chunk = chunk;
-	chunk_args.changed_chunks = generate_args.changed_chunks = changed_chunks;
+	map->pos = pos;
+
+	size_t row_data_size = get_row_data_size();
+	map->row_data = row_data_size ? malloc(row_data_size * CHUNK_SIZE * CHUNK_SIZE) : NULL;
+
+	for (Biome i = 0; i < COUNT_BIOME; i++) {
+		map->has_biome[i] = false;
+		map->column_data[i] = NULL;
+	}
+
+	column_args.pos = (v2s32) {pos.x * CHUNK_SIZE, pos.y * CHUNK_SIZE};
+
+	// noise is evaluated for all columns at once
+	v2s32 size = {CHUNK_SIZE, CHUNK_SIZE};
+	Biome biome[CHUNK_SIZE][CHUNK_SIZE];
+	f64 factor[CHUNK_SIZE][CHUNK_SIZE];
+	f64 height[CHUNK_SIZE][CHUNK_SIZE];
+	f64 hillyness[CHUNK_SIZE][CHUNK_SIZE];
+	f64 humidity[CHUNK_SIZE][CHUNK_SIZE];
+	f64 temperature[CHUNK_SIZE][CHUNK_SIZE];
+
+	get_biome_tile(&biome[0][0], &factor[0][0], column_args.pos, size);
+	pnoise2d_tile(&height[0][0], column_args.pos, size,  32.0, 0.45, 5, seed + OFFSET_HEIGHT);
+	pnoise2d_tile(&hillyness[0][0], column_args.pos, size, 256.0, 0.45, 5, seed + OFFSET_HILLYNESS);
+	get_humidity_tile(&humidity[0][0], column_args.pos, size);
+	get_column_temperature_tile(&temperature[0][0], column_args.pos, size);
+
+	for (s32 x = 0; x < CHUNK_SIZE; x++)
+	for (s32 z = 0; z < CHUNK_SIZE; z++) {
+		ColumnInfo *column = &map->columns[x][z];
+		row_args.pos = height_args.pos = (v2s32) {column_args.pos.x + x, column_args.pos.y + z};
+
+		column->biome = biome[x][z];
+		column->factor = factor[x][z];
+		BiomeDef *biome_def = &biomes[column->biome];
+
+		height_args.factor = row_args.factor = column->factor;
+
+		if (!map->has_biome[column->biome]) {
+			if (biome_def->column_data_size)
+				map->column_data[column->biome] = malloc(biome_def->column_data_size);
+
+			column_args.column_data = map->column_data[column->biome];
+
+			if (biome_def->before_column)
+				biome_def->before_column(&column_args);
+
+			map->has_biome[column->biome] = true;
+		}
+
+		row_args.column_data = height_args.column_data = map->column_data[column->biome];
+		column->row_data = row_args.row_data = height_args.row_data =
+			row_data_size ? &map->row_data[(x * CHUNK_SIZE + z) * row_data_size] : NULL;
+
+		if (biome_def->before_row)
+			biome_def->before_row(&row_args);
+
+		column->base_height = height_args.height = calculate_base_height(height[x][z], hillyness[x][z]);
+		column->height = biome_def->height(&height_args);
+
+		column->humidity = humidity[x][z];
+		column->temperature = temperature[x][z];
+
+		condition_args.pos = (v3s32) {row_args.pos.x, column->height + 1, row_args.pos.y};
+		condition_args.humidity = column->humidity;
+		condition_args.temperature = get_temperature_at(column->temperature, condition_args.pos.y);
+		condition_args.biome = column->biome;
+		condition_args.factor = column->factor;
+		condition_args.row_data = column->row_data;
+
+		column->tree = -1;
+
+		for (int i = 0; i < NUM_TREES; i++) {
+			TreeDef *def = &tree_def[i];
+
+			if (def->condition(&condition_args)
+					&& noise2d(condition_args.pos.x, condition_args.pos.z, 0, seed + def->offset) * 0.5 + 0.5 < def->probability
+					&& smooth2d(U32(condition_args.pos.x) / def->spread, U32(condition_args.pos.z) / def->spread, 0, seed + def->area_offset) * 0.5 + 0.5 < def->area_probability) {
+				column->tree = i;
+				break;
+			}
+		}
+	}
+}
+
+void terrain_gen_column_dst(ColumnMap *map)
+{
+	for (Biome i = 0; i < COUNT_BIOME; i++)
+		if (map->column_data[i])
+			free(map->column_data[i]);
+
+	if (map->row_data)
+		free(map->row_data);
+}
+
+// generate the base terrain of a chunk, without trees
+static void generate_base(TerrainChunk *chunk, bool profiling, TerrainGenProfile *chunk_profile)
+{
+	TerrainChunkMeta *meta = chunk->extra;
+
+	BiomeArgsChunk chunk_args;
+	BiomeArgsUniform uniform_args;
+	BiomeArgsGenerate generate_args;
+
+	chunk_args.chunk = generate_args.chunk = chunk;
 
 	v3s32 chunkp = {
 		chunk->pos.x * CHUNK_SIZE,
@@ -37,91 +194,91 @@ void terrain_gen_chunk(TerrainChunk *chunk, List *changed_chunks)
 		chunk->pos.z * CHUNK_SIZE,
 	};
 
+	// 2D values are shared with the chunks above and below
+	ColumnMap *map = column_cache_get((v2s32) {chunk->pos.x, chunk->pos.z});
+
 	unsigned char *chunk_data[COUNT_BIOME] = {NULL};
-	bool has_biome[COUNT_BIOME] = {false};
 
-	for (s32 x = 0; x < CHUNK_SIZE; x++) {
-		s32 pos_x = chunkp.x + x;
+	for (Biome i = 0; i < COUNT_BIOME; i++) {
+		if (!map->has_biome[i])
+			continue;
 
-		for (s32 z = 0; z < CHUNK_SIZE; z++) {
-			row_args.pos = height_args.pos = (v2s32) {pos_x, chunkp.z + z};
+		if (biomes[i].chunk_data_size)
+			chunk_data[i] = malloc(biomes[i].chunk_data_size);
 
-			condition_args.biome = get_biome(row_args.pos, &condition_args.factor);
-			BiomeDef *biome_def = &biomes[condition_args.biome];
+		chunk_args.chunk_data = chunk_data[i];
 
-			height_args.factor = generate_args.factor = row_args.factor
-				= condition_args.factor;
+		if (biomes[i].before_chunk)
+			biomes[i].before_chunk(&chunk_args);
+	}
 
-			if (biome_def->chunk_data_size && !chunk_data[condition_args.biome])
-				chunk_data[condition_args.biome] = malloc(biome_def->chunk_data_size);
+	// if all columns agree on a single type, the chunk can be filled without generating every node
+	NodeType uniform = NODE_UNKNOWN;
+	uniform_args.min_y = chunkp.y;
+	uniform_args.max_y = chunkp.y + CHUNK_SIZE - 1;
 
-			chunk_args.chunk_data = row_args.chunk_data = height_args.chunk_data =
-				generate_args.chunk_data = condition_args.chunk_data =
-				chunk_data[condition_args.biome];
+	for (s32 x = 0; x < CHUNK_SIZE && uniform != COUNT_NODE; x++)
+	for (s32 z = 0; z < CHUNK_SIZE && uniform != COUNT_NODE; z++) {
+		ColumnInfo *column = &map->columns[x][z];
+		BiomeDef *biome_def = &biomes[column->biome];
 
-			if (!has_biome[condition_args.biome]) {
-				if (biome_def->before_chunk)
-					biome_def->before_chunk(&chunk_args);
+		uniform_args.height = column->height;
+		uniform_args.row_data = column->row_data;
 
-				has_biome[condition_args.biome] = true;
-			}
+		NodeType node = biome_def->uniform ? biome_def->uniform(&uniform_args) : COUNT_NODE;
 
-			unsigned char row_data[biome_def->row_data_size];
-			row_args.row_data = height_args.row_data = generate_args.row_data =
-				condition_args.row_data = row_data;
-
-			if (biome_def->before_row)
-				biome_def->before_row(&row_args);
-
-			height_args.height = terrain_gen_get_base_height(height_args.pos);
-			s32 height = biome_def->height(&height_args);
-
-			for (s32 y = 0; y < CHUNK_SIZE; y++) {
-				generate_args.offset = (v3s32) {x, y, z};
-
-				generate_args.pos = condition_args.pos = (v3s32)
-					{row_args.pos.x, chunkp.y + y, row_args.pos.y};
-				generate_args.diff = generate_args.pos.y - height;
-
-				generate_args.humidity = condition_args.humidity =
-					get_humidity(generate_args.pos);
-				generate_args.temperature = condition_args.temperature =
-					get_temperature(generate_args.pos);
-
-				NodeType node = biome_def->generate(&generate_args);
-
-				if (biome_def->snow
-						&& generate_args.diff <= 1
-						&& generate_args.temperature < 0.0
-						&& node == NODE_AIR)
-					node = NODE_SNOW;
-
-				if (generate_args.diff == 1) for (int i = 0; i < NUM_TREES; i++) {
-					TreeDef *def = &tree_def[i];
-
-					if (def->condition(&condition_args)
-							&& noise2d(condition_args.pos.x, condition_args.pos.z, 0, seed + def->offset) * 0.5 + 0.5 < def->probability
-							&& smooth2d(U32(condition_args.pos.x) / def->spread, U32(condition_args.pos.z) / def->spread, 0, seed + def->area_offset) * 0.5 + 0.5 < def->area_probability) {
-						def->generate(condition_args.pos, changed_chunks);
-						break;
-					}
-				}
-
-				assert(pthread_rwlock_wrlock(&chunk->lock) == 0);
-				if (meta->tgsb.raw.nodes[x][y][z] <= STAGE_TERRAIN) {
-					server_terrain_replace_node(&chunk->data[x][y][z], server_node_create(node));
-					meta->tgsb.raw.nodes[x][y][z] = STAGE_TERRAIN;
-				}
-				pthread_rwlock_unlock(&chunk->lock);
-			}
+		if (uniform == NODE_UNKNOWN)
+			uniform = node;
+		else if (uniform != node)
+			uniform = COUNT_NODE;
+	}
+
+	if (uniform != COUNT_NODE) {
+		fill_chunk(chunk, uniform);
+		chunk_profile->uniform_chunks++;
+	} else for (s32 x = 0; x < CHUNK_SIZE; x++)
+	for (s32 z = 0; z < CHUNK_SIZE; z++) {
+		ColumnInfo *column = &map->columns[x][z];
+		BiomeDef *biome_def = &biomes[column->biome];
+
+		u64 column_start = profiling ? profile_clock() : 0;
+
+		generate_args.factor = column->factor;
+		generate_args.chunk_data = chunk_data[column->biome];
+		generate_args.row_data = column->row_data;
+		generate_args.humidity = column->humidity;
+
+		for (s32 y = 0; y < CHUNK_SIZE; y++) {
+			generate_args.offset = (v3s32) {x, y, z};
+
+			generate_args.pos = (v3s32)
+				{chunkp.x + x, chunkp.y + y, chunkp.z + z};
+			generate_args.diff = generate_args.pos.y - column->height;
+
+			generate_args.temperature = get_temperature_at(column->temperature, generate_args.pos.y);
+
+			NodeType node = biome_def->generate(&generate_args);
 
-			if (biome_def->after_row)
-				biome_def->after_row(&row_args);
+			if (biome_def->snow
+					&& generate_args.diff <= 1
+					&& generate_args.temperature < 0.0
+					&& node == NODE_AIR)
+				node = NODE_SNOW;
+
+			assert(pthread_rwlock_wrlock(&chunk->lock) == 0);
+			if (gen_stage_get(&meta->tgsb, (v3s32) {x, y, z}) <= STAGE_TERRAIN) {
+				terrain_chunk_set_node(chunk, (v3s32) {x, y, z}, server_node_create(node));
+				gen_stage_set(&meta->tgsb, (v3s32) {x, y, z}, STAGE_TERRAIN);
+			}
+			pthread_rwlock_unlock(&chunk->lock);
 		}
+
+		if (profiling)
+			chunk_profile->biome_ns[column->biome] += profile_clock() - column_start;
 	}
 
 	for (Biome i = 0; i < COUNT_BIOME; i++) {
-		if (has_biome[i]) {
+		if (map->has_biome[i]) {
 			chunk_args.chunk_data = chunk_data[i];
 
 			if (biomes[i].after_chunk)
@@ -131,4 +288,116 @@ void terrain_gen_chunk(TerrainChunk *chunk, List *changed_chunks)
 				free(chunk_args.chunk_data);
 		}
 	}
+
+	column_cache_release(map);
+}
+
+// place the parts of all trees that reach into a chunk
+// columns are visited in the same order for every chunk, so overlapping trees are placed in the same order everywhere
+static void decorate_chunk(TerrainChunk *chunk, GenBatch *batch, bool profiling, TerrainGenProfile *chunk_profile)
+{
+	aabb3s32 box;
+	box.min = (v3s32) {chunk->pos.x * CHUNK_SIZE, chunk->pos.y * CHUNK_SIZE, chunk->pos.z * CHUNK_SIZE};
+	box.max = v3s32_add(box.min, (v3s32) {CHUNK_SIZE - 1, CHUNK_SIZE - 1, CHUNK_SIZE - 1});
+
+	// bounds of all tree types
+	aabb3s32 reach = {{0, 0, 0}, {0, 0, 0}};
+	for (int i = 0; i < NUM_TREES; i++) {
+		reach.min.x = s32_min(reach.min.x, tree_def[i].bounds.min.x);
+		reach.min.y = s32_min(reach.min.y, tree_def[i].bounds.min.y);
+		reach.min.z = s32_min(reach.min.z, tree_def[i].bounds.min.z);
+		reach.max.x = s32_max(reach.max.x, tree_def[i].bounds.max.x);
+		reach.max.y = s32_max(reach.max.y, tree_def[i].bounds.max.y);
+		reach.max.z = s32_max(reach.max.z, tree_def[i].bounds.max.z);
+	}
+
+	// trees rooted outside of this box can't reach into the chunk
+	aabb3s32 roots = {
+		v3s32_sub(box.min, reach.max),
+		v3s32_sub(box.max, reach.min),
+	};
+
+	v3s32 min_chunkp = terrain_chunkp(roots.min);
+	v3s32 max_chunkp = terrain_chunkp(roots.max);
+
+	gen_batch_clip(batch, box);
+
+	for (s32 cx = min_chunkp.x; cx <= max_chunkp.x; cx++)
+	for (s32 cz = min_chunkp.z; cz <= max_chunkp.z; cz++) {
+		ColumnMap *map = column_cache_get((v2s32) {cx, cz});
+
+		for (s32 x = 0; x < CHUNK_SIZE; x++)
+		for (s32 z = 0; z < CHUNK_SIZE; z++) {
+			ColumnInfo *column = &map->columns[x][z];
+
+			if (column->tree < 0)
+				continue;
+
+			TreeDef *def = &tree_def[column->tree];
+			v3s32 root = {cx * CHUNK_SIZE + x, column->height + 1, cz * CHUNK_SIZE + z};
+			v3s32 tree_min = v3s32_add(root, def->bounds.min);
+			v3s32 tree_max = v3s32_add(root, def->bounds.max);
+
+			if (tree_max.x < box.min.x || tree_min.x > box.max.x
+					|| tree_max.y < box.min.y || tree_min.y > box.max.y
+					|| tree_max.z < box.min.z || tree_min.z > box.max.z)
+				continue;
+
+			u64 tree_start = profiling ? profile_clock() : 0;
+			def->generate(root, batch);
+
+			if (profiling) {
+				chunk_profile->tree_ns[column->tree] += profile_clock() - tree_start;
+				chunk_profile->trees[column->tree]++;
+			}
+		}
+
+		column_cache_release(map);
+	}
+}
+
+// generate a chunk (does not manage chunk state or threading), the chunk has to be in batch
+void terrain_gen_chunk(TerrainChunk *chunk, GenBatch *batch)
+{
+	// profile is gathered per chunk and added to the totals at the end
+	bool profiling = atomic_load_explicit(&profile, memory_order_relaxed);
+	TerrainGenProfile chunk_profile = {0};
+
+	generate_base(chunk, profiling, &chunk_profile);
+	decorate_chunk(chunk, batch, profiling, &chunk_profile);
+
+	if (profiling) {
+		atomic_fetch_add_explicit(&profile_totals.chunks, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&profile_totals.uniform_chunks, chunk_profile.uniform_chunks, memory_order_relaxed);
+
+		for (Biome i = 0; i < COUNT_BIOME; i++)
+			atomic_fetch_add_explicit(&profile_totals.biome_ns[i], chunk_profile.biome_ns[i], memory_order_relaxed);
+
+		for (int i = 0; i < NUM_TREES; i++) {
+			atomic_fetch_add_explicit(&profile_totals.tree_ns[i], chunk_profile.tree_ns[i], memory_order_relaxed);
+			atomic_fetch_add_explicit(&profile_totals.trees[i], chunk_profile.trees[i], memory_order_relaxed);
+		}
+	}
+}
+
+void terrain_gen_profile_enable(bool enable)
+{
+	atomic_store(&profile, enable);
+}
+
+TerrainGenProfile terrain_gen_profile()
+{
+	TerrainGenProfile totals;
+	totals.chunks = atomic_load(&profile_totals.chunks);
+	totals.uniform_chunks = atomic_load(&profile_totals.uniform_chunks);
+
+	for (Biome i = 0; i < COUNT_BIOME; i++)
+		totals.biome_ns[i] = atomic_load(&profile_totals.biome_ns[i]);
+
+	for (int i = 0; i < NUM_TREES; i++) {
+		totals.tree_ns[i] = atomic_load(&profile_totals.tree_ns[i]);
+		totals.trees[i] = atomic_load(&profile_totals.trees[i]);
+	}
+
+	return totals;
 }
@@ -2,9 +2,56 @@
 #define _TERRAIN_GEN_H_
 
 #include "common/terrain.h"
+#include "server/biomes.h"
+#include "server/gen_batch.h"
 #include "server/server_terrain.h"
+#include "server/tree.h"
+
+// 2D values of a column of nodes, shared by all chunks stacked on top of each other
+typedef struct {
+	Biome biome;
+	f64 factor;
+	s32 base_height;
+	s32 height;
+	f64 humidity;
+	f64 temperature; // without the height dependent part, see get_temperature_at
+	int tree;        // index into tree_def of the tree rooted one node above the surface, or -1
+	void *row_data;
+} ColumnInfo;
+
+typedef struct {
+	v2s32 pos; // x and z of the chunks in the column
+	ColumnInfo columns[CHUNK_SIZE][CHUNK_SIZE];
+	bool has_biome[COUNT_BIOME];
+	void *column_data[COUNT_BIOME];
+	unsigned char *row_data;
+} ColumnMap;
+
+// time spent in parts of terrain generation, only measured while profiling is enabled
+typedef struct {
+	u64 chunks;                // generated chunks
+	u64 uniform_chunks;        // chunks that were filled with a single node type
+	u64 biome_ns[COUNT_BIOME]; // generating nodes of each biome, without trees
+	u64 tree_ns[NUM_TREES];    // placing trees of each type
+	u64 trees[NUM_TREES];      // number of placed trees of each type, a tree is placed once for each chunk it reaches into
+} TerrainGenProfile;
 
 s32 terrain_gen_get_base_height(v2s32 pos);
-void terrain_gen_chunk(TerrainChunk *chunk, List *changed_chunks); // generate a chunk (does not manage chunk state or threading)
+void terrain_gen_column_ini(ColumnMap *map, v2s32 pos); // compute 2D values of a column of chunks
+void terrain_gen_column_dst(ColumnMap *map);
+/*
+	Chunk generation:
+	- the base terrain of the chunk is generated first, then it is decorated with trees
+	- trees only depend on the 2D values of the column they are rooted in, so the decoration pass places the parts of all trees
+	  of the surrounding columns that reach into the chunk, instead of writing into neighbouring chunks
+	- writes only ever go to the chunk itself, so generation never locks or creates other chunks
+	- trees are placed in a fixed order, so overlapping trees look the same in all chunks they reach into,
+	  and the result does not depend on the order in which chunks are generated
+*/
+
+// generate a chunk (does not manage chunk state or threading), the chunk has to be in batch
+void terrain_gen_chunk(TerrainChunk *chunk, GenBatch *batch);
+void terrain_gen_profile_enable(bool enable); // profiling adds a few clock reads per column of every generated chunk
+TerrainGenProfile terrain_gen_profile(); // totals since startup
 
 #endif // _TERRAIN_GEN_H_
@@ -5,18 +5,120 @@
 #include "server/tree.h"
 #include "server/voxel_procedural.h"
 
+// tree templates
+
 typedef struct {
+	v3s32 offset; // relative to the origin of the tree
 	NodeType type;
-	v3s32 root;
+	v3f32 color;
+} TreeVoxel;
+
+typedef struct {
+	Array voxels; // TreeVoxel, sorted by offset
+} TreeTemplate;
+
+// voxels of a template that is being baked
+typedef struct {
+	v3s32 origin;
+	Tree voxels; // TreeVoxel by offset
+} TreeBake;
+
+typedef struct {
+	NodeType type;
+	TreeBake *bake;
 } ProceduralTreeArg;
 
-static TerrainNode create_tree_node(__attribute__((unused)) v3s32 pos, v3f32 color, ProceduralTreeArg *arg)
+static int cmp_tree_voxel(const TreeVoxel *voxel, const v3s32 *offset)
+{
+	return v3s32_cmp(&voxel->offset, offset);
+}
+
+static void bake_tree_node(v3s32 pos, v3f32 color, ProceduralTreeArg *arg)
+{
+	v3s32 offset = v3s32_sub(pos, arg->bake->origin);
+	TreeVoxel *voxel = tree_get(&arg->bake->voxels, &offset, &cmp_tree_voxel, NULL);
+
+	if (!voxel) {
+		voxel = malloc(sizeof *voxel);
+		voxel->offset = offset;
+		tree_add(&arg->bake->voxels, &voxel->offset, voxel, &cmp_tree_voxel, NULL);
+	}
+
+	// later voxels replace earlier ones, like they would in the terrain
+	voxel->type = arg->type;
+	voxel->color = color;
+}
+
+static void move_tree_voxel(TreeVoxel *voxel, Array *voxels)
+{
+	array_apd(voxels, voxel);
+	free(voxel);
+}
+
+// bake all variants of a tree type and extend bounds by their voxels in any rotation
+// a variant only depends on the seed, the voxel procedural script draws its random numbers from its number
+// origin is the position of the origin of the tree relative to its root
+static void bake_templates(TreeTemplate *templates, void (*bake)(VoxelProcedural *proc, TreeBake *bake),
+	v3s32 origin, aabb3s32 *bounds)
+{
+	for (int variant = 0; variant < TREE_VARIANTS; variant++) {
+		TreeTemplate *template = &templates[variant];
+
+		TreeBake tree_bake;
+		tree_bake.origin = (v3s32) {variant, 0, 0};
+		tree_ini(&tree_bake.voxels);
+
+		VoxelProcedural *proc = voxel_procedural_create(tree_bake.origin);
+		bake(proc, &tree_bake);
+		voxel_procedural_delete(proc);
+
+		array_ini(&template->voxels, sizeof(TreeVoxel), 256);
+		tree_clr(&tree_bake.voxels, &move_tree_voxel, &template->voxels, NULL, TRAVERSION_INORDER);
+
+		for (size_t i = 0; i < template->voxels.siz; i++) {
+			v3s32 offset = v3s32_add(origin, ((TreeVoxel *) template->voxels.ptr)[i].offset);
+			s32 radius = abs(offset.x) > abs(offset.z) ? abs(offset.x) : abs(offset.z);
+
+			bounds->min.x = bounds->min.z = s32_min(bounds->min.x, -radius);
+			bounds->max.x = bounds->max.z = s32_max(bounds->max.x, +radius);
+			bounds->min.y = s32_min(bounds->min.y, offset.y);
+			bounds->max.y = s32_max(bounds->max.y, offset.y);
+		}
+	}
+}
+
+// rotate around the vertical axis in steps of 90 degrees
+static v3s32 rotate_offset(v3s32 offset, int rotation)
 {
-	return server_node_create_tree(arg->type, (TreeData) {
-		.color = color,
-		.has_root = 1,
-		.root = arg->root,
-	});
+	switch (rotation) {
+		case 1:  return (v3s32) {+offset.z, offset.y, -offset.x};
+		case 2:  return (v3s32) {-offset.x, offset.y, -offset.z};
+		case 3:  return (v3s32) {-offset.z, offset.y, +offset.x};
+		default: return offset;
+	}
+}
+
+// place a tree using one of the variants in templates, chosen by the position of the root
+static void place_tree(TreeTemplate *templates, v3s32 root, v3s32 origin, GenBatch *batch)
+{
+	f64 variant_noise = noise3d(root.x, root.y, root.z, 0, seed + OFFSET_TREE_VARIANT) * 0.5 + 0.5;
+	f64 rotation_noise = noise3d(root.x, root.y, root.z, 1, seed + OFFSET_TREE_VARIANT) * 0.5 + 0.5;
+
+	int variant = s32_clamp(variant_noise * TREE_VARIANTS, 0, TREE_VARIANTS - 1);
+	int rotation = s32_clamp(rotation_noise * 4.0, 0, 3);
+
+	TreeTemplate *template = &templates[variant];
+
+	for (size_t i = 0; i < template->voxels.siz; i++) {
+		TreeVoxel *voxel = &((TreeVoxel *) template->voxels.ptr)[i];
+
+		gen_batch_set_node(batch, v3s32_add(origin, rotate_offset(voxel->offset, rotation)),
+			server_node_create_tree(voxel->type, (TreeData) {
+				.color = voxel->color,
+				.has_root = 1,
+				.root = root,
+			}), STAGE_TREES);
+	}
 }
 
 // oak
@@ -26,14 +128,14 @@ static bool oak_condition(TreeArgsCondition *args)
 	return args->biome == BIOME_HILLS;
 }
 
-static void oak_tree_leaf(VoxelProcedural *proc, v3s32 root)
+static void oak_tree_leaf(VoxelProcedural *proc, TreeBake *bake)
 {
 	if (!voxel_procedural_is_alive(proc))
 		return;
 
 	voxel_procedural_push(proc);
-		voxel_procedural_cube(proc, (void *) &create_tree_node,
-			&(ProceduralTreeArg) {NODE_OAK_LEAVES, root});
+		voxel_procedural_cube(proc, (void *) &bake_tree_node,
+			&(ProceduralTreeArg) {NODE_OAK_LEAVES, bake});
 	voxel_procedural_pop(proc);
 
 	voxel_procedural_push(proc);
@@ -43,11 +145,11 @@ static void oak_tree_leaf(VoxelProcedural *proc, v3s32 root)
 		voxel_procedural_sz(proc, 0.8f);
 		voxel_procedural_ry(proc, 25.0f);
 		voxel_procedural_x(proc, 0.4f);
-		oak_tree_leaf(proc, root);
+		oak_tree_leaf(proc, bake);
 	voxel_procedural_pop(proc);
 }
 
-static void oak_tree_top(VoxelProcedural *proc, v3s32 root)
+static void oak_tree_top(VoxelProcedural *proc, TreeBake *bake)
 {
 	if (!voxel_procedural_is_alive(proc))
 		return;
@@ -64,13 +166,13 @@ static void oak_tree_top(VoxelProcedural *proc, v3s32 root)
 			voxel_procedural_sat(proc, 0.5f);
 			voxel_procedural_hue(proc, voxel_procedural_random(proc, 60.0f, 20.0f));
 			voxel_procedural_ry(proc, -45.0f);
-			oak_tree_leaf(proc, root);
+			oak_tree_leaf(proc, bake);
 		voxel_procedural_pop(proc);
 	}
 	voxel_procedural_pop(proc);
 }
 
-static void oak_tree_part(VoxelProcedural *proc, v3s32 root, f32 n)
+static void oak_tree_part(VoxelProcedural *proc, TreeBake *bake, f32 n)
 {
 	if (!voxel_procedural_is_alive(proc))
 		return;
@@ -85,23 +187,21 @@ static void oak_tree_part(VoxelProcedural *proc, v3s32 root, f32 n)
 			voxel_procedural_s(proc, 4.0f);
 			voxel_procedural_x(proc, 0.1f);
 			voxel_procedural_light(proc, voxel_procedural_random(proc, 0.0f, 0.1f));
-			voxel_procedural_cylinder(proc, (void *) &create_tree_node,
-				&(ProceduralTreeArg) {NODE_OAK_WOOD, root});
+			voxel_procedural_cylinder(proc, (void *) &bake_tree_node,
+				&(ProceduralTreeArg) {NODE_OAK_WOOD, bake});
 		voxel_procedural_pop(proc);
 
 		if (i == (int) (n - 2.0f)) {
 			voxel_procedural_push(proc);
-				oak_tree_top(proc, root);
+				oak_tree_top(proc, bake);
 			voxel_procedural_pop(proc);
 		}
 	}
 	voxel_procedural_pop(proc);
 }
 
-static void oak_tree(v3s32 root, List *changed_chunks)
+static void bake_oak_tree(VoxelProcedural *proc, TreeBake *bake)
 {
-	VoxelProcedural *proc = voxel_procedural_create(changed_chunks, STAGE_TREES, root);
-
 	voxel_procedural_hue(proc, 40.0f);
 	voxel_procedural_light(proc, -0.5f);
 	voxel_procedural_sat(proc, 0.5f);
@@ -114,12 +214,17 @@ static void oak_tree(v3s32 root, List *changed_chunks)
 		voxel_procedural_push(proc);
 			voxel_procedural_y(proc, 0.5f);
 			voxel_procedural_light(proc, voxel_procedural_random(proc, -0.3f, 0.05f));
-			oak_tree_part(proc, root, n);
+			oak_tree_part(proc, bake, n);
 		voxel_procedural_pop(proc);
 	}
 	voxel_procedural_pop(proc);
+}
 
-	voxel_procedural_delete(proc);
+static TreeTemplate oak_templates[TREE_VARIANTS];
+
+static void oak_tree(v3s32 root, GenBatch *batch)
+{
+	place_tree(oak_templates, root, root, batch);
 }
 
 // pine
@@ -129,7 +234,7 @@ static bool pine_condition(TreeArgsCondition *args)
 	return args->biome == BIOME_MOUNTAIN;
 }
 
-static void pine_tree(v3s32 pos, List *changed_chunks)
+static void pine_tree(v3s32 pos, GenBatch *batch)
 {
 	s32 tree_top = (noise2d(pos.x, pos.z, 0, seed + OFFSET_PINETREE_HEIGHT) * 0.5 + 0.5) * (35.0 - 20.0) + 20.0 + pos.y;
 	for (v3s32 tree_pos = pos; tree_pos.y < tree_top; tree_pos.y++) {
@@ -145,11 +250,11 @@ static void pine_tree(v3s32 pos, List *changed_chunks)
 		s32 dir = (noise3d(tree_pos.x, tree_pos.y, tree_pos.z, 0, seed + OFFSET_PINETREE_BRANCH_DIR) * 0.5 + 0.5) * 4.0;
 
 		for (v3s32 branch_pos = tree_pos; branch_length > 0; branch_length--, branch_pos = v3s32_add(branch_pos, dirs[dir]))
-			server_terrain_gen_node(branch_pos, server_node_create(NODE_PINE_WOOD),
-				STAGE_TREES, changed_chunks);
+			gen_batch_set_node(batch, branch_pos, server_node_create(NODE_PINE_WOOD),
+				STAGE_TREES);
 
-		server_terrain_gen_node(tree_pos, server_node_create(NODE_PINE_WOOD),
-			STAGE_TREES, changed_chunks);
+		gen_batch_set_node(batch, tree_pos, server_node_create(NODE_PINE_WOOD),
+			STAGE_TREES);
 	}
 }
 
@@ -162,27 +267,25 @@ static bool palm_condition(TreeArgsCondition *args)
 		&& ocean_get_node_at((v3s32) {args->pos.x, args->pos.y - 1, args->pos.z}, 0, args->row_data) == NODE_SAND;
 }
 
-static void palm_branch(VoxelProcedural *proc, v3s32 root)
+static void palm_branch(VoxelProcedural *proc, TreeBake *bake)
 {
 	if (!voxel_procedural_is_alive(proc))
 		return;
 
-	voxel_procedural_cube(proc, (void *) &create_tree_node,
-		&(ProceduralTreeArg) {NODE_PALM_LEAVES, root});
+	voxel_procedural_cube(proc, (void *) &bake_tree_node,
+		&(ProceduralTreeArg) {NODE_PALM_LEAVES, bake});
 
 	voxel_procedural_push(proc);
 		voxel_procedural_z(proc, 0.5f);
 		voxel_procedural_s(proc, 0.8f);
 		voxel_procedural_rx(proc, voxel_procedural_random(proc, 20.0f, 4.0f));
 		voxel_procedural_z(proc, 0.5f);
-		palm_branch(proc, root);
+		palm_branch(proc, bake);
 	voxel_procedural_pop(proc);
 }
 
-static void palm_tree(v3s32 root, List *changed_chunks)
+static void bake_palm_tree(VoxelProcedural *proc, TreeBake *bake)
 {
-	VoxelProcedural *proc = voxel_procedural_create(changed_chunks, STAGE_TREES, (v3s32) {root.x, root.y - 1, root.z});
-
 	f32 s = voxel_procedural_random(proc, 8.0f, 2.0f);
 
 	voxel_procedural_push(proc);
@@ -192,8 +295,8 @@ static void palm_tree(v3s32 root, List *changed_chunks)
 			voxel_procedural_s(proc, 1.0f);
 			voxel_procedural_light(proc, voxel_procedural_random(proc, -0.8f, 0.1f));
 			voxel_procedural_sat(proc, 0.5f);
-			voxel_procedural_cube(proc, (void *) &create_tree_node,
-				&(ProceduralTreeArg) {NODE_PALM_WOOD, root});
+			voxel_procedural_cube(proc, (void *) &bake_tree_node,
+				&(ProceduralTreeArg) {NODE_PALM_WOOD, bake});
 		voxel_procedural_pop(proc);
 	}
 	voxel_procedural_pop(proc);
@@ -211,12 +314,17 @@ static void palm_tree(v3s32 root, List *changed_chunks)
 			voxel_procedural_light(proc, voxel_procedural_random(proc, 0.0f, 0.3f));
 			voxel_procedural_rx(proc, 90.0f);
 			voxel_procedural_s(proc, 2.0f);
-			palm_branch(proc, root);
+			palm_branch(proc, bake);
 		voxel_procedural_pop(proc);
 	}
 	voxel_procedural_pop(proc);
+}
+
+static TreeTemplate palm_templates[TREE_VARIANTS];
 
-	voxel_procedural_delete(proc);
+static void palm_tree(v3s32 root, GenBatch *batch)
+{
+	place_tree(palm_templates, root, (v3s32) {root.x, root.y - 1, root.z}, batch);
 }
 
 TreeDef tree_def[NUM_TREES] = {
@@ -239,6 +347,8 @@ TreeDef tree_def[NUM_TREES] = {
 		.area_offset = OFFSET_PINETREE_AREA,
 		.condition = &pine_condition,
 		.generate = &pine_tree,
+		// branches are shorter than 3 nodes, the trunk is shorter than 35 nodes
+		.bounds = {{-2, 0, -2}, {+2, 34, +2}},
 	},
 	// palm
 	{
@@ -252,3 +362,9 @@ TreeDef tree_def[NUM_TREES] = {
 	},
 };
 
+
+void tree_init()
+{
+	bake_templates(oak_templates, &bake_oak_tree, (v3s32) {0, 0, 0}, &tree_def[0].bounds);
+	bake_templates(palm_templates, &bake_palm_tree, (v3s32) {0, -1, 0}, &tree_def[2].bounds);
+}
@@ -5,19 +5,21 @@
 #include <stdbool.h>
 #include "common/perlin.h"
 #include "common/terrain.h"
+#include "server/gen_batch.h"
 #include "types.h"
 
 #define NUM_TREES 3
+// number of different shapes of each tree type that uses a voxel procedural script
+#define TREE_VARIANTS 32
 
+// conditions only depend on the column, trees are rooted one node above its surface
 typedef struct {
 	v3s32 pos;
 	f64 humidity;
 	f64 temperature;
 	Biome biome;
 	f64 factor;
-	TerrainChunk *chunk;
 	void *row_data;
-	void *chunk_data;
 } TreeArgsCondition;
 
 typedef struct {
@@ -27,9 +29,13 @@ typedef struct {
 	SeedOffset offset;
 	SeedOffset area_offset;
 	bool (*condition)(TreeArgsCondition *args);
-	void (*generate)(v3s32 pos, List *changed_chunks);
+	void (*generate)(v3s32 pos, GenBatch *batch);
+	aabb3s32 bounds; // contains all nodes of any tree of this type, relative to its root
 } TreeDef;
 
 extern TreeDef tree_def[];
 
+// bake tree templates and compute their bounds, called on server startup before terrain generation starts
+void tree_init();
+
 #endif // _TREE_H_
@@ -1,60 +1,66 @@
 #include <assert.h>
 #include <dragonstd/array.h>
 #include <dragonstd/list.h>
-#include <dragonstd/tree.h>
-#include <errno.h>
 #include <stdbool.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <time.h>
+#include <string.h>
 #include "common/facedir.h"
 #include "server/server_node.h"
 #include "server/server_terrain.h"
 #include "server/tree_physics.h"
 #include "server/voxel_depth_search.h"
 
+// trees that are larger than this are never removed
+#define TREE_PHYSICS_SEARCH_BUDGET 65536
+
 typedef struct {
 	v3s32 root;
-	bool deadlock;
-	Tree chunks;
+	bool restart;
+	TerrainLockSet *locks;
 } CheckTreeArg;
 
 typedef struct {
-	TerrainChunk *chunk;
-	TerrainNode *node;
-	u32 *tgs;
-} CheckTreeSearchNodeMeta;
+	TerrainLockSet *locks;
+	List changed_chunks;
+} DestroyTreeArg;
 
-static inline bool is_tree_with_root(TerrainNode *node)
+static inline bool is_tree(NodeType type)
 {
-	switch (node->type) {
+	switch (type) {
 		NODES_TREE
-			return ((TreeData *) node->data)->has_root;
+			return true;
 
 		default:
 			return false;
 	}
 }
 
-static int cmp_chunk(const TerrainChunk *chunk, const v3s32 *pos)
+static inline bool is_tree_with_root(TerrainNode *node)
 {
-	return v3s32_cmp(&chunk->pos, pos);
-}
+	switch (node->type) {
+		NODES_TREE
+			return ((TreeData *) node->data)->has_root;
 
-static void unlock_chunk(TerrainChunk *chunk)
-{
-	pthread_rwlock_unlock(&chunk->lock);
+		default:
+			return false;
+	}
 }
 
 static void init_search_node(DepthSearchNode *search_node, CheckTreeArg *arg)
 {
+	// finish search directly if it has to be restarted anyway
+	if (arg->restart) {
+		search_node->type = DEPTH_SEARCH_TARGET;
+		return;
+	}
+
 	// first, get chunk position and offset
 	v3s32 chunkp = terrain_chunkp(search_node->pos);
+	v3s32 offset = terrain_offset(search_node->pos);
 
-	// check for chunk in cache
-	TerrainChunk *chunk = tree_get(&arg->chunks, &chunkp, &cmp_chunk, NULL);
+	// check whether chunk is already locked
+	TerrainChunk *chunk = terrain_lock_set_get(arg->locks, chunkp);
 
-	// if not found in cache, get it from server_terrain and lock it
+	// if not, get it from server_terrain and lock it
 	if (!chunk) {
 		chunk = terrain_get_chunk(server_terrain, chunkp, CHUNK_MODE_PASSIVE);
 
@@ -66,87 +72,60 @@ static void init_search_node(DepthSearchNode *search_node, CheckTreeArg *arg)
 			// done
 			return;
 		}
+	}
 
-		// try to obtain the chunk lock
-		int lock_err = pthread_rwlock_wrlock(&chunk->lock);
-
-		// a deadlock might occur because of the order the chunks are locked
-		if (lock_err == EDEADLK) {
-			// notify caller deadlock has occured
-			arg->deadlock = true;
-
-			// finish search directly
-			search_node->type = DEPTH_SEARCH_TARGET;
-
-			// done
-			return;
-		}
+	// lock chunk in order with the others (does nothing if it is already locked)
+	if (!terrain_lock_set_add(arg->locks, chunk)) {
+		// other chunks had to be unlocked for a moment, what has been found so far may be outdated
+		arg->restart = true;
 
-		// assert that no different error has occured while trying to obtain the lock
-		assert(lock_err == 0);
+		// finish search directly
+		search_node->type = DEPTH_SEARCH_TARGET;
 
-		// insert chunk into cache
-		tree_add(&arg->chunks, &chunk->pos, chunk, &cmp_chunk, NULL);
+		// done
+		return;
 	}
 
-	// get node offset
-	v3s32 offset = terrain_offset(search_node->pos);
-
 	// type coersion for easier access
 	TerrainChunkMeta *meta = chunk->extra;
 
-	// pointer to node and generation stage
-	TerrainNode *node = &chunk->data[offset.x][offset.y][offset.z];
-	u32 *tgs = &meta->tgsb.raw.nodes[offset.x][offset.y][offset.z];
+	// node and generation stage
+	TerrainNode node = terrain_chunk_get_node(chunk, offset);
+	TerrainGenStage tgs = gen_stage_get(&meta->tgsb, offset);
 
 	// type coersion for easier access
-	TreeData *data = node->data;
+	TreeData *data = (TreeData *) node.data;
 
 	// have we found terrain?
-	if (*tgs == STAGE_TERRAIN && node->type != NODE_AIR) {
+	if (tgs == STAGE_TERRAIN && node.type != NODE_AIR) {
 		// if we've reached the target, set search node type accordingly
 		search_node->type = DEPTH_SEARCH_TARGET;
-	} else if (is_tree_with_root(node) && v3s32_equals(arg->root, data->root)) {
+	} else if (is_tree_with_root(&node) && v3s32_equals(arg->root, data->root)) {
 		// if node is part of our tree, continue search
+		// its chunk stays in the lock set, so it can be found again if the node has to be removed
 		search_node->type = DEPTH_SEARCH_PATH;
-
-		// allocate meta storage
-		CheckTreeSearchNodeMeta *search_meta = search_node->extra = malloc(sizeof *search_meta);
-
-		// store chunk, node and stage pointer for later
-		search_meta->chunk = chunk;
-		search_meta->node = node;
-		search_meta->tgs = tgs;
 	} else {
 		// otherwise, this is a roadblock
 		search_node->type = DEPTH_SEARCH_BLOCK;
 	}
 }
 
-static void free_search_node(DepthSearchNode *node)
-{
-	if (node->extra)
-		free(node->extra);
-
-	free(node);
-}
-
-static void destroy_search_node(DepthSearchNode *node, List *changed_chunks)
+static void destroy_search_node(DepthSearchNode *node, DestroyTreeArg *arg)
 {
 	if (node->type == DEPTH_SEARCH_PATH && !(*node->success)) {
 		// this is a tree/leaves node without connection to ground
 
-		CheckTreeSearchNodeMeta *meta = node->extra;
+		TerrainChunk *chunk = terrain_lock_set_get(arg->locks, terrain_chunkp(node->pos));
+		TerrainChunkMeta *meta = chunk->extra;
+		v3s32 offset = terrain_offset(node->pos);
 
 		// overwrite node and generation stage
-		server_terrain_replace_node(meta->node, server_node_create(NODE_AIR));
-		*meta->tgs  = STAGE_PLAYER;
+		terrain_chunk_set_node(chunk, offset, server_node_create(NODE_AIR));
+		gen_stage_set(&meta->tgsb, offset, STAGE_PLAYER);
 
 		// flag chunk as changed
-		list_add(changed_chunks, meta->chunk, meta->chunk, &cmp_ref, NULL);
+		server_terrain_add_changed_chunk(&arg->changed_chunks, chunk);
 	}
-
-	free_search_node(node);
 }
 
 /*
@@ -154,27 +133,24 @@ static void destroy_search_node(DepthSearchNode *node, List *changed_chunks)
 	Destroy any tree parts without ground connection.
 
 	The advantage of grouping them together is that they can use the same search cache.
+
+	Returns false if the search has to be restarted because chunks were unlocked in between,
+		the lock set stays locked in that case and is released otherwise.
 */
-static bool check_tree(v3s32 root, Array *positions, Array *chunks)
+static bool check_tree(v3s32 root, Array *positions, TerrainLockSet *locks)
 {
 	CheckTreeArg arg;
 	// inform depth search callbacks about root of tree (to only match nodes that belong to it)
 	arg.root = root;
-	// output parameter to prevent deadlocks
-	arg.deadlock = false;
-	// cache chunks, to accelerate lookup and prevent locking them twice
-	tree_ini(&arg.chunks);
-
-	// add the chunks the starting points are in to the chunk cache
-	for (size_t i = 0; i < chunks->siz; i++) {
-		TerrainChunk *chunk = ((TerrainChunk **) chunks->ptr)[i];
-		tree_add(&arg.chunks, &chunk->pos, chunk, &cmp_chunk, NULL);
-	}
+	// output parameter, set if locks had to be reacquired
+	arg.restart = false;
+	// chunks are locked in order, this also makes sure they are not locked twice
+	arg.locks = locks;
 
 	// nodes that have been visited
 	// serves as search cache and contains all tree nodes, to remove them if no ground found
-	Tree visit;
-	tree_ini(&visit);
+	DepthSearch search;
+	voxel_depth_search_ini(&search, TREE_PHYSICS_SEARCH_BUDGET);
 
 	// success means ground has been found
 
@@ -188,40 +164,44 @@ static bool check_tree(v3s32 root, Array *positions, Array *chunks)
 		success_buf[i] = false;
 
 		// call depth search algorithm to collect positions and find ground
-		if (!voxel_depth_search(((v3s32 *) positions->ptr)[i], (void *) &init_search_node, &arg,
-				&success_buf[i], &visit))
+		if (!voxel_depth_search(&search, ((v3s32 *) positions->ptr)[i], (void *) &init_search_node, &arg,
+				&success_buf[i]))
 			success_all = false;
 
-		// immediately stop if there was a deadlock
-		if (arg.deadlock)
+		// immediately stop if the search has to be restarted
+		if (arg.restart)
 			break;
 	}
 
-	if (success_all || arg.deadlock) {
-		// ground has been found for all parts (or a deadlock was detected)
+	if (success_all || arg.restart) {
+		// ground has been found for all parts (or chunks were unlocked in between)
 
-		// if ground has been found for all, there is no need to pass more complex callback
-		tree_clr(&visit, &free_search_node, NULL, NULL, 0);
+		// if ground has been found for all, nothing has to be destroyed
+		voxel_depth_search_dst(&search);
 
-		// unlock grabbed chunks
-		tree_clr(&arg.chunks, &unlock_chunk, NULL, NULL, 0);
+		// caller will restart with the chunks still locked
+		if (arg.restart)
+			return false;
 
-		// return false if there was a deadlock - caller will reinitiate search
-		return !arg.deadlock;
+		// unlock grabbed chunks
+		terrain_lock_set_release(locks);
+		return true;
 	}
 
 	// keep track of changed chunks
-	List changed_chunks;
-	list_ini(&changed_chunks);
+	DestroyTreeArg destroy_arg;
+	destroy_arg.locks = locks;
+	list_ini(&destroy_arg.changed_chunks);
 
-	// some or all positions have no connection to ground, pass callback to destroy nodes without
-	tree_clr(&visit, &destroy_search_node, &changed_chunks, NULL, 0);
+	// some or all positions have no connection to ground, destroy nodes without
+	voxel_depth_search_iterate(&search, (void *) &destroy_search_node, &destroy_arg);
+	voxel_depth_search_dst(&search);
 
 	// now, unlock all the chunks (before sending some of them)
-	tree_clr(&arg.chunks, &unlock_chunk, NULL, NULL, 0);
+	terrain_lock_set_release(locks);
 
 	// send changed chunks
-	server_terrain_lock_and_send_chunks(&changed_chunks);
+	server_terrain_lock_and_send_chunks(&destroy_arg.changed_chunks);
 
 	// done
 	return true;
@@ -234,7 +214,7 @@ static bool check_tree(v3s32 root, Array *positions, Array *chunks)
 
 	- select neighbor nodes that are leaves or wood
 	- in every iteration, select only the nodes that belong to the same tree (have the same root)
-	- in every iteration, keep the chunks the selected nodes belong to locked
+	- in every iteration, keep the chunks the selected nodes belong to locked (in a lock set, to avoid deadlocks)
 	- skip nodes that don't match the currently selected root, process them in a later iteration
 */
 void tree_physics_check(v3s32 center)
@@ -242,21 +222,37 @@ void tree_physics_check(v3s32 center)
 	// remember directions that have been processed
 	bool dirs[6] = {false};
 
+	// read neighbor types at once so chunks only have to be locked for tree nodes
+	aabb3s32 box = {
+		v3s32_sub(center, (v3s32) {1, 1, 1}),
+		v3s32_add(center, (v3s32) {1, 1, 1}),
+	};
+	NodeType types[3 * 3 * 3];
+	terrain_read_box(server_terrain, box, types);
+
 	bool skipped;
 	do {
-		skipped = false;
+		// chunks of selected nodes and all chunks visited by the search stay locked until the tree has been checked
+		TerrainLockSet locks;
+		terrain_lock_set_ini(&locks);
+
+		// restart from here if chunks had to be unlocked in between
+		bool dirs_before[6];
+		memcpy(dirs_before, dirs, sizeof dirs);
 
 		// the first node that has a root will initialize these variables
-		bool selected_root = false;
+		bool selected_root;
 		v3s32 root;
 
-		// remember selected positions and their associated locked chunks
-		Array positions, chunks;
+		// remember selected positions
+		Array positions;
 		array_ini(&positions, sizeof(v3s32), 5);
-		array_ini(&chunks, sizeof(TerrainChunk *), 5);
 
-		// remember indices of positions selected in this iteration
-		bool selected[6] = {false};
+		restart:
+		skipped = false;
+		selected_root = false;
+		array_clr(&positions);
+		memcpy(dirs, dirs_before, sizeof dirs);
 
 		for (int i = 0; i < 6; i++) {
 			// we already processed this direction
@@ -269,27 +265,29 @@ void tree_physics_check(v3s32 center)
 			// facedir contains offsets to neighbor nodes
 			v3s32 pos = v3s32_add(center, facedir[i]);
 
-			// get chunk
-			v3s32 offset;
-			TerrainChunk *chunk = terrain_get_chunk_nodep(server_terrain, pos, &offset, CHUNK_MODE_PASSIVE);
-			if (!chunk)
+			// nothing to do for nodes that aren't part of a tree
+			if (!is_tree(types[terrain_box_index(box, pos)]))
 				continue;
 
-			// check if chunk is already locked
-			bool locked_before = array_idx(&chunks, &chunk) != -1;
+			// get chunk, looking it up only if it's not locked already
+			v3s32 offset = terrain_offset(pos);
+			TerrainChunk *chunk = terrain_lock_set_get(&locks, terrain_chunkp(pos));
+			if (!chunk)
+				chunk = terrain_get_chunk(server_terrain, terrain_chunkp(pos), CHUNK_MODE_PASSIVE);
+			if (!chunk)
+				continue;
 
-			// lock if not locked
-			// fixme: a deadlock can happen here lol
-			if (!locked_before)
-				assert(pthread_rwlock_wrlock(&chunk->lock) == 0);
+			// lock chunk in order with the others, start over if that meant unlocking some of them
+			if (!terrain_lock_set_add(&locks, chunk))
+				goto restart;
 
 			// now that chunk is locked, actually get node
-			TerrainNode *node = &chunk->data[offset.x][offset.y][offset.z];
+			TerrainNode node = terrain_chunk_get_node(chunk, offset);
 
 			// check whether we're dealing with a tree node that has a root
-			if (is_tree_with_root(node)) {
+			if (is_tree_with_root(&node)) {
 				// type coersion for easier access
-				TreeData *data = node->data;
+				TreeData *data = (TreeData *) node.data;
 
 				// select root and initialize variables
 				if (!selected_root) {
@@ -301,47 +299,22 @@ void tree_physics_check(v3s32 center)
 				if (v3s32_equals(root, data->root)) {
 					// remember position
 					array_apd(&positions, &pos);
-
-					// remember chunk - unless it's already on the list
-					if (!locked_before)
-						array_apd(&chunks, &chunk);
-
-					// remember index was selected
-					selected[i] = true;
-
-					// don't run rest of loop body to not unlock chunk
-					continue;
 				} else {
 					// if it doesn't match selected root, mark as skipped
 					skipped = true;
 					dirs[i] = false;
 				}
 			}
-
-			// only unlock if it wasn't locked before
-			if (!locked_before)
-				pthread_rwlock_unlock(&chunk->lock);
 		}
 
-		if (selected_root) {
-			// run depth search
-			if (!check_tree(root, &positions, &chunks)) {
-				// a return value of false means a deadlock occured (should be very rare)
-				fprintf(stderr, "[verbose] tree_physics detected deadlock (this not an issue, but should not happen frequently)\n");
-
-				// sleep for 50ms to hopefully resolve the conflict
-				nanosleep(&(struct timespec) {0, 50e6}, NULL);
+		if (!selected_root)
+			terrain_lock_set_release(&locks);
+		// run depth search, start over if chunks were unlocked in the meantime
+		else if (!check_tree(root, &positions, &locks))
+			goto restart;
 
-				// invalidate faces that were selected in this iteration
-				for (int i = 0; i < 6; i++)
-					if (selected[i])
-						dirs[i] = false;
-			}
-
-			// free memory
-			array_clr(&positions);
-			array_clr(&chunks);
-		}
+		// free memory
+		array_clr(&positions);
 
 	// repeat until all directions have been processed
 	} while (skipped);
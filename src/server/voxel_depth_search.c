@@ -1,7 +1,16 @@
 #include <stdlib.h>
 #include "server/voxel_depth_search.h"
 
-v3s32 dirs[6] = {
+#define SLOTS_INITIAL_SIZE 256
+#define BLOCK_NODES 256
+
+struct DepthSearchBlock {
+	DepthSearchBlock *next;
+	size_t used;
+	DepthSearchNode nodes[BLOCK_NODES];
+};
+
+static v3s32 dirs[6] = {
 	{+0, -1, +0}, // this is commonly used to find ground, search downwards first
 	{-1, +0, +0},
 	{+0, +0, -1},
@@ -10,29 +19,128 @@ v3s32 dirs[6] = {
 	{+0, +1, +0},
 };
 
-static int cmp_depth_search_node(const DepthSearchNode *node, const v3s32 *pos)
+static inline u64 hash_pos(v3s32 pos)
+{
+	u64 key = (u64) (pos.x & 0x1FFFFF) << 42 | (u64) (pos.y & 0x1FFFFF) << 21 | (u64) (pos.z & 0x1FFFFF);
+	key *= 0x9E3779B97F4A7C15; // fibonacci hashing
+	return key ^ (key >> 32);
+}
+
+// returns the slot of the node at pos, or the empty slot it would go into
+static DepthSearchNode **find_slot(DepthSearchNode **slots, size_t mask, v3s32 pos)
 {
-	return v3s32_cmp(&node->pos, pos);
+	for (size_t i = hash_pos(pos) & mask;; i = (i + 1) & mask)
+		if (!slots[i] || v3s32_equals(slots[i]->pos, pos))
+			return &slots[i];
 }
 
-bool voxel_depth_search(v3s32 pos, void (*callback)(DepthSearchNode *node, void *arg), void *arg, bool *success, Tree *visit)
+static void grow_slots(DepthSearch *search)
 {
-	TreeNode **tree_node = tree_nfd(visit, &pos, &cmp_depth_search_node);
-	if (*tree_node)
-		return *success = *((DepthSearchNode *) (*tree_node)->dat)->success;
+	size_t mask = search->mask * 2 + 1;
+	DepthSearchNode **slots = calloc(mask + 1, sizeof *slots);
+
+	for (size_t i = 0; i <= search->mask; i++)
+		if (search->slots[i])
+			*find_slot(slots, mask, search->slots[i]->pos) = search->slots[i];
 
-	DepthSearchNode *node = malloc(sizeof *node);
-	tree_nmk(visit, tree_node, node);
-	node->pos = pos;
-	node->extra = NULL;
-	callback(node, arg);
-	if ((*(node->success = success) = (node->type == DEPTH_SEARCH_TARGET)))
-		return true;
+	free(search->slots);
+	search->slots = slots;
+	search->mask = mask;
+}
+
+static DepthSearchNode *alloc_node(DepthSearch *search)
+{
+	if (!search->blocks || search->blocks->used == BLOCK_NODES) {
+		DepthSearchBlock *block = malloc(sizeof *block);
+		block->next = search->blocks;
+		block->used = 0;
+		search->blocks = block;
+	}
 
-	if (node->type == DEPTH_SEARCH_PATH)
-		for (int i = 0; i < 6; i++)
-			if (voxel_depth_search(v3s32_add(pos, dirs[i]), callback, arg, success, visit))
-				return true;
+	return &search->blocks->nodes[search->blocks->used++];
+}
+
+// public functions
+
+void voxel_depth_search_ini(DepthSearch *search, size_t budget)
+{
+	search->budget = budget;
+	search->slots = calloc(SLOTS_INITIAL_SIZE, sizeof *search->slots);
+	search->mask = SLOTS_INITIAL_SIZE - 1;
+	search->num_nodes = 0;
+	search->blocks = NULL;
+	array_ini(&search->stack, sizeof(v3s32), 64);
+}
+
+void voxel_depth_search_dst(DepthSearch *search)
+{
+	while (search->blocks) {
+		DepthSearchBlock *next = search->blocks->next;
+		free(search->blocks);
+		search->blocks = next;
+	}
+
+	free(search->slots);
+	array_clr(&search->stack);
+}
+
+bool voxel_depth_search(DepthSearch *search, v3s32 pos, void (*callback)(DepthSearchNode *node, void *arg), void *arg, bool *success)
+{
+	size_t visited = 0;
+
+	*success = false;
+	search->stack.siz = 0;
+	array_apd(&search->stack, &pos);
+
+	while (search->stack.siz > 0) {
+		pos = ((v3s32 *) search->stack.ptr)[--search->stack.siz];
+
+		DepthSearchNode **slot = find_slot(search->slots, search->mask, pos);
+
+		if (*slot) {
+			DepthSearchNode *node = *slot;
+
+			// nodes of this search have been handled already, nodes of earlier searches tell their result
+			if (node->success != success && node->type != DEPTH_SEARCH_BLOCK && *node->success)
+				return *success = true;
+
+			continue;
+		}
+
+		// give up, the caller has to assume a connection
+		if (search->budget && visited == search->budget)
+			return *success = true;
+
+		DepthSearchNode *node = alloc_node(search);
+		node->pos = pos;
+		node->success = success;
+		node->extra = NULL;
+
+		*slot = node;
+		visited++;
+
+		if (++search->num_nodes * 2 > search->mask)
+			grow_slots(search);
+
+		callback(node, arg);
+
+		if (node->type == DEPTH_SEARCH_TARGET)
+			return *success = true;
+
+		// push in reverse, so the first direction is visited first
+		if (node->type == DEPTH_SEARCH_PATH)
+			for (int i = 5; i >= 0; i--) {
+				v3s32 next = v3s32_add(pos, dirs[i]);
+				array_apd(&search->stack, &next);
+			}
+	}
 
 	return false;
 }
+
+void voxel_depth_search_iterate(DepthSearch *search, void (*func)(DepthSearchNode *node, void *arg), void *arg)
+{
+	for (DepthSearchBlock *block = search->blocks; block; block = block->next)
+		for (size_t i = 0; i < block->used; i++)
+			func(&block->nodes[i], arg);
+}
@@ -1,7 +1,7 @@
 #ifndef _VOXEL_DEPTH_SEARCH_
 #define _VOXEL_DEPTH_SEARCH_
 
-#include <dragonstd/tree.h>
+#include <dragonstd/array.h>
 #include <stdbool.h>
 #include "types.h"
 
@@ -18,6 +18,34 @@ typedef struct {
 	void *extra;
 } DepthSearchNode;
 
-bool voxel_depth_search(v3s32 pos, void (*callback)(DepthSearchNode *node, void *arg), void *arg, bool *success, Tree *visit);
+typedef struct DepthSearchBlock DepthSearchBlock;
+
+typedef struct {
+	size_t budget;            // maximum number of nodes visited by a single search, 0 for no limit
+	DepthSearchNode **slots;  // visited nodes, open addressing hash table using linear probing
+	size_t mask;              // number of slots minus one
+	size_t num_nodes;         // number of visited nodes
+	DepthSearchBlock *blocks; // nodes are allocated from here
+	Array stack;              // v3s32, positions waiting to be visited
+} DepthSearch;
+
+/*
+	Voxel depth search:
+	- searches from a position for a node of type target, moving only through nodes of type path
+	- callback is called exactly once for every visited position and has to set the node type
+	- nodes are remembered by the DepthSearch, multiple searches using the same DepthSearch share them:
+	  reaching a path or target node found by an earlier successful search counts as success
+	- the search is iterative and nodes are allocated in blocks, so deep or large searches are cheap
+	- a search that visits more than budget nodes gives up and reports success, like for parts of the terrain
+	  that can't be checked, so callers have to treat success as "may be connected"
+	- node pointers stay valid until voxel_depth_search_dst
+*/
+
+void voxel_depth_search_ini(DepthSearch *search, size_t budget);
+void voxel_depth_search_dst(DepthSearch *search);
+// returns *success, which is set to whether the target has been reached from pos
+bool voxel_depth_search(DepthSearch *search, v3s32 pos, void (*callback)(DepthSearchNode *node, void *arg), void *arg, bool *success);
+// call func for all nodes visited so far
+void voxel_depth_search_iterate(DepthSearch *search, void (*func)(DepthSearchNode *node, void *arg), void *arg);
 
 #endif // _VOXEL_DEPTH_SEARCH_
@@ -31,12 +31,10 @@ static VoxelProceduralState *create_state(VoxelProceduralState *old)
 	return state;
 }
 
-VoxelProcedural *voxel_procedural_create(List *changed_chunks, TerrainGenStage tgs, v3s32 pos)
+VoxelProcedural *voxel_procedural_create(v3s32 pos)
 {
 	VoxelProcedural *proc = malloc(sizeof(VoxelProcedural));
 
-	proc->changed_chunks = changed_chunks;
-	proc->tgs = tgs;
 	proc->pos = pos;
 	proc->random = 0;
 
@@ -227,8 +225,7 @@ void voxel_procedural_cube(VoxelProcedural *proc, VoxelProceduralNode func, void
 		}
 
 		v3s32 pos = v3s32_add(proc->pos, (v3s32) {v[0], v[2], v[1]});
-		server_terrain_gen_node(pos, func(pos, color, arg),
-			proc->tgs, proc->changed_chunks);
+		func(pos, color, arg);
 	}
 }
 
@@ -3,10 +3,10 @@
 
 #include <dragonstd/list.h>
 #include <linmath.h>
-#include "server/server_terrain.h"
 #include "types.h"
 
 // Note: This is a close reimplementation of goxel procedural scripting capabilities
+// it only computes shapes, func is called for every voxel of a shape and decides what to do with it
 
 typedef struct {
 	vec4 pos;
@@ -18,15 +18,13 @@ typedef struct {
 
 typedef struct {
 	v3s32 pos;
-	List *changed_chunks;
-	TerrainGenStage tgs;
 	s32 random;
 	List state;
 } VoxelProcedural;
 
-typedef TerrainNode (*VoxelProceduralNode)(v3s32 pos, v3f32 color, void *arg);
+typedef void (*VoxelProceduralNode)(v3s32 pos, v3f32 color, void *arg);
 
-VoxelProcedural *voxel_procedural_create(List *changed_chunks, TerrainGenStage tgs, v3s32 pos);
+VoxelProcedural *voxel_procedural_create(v3s32 pos);
 void voxel_procedural_delete(VoxelProcedural *proc);
 void voxel_procedural_hue(VoxelProcedural *proc, f32 value);
 void voxel_procedural_sat(VoxelProcedural *proc, f32 value);